@@ -1,10 +1,15 @@
+#include <fcntl.h>
 #include <fstream>
+#include <getopt.h>
+#include <set>
 #include <sstream>
 #include <omp.h>
 #include "feature_min.h"
 #include "util.h"
 #include "database.h"
 #include "classifier.h"
+#include "serve.h"
+#include "stream.h"
 #include "bitmap.h"
 #include "tx.h"
 #include "setcmp.h"
@@ -22,31 +27,195 @@ using std::cout;
 using std::begin;
 using std::end;
 
+namespace {
+struct ClassifySample {
+    std::string name_, fq1_, fq2_; // fq2_ is empty for single-end samples.
+};
+
+// Reads a manifest of samples, one per line: <name> <r1.fq> [<r2.fq>]. Blank lines and lines starting with # are skipped.
+std::vector<ClassifySample> read_manifest(const char *path) {
+    std::ifstream ifs(path);
+    if(!ifs) throw file_open_error(path);
+    std::vector<ClassifySample> ret;
+    std::set<std::string> names;
+    for(std::string line; std::getline(ifs, line);) {
+        std::istringstream is(line);
+        ClassifySample sample;
+        if(!(is >> sample.name_) || sample.name_[0] == '#') continue;
+        if(!(is >> sample.fq1_)) LOG_EXIT("Manifest line for sample %s lists no reads.\n", sample.name_.data());
+        is >> sample.fq2_;
+        if(!names.insert(sample.name_).second) LOG_EXIT("Sample %s is listed twice in the manifest.\n", sample.name_.data());
+        ret.push_back(std::move(sample));
+    }
+    if(ret.empty()) LOG_EXIT("Manifest %s lists no samples.\n", path);
+    return ret;
+}
+
+// Points c at the lookup tables the database has, rather than its hash table, unless use_khash is set and they are exact.
+template<typename ScoreType>
+void use_tables(ClassifierGeneric<ScoreType> &c, const Database<khash_t(c)> &db, bool use_khash, bool use_filter) {
+    if(!use_khash && !db.ct_.empty()) {
+        LOG_INFO("Using compact lookup table with %zu keys and %u-bit values.\n", size_t(db.ct_.size()), db.ct_.value_bits());
+        c.set_table(&db.ct_);
+    }
+    if(!db.cht_.empty()) {
+        if(use_khash) LOG_WARNING("-H is ignored: the database only has a probabilistic compact hash table.\n");
+        LOG_INFO("Using probabilistic compact hash table with %zu keys.\n", size_t(db.cht_.size()));
+        c.set_table(&db.cht_);
+    }
+    if(!db.mbt_.empty()) {
+        if(use_khash) LOG_WARNING("-H is ignored: the database only has a minimizer-binned table.\n");
+        LOG_INFO("Using minimizer-binned table with %zu keys in %zu bins of %u-mer minimizers.\n",
+                 size_t(db.mbt_.size()), size_t(db.mbt_.nbins()), db.mbt_.l());
+        c.set_table(&db.mbt_);
+    }
+    if(use_filter && !db.bf_.empty() && db.mbt_.empty()) {
+        LOG_INFO("Using %zu-byte Bloom filter.\n", db.bf_.nbytes());
+        c.set_filter(&db.bf_);
+    }
+}
+
+struct ClassifyDatabase {
+    std::string db_, tax_, out_; // With a manifest, out_ is a prefix, as for -o.
+};
+
+// Parses <dbpath>,<tax_path>,<out> as given to classify -d.
+ClassifyDatabase parse_database(const char *arg) {
+    ClassifyDatabase ret;
+    std::istringstream is(arg);
+    if(!std::getline(is, ret.db_, ',') || !std::getline(is, ret.tax_, ',') || !std::getline(is, ret.out_) ||
+       ret.db_.empty() || ret.tax_.empty() || ret.out_.empty() || ret.out_.find(',') != std::string::npos)
+        LOG_EXIT("-d takes <dbpath>,<tax_path>,<out>, not %s.\n", arg);
+    return ret;
+}
+
+struct ClassifyExtraction {
+    std::vector<tax_t> taxids_;
+    bool               unclassified_ = false;
+    std::string        out_; // With a manifest, a prefix, as for -o.
+};
+
+// Parses <taxid>[,<taxid>...]:<out> as given to classify -e, where taxid U stands for unclassified reads.
+ClassifyExtraction parse_extraction(const char *arg) {
+    ClassifyExtraction ret;
+    const char *colon(std::strchr(arg, ':'));
+    if(colon == nullptr || colon == arg || colon[1] == '\0') LOG_EXIT("-e takes <taxid>[,<taxid>...]:<out>, not %s.\n", arg);
+    ret.out_ = colon + 1;
+    std::istringstream is(std::string(arg, colon));
+    for(std::string field; std::getline(is, field, ',');) {
+        if(field == "U") {
+            ret.unclassified_ = true;
+            continue;
+        }
+        char *end;
+        const unsigned long taxid(std::strtoul(field.data(), &end, 10));
+        if(field.empty() || *end) LOG_EXIT("-e: %s is neither a taxid nor U.\n", field.data());
+        ret.taxids_.push_back(taxid);
+    }
+    return ret;
+}
+
+std::FILE *open_output(const std::string &path) {
+    std::FILE *fp(path == "-" ? stdout: std::fopen(path.data(), "w"));
+    if(fp == nullptr) throw file_open_error(path);
+    return fp;
+}
+} // anonymous namespace
+
 int classify_main(int argc, char *argv[]) {
-    int co, num_threads(1), emit_kraken(1), emit_fastq(0), emit_all(0), chunk_size(1 << 20), per_set(32);
-    bool canonicalize(true);
+    int co, num_threads(1), emit_kraken(1), emit_fastq(0), emit_all(0), chunk_size(-1), decompress_threads(-1);
+    bool canonicalize(true), use_khash(false), use_filter(true), prefetch_khash(false), long_reads(false), emit_binary(false);
+    unsigned window(0), cache_bits(0), min_quality(0), dust_threshold(0);
+    unsigned batch_reads(STREAM_DEFAULT_BATCH_READS), batch_ms(STREAM_DEFAULT_BATCH_MS);
+    bool stream(false);
+    double host_fraction(HOST_DEFAULT_FRACTION);
+    const char *host_path(nullptr), *out_path(nullptr), *host_out_path(nullptr), *report_path(nullptr), *manifest_path(nullptr);
+    std::vector<ClassifyDatabase> databases;
+    std::vector<ClassifyExtraction> extractions;
     std::ios_base::sync_with_stdio(false);
-    std::FILE *ofp(stdout);
+    static const option long_options[] {
+        {"report",   required_argument, nullptr, 'r'},
+        {"database", required_argument, nullptr, 'd'},
+        {"extract",  required_argument, nullptr, 'e'},
+        {"binary",   no_argument,       nullptr, 'y'},
+        {"manifest", required_argument, nullptr, 'M'},
+        {"stream",   no_argument,       nullptr, 's'},
+        {nullptr, 0, nullptr, 0}
+    };
     if(argc < 4) {
         usage:
         std::fprintf(stderr, "Usage:\n%s <dbpath> <tax_path> <inr1.fq> [Optional: <inr2.fq>]\n"
+                             "       %s -M <manifest> <dbpath> <tax_path>\n"
                              "Flags:\n-o:\tRedirect output to path instead of stdout.\n"
-                             "-c:\tSet chunk size. Default: %i\n"
+                             "-c:\tSet chunk size: the number of bases read at a time. [%i, or %i with -L]\n"
                              "-a:\tEmit all records, not just classified.\n"
                              "-p:\tSet number of threads. [1] (Set -1 to use all threads.)\n"
                              "-k:\tEmit kraken-style output.\n"
                              "-K:\tDo not emit kraken-style output.\n"
                              "-f:\tEmit fastq-style output.\n"
                              "-K:\tDo not emit fastq-formatted output.\n"
+                             "-H:\tLook up k-mers in the hash table even if the database has a compact lookup table.\n"
+                             "-B:\tDo not consult the database's Bloom filter before lookups.\n"
+                             "-P:\tPrefetch hash table buckets. Whether this helps depends on the machine; check with classify_bench.\n"
+                             "-Z:\tSet number of threads for decompressing BGZF or multi-frame zstd input. [Same as -p]\n"
+                             "-L:\tLong-read mode: list hits per taxon, most frequent first, instead of every run of hits.\n"
+                             "-W:\tAlso report the taxon assigned to each window of <arg> k-mers\n"
+                             "   \t(minimizer windows, for a windowed database), e.g., to find chimeric reads.\n"
+                             "-R:\tCache lookups in 2^<arg> entries of 16 bytes per thread (e.g., 16), which pays off when reads repeat k-mers,\n"
+                             "   \tas in amplicon or high-coverage data. The hit rate is logged at the end. [0: off]\n"
+                             "-q:\tMask bases with Phred quality below <arg> (e.g., 10) before taking k-mers. [0: off]\n"
+                             "-D:\tMask low-complexity windows of 64 bases whose DUST score exceeds <arg> (e.g., 20). [0: off]\n"
+                             "   \tMasked k-mers are not looked up, and are counted as ambiguous (A:).\n"
+                             "-x:\tScreen out reads from the host before classifying them, with a filter built by `bonsai hostfilter`.\n"
+                             "   \tThe host fraction and the time saved are logged at the end.\n"
+                             "-X:\tFraction of a read's k-mers the host filter must contain for it to be screened out. [%0.2lf]\n"
+                             "-O:\tWrite reads screened out as host to path, as FASTA/FASTQ, pairs interleaved. [Default: drop them]\n"
+                             "-r/--report:\tOnly count reads per taxon, and write a kraken-report style clade report to path (- for stdout)\n"
+                             "   \tinstead of a record per read.\n"
+                             "-y/--binary:\tWrite compact binary records instead of kraken-style text. classify_decode converts them back.\n"
+                             "-M/--manifest:\tClassify each sample listed in <arg>, one per line as <name> <r1.fq> [<r2.fq>], loading the\n"
+                             "   \tdatabase once. -o, -O and --report then give path prefixes, to which each sample's name and\n"
+                             "   \t.out, .host or .report are appended. [-o default: ./]\n"
+                             "-s/--stream:\tClassify single-end reads from <inr1.fq> (- for stdin, or a named pipe) as they arrive, in batches\n"
+                             "   \tof up to -N reads, each waiting at most -T ms for its reads and written out at once.\n"
+                             "-d/--database:\tAlso classify against the database at <dbpath>, with the taxonomy at <tax_path>, given as\n"
+                             "   \t<dbpath>,<tax_path>,<out>, writing its records (or report, with --report) to <out>. Reads are encoded once\n"
+                             "   \tand looked up in every database. Its k, spacing and minimizer scoring must match <dbpath>'s; w may differ.\n"
+                             "   \tMay be repeated. With -M, <out> is a prefix, as for -o.\n"
+                             "-e/--extract:\tAlso write reads assigned a taxon under any of the taxids given as <taxid>[,<taxid>...]:<out>\n"
+                             "   \t(U for unclassified reads) to <out>, as FASTA/FASTQ, pairs interleaved. May be repeated, each with its own\n"
+                             "   \toutput. With -M, <out> is a prefix, to which each sample's name and .reads are appended.\n"
+                             "-N:\tReads per batch in stream mode. [%u]\n"
+                             "-T:\tMaximum time in ms a batch waits for reads in stream mode. [%u]\n"
                              "\nIf -f and -k are set, full kraken output will be contained in the fastq comment field."
                              "\n  Default: kraken-style only output.\n",
-                 *argv, 1 << 14);
+                 *argv, *argv, CLASSIFY_CHUNK_BASES, CLASSIFY_LONG_READ_CHUNK_BASES, HOST_DEFAULT_FRACTION,
+                 STREAM_DEFAULT_BATCH_READS, STREAM_DEFAULT_BATCH_MS);
         std::exit(EXIT_FAILURE);
     }
-    while((co = getopt(argc, argv, "Cc:p:o:S:afFkKh?")) >= 0) {
+    while((co = getopt_long(argc, argv, "Cc:d:e:p:o:q:r:x:X:O:D:M:N:R:S:T:W:Z:afFkKBHLPsyh?", long_options, nullptr)) >= 0) {
         switch(co) {
             case 'h': case '?': goto usage;
             case 'C': canonicalize = false; break;
+            case 'H': use_khash = true; break;
+            case 'B': use_filter = false; break;
+            case 'P': prefetch_khash = true; break;
+            case 'L': long_reads = true; break;
+            case 'y': emit_binary = true; break;
+            case 'W': window = std::strtoul(optarg, nullptr, 10); break;
+            case 'R': cache_bits = std::strtoul(optarg, nullptr, 10); break;
+            case 'q': min_quality = std::strtoul(optarg, nullptr, 10); break;
+            case 'D': dust_threshold = std::strtoul(optarg, nullptr, 10); break;
+            case 'r': report_path = optarg; break;
+            case 'd': databases.push_back(parse_database(optarg)); break;
+            case 'e': extractions.push_back(parse_extraction(optarg)); break;
+            case 'M': manifest_path = optarg; break;
+            case 's': stream = true; break;
+            case 'N': batch_reads = std::strtoul(optarg, nullptr, 10); break;
+            case 'T': batch_ms = std::strtoul(optarg, nullptr, 10); break;
+            case 'x': host_path = optarg; break;
+            case 'X': host_fraction = std::atof(optarg); break;
+            case 'O': host_out_path = optarg; break;
             case 'a': emit_all = 1; break;
             case 'c': chunk_size = std::atoi(optarg); break;
             case 'F': emit_fastq  = 0; break;
@@ -54,28 +223,132 @@ int classify_main(int argc, char *argv[]) {
             case 'K': emit_kraken = 0; break;
             case 'k': emit_kraken = 1; break;
             case 'p': num_threads = std::atoi(optarg); break;
-            case 'o': ofp = std::fopen(optarg, "w"); break;
-            case 'S': per_set = std::atoi(optarg); break;
+            case 'o': out_path = optarg; break;
+            case 'S': LOG_WARNING("-S is ignored: reads are now divided between threads by number of bases.\n"); break;
+            case 'Z': decompress_threads = std::atoi(optarg); break;
         }
     }
-    LOG_ASSERT(ofp);
-    switch(argc - optind) {
-        default: goto usage;
-        case 3:  LOG_DEBUG("Processing in single-end mode.\n"); break;
-        case 4:  LOG_DEBUG("Processing in paired-end mode.\n"); break;
+    std::vector<ClassifySample> samples;
+    if(manifest_path) {
+        if(argc - optind != 2) goto usage;
+        samples = read_manifest(manifest_path);
+        LOG_INFO("Classifying %zu samples listed in %s.\n", samples.size(), manifest_path);
+    } else {
+        switch(argc - optind) {
+            default: goto usage;
+            case 3:  LOG_DEBUG("Processing in single-end mode.\n"); break;
+            case 4:  LOG_DEBUG("Processing in paired-end mode.\n"); break;
+        }
+        samples.push_back(ClassifySample{"", argv[optind + 2], argc - optind == 4 ? argv[optind + 3]: ""});
     }
+    if(host_out_path && host_path == nullptr) LOG_EXIT("-O requires a host filter (-x).\n");
+    if(stream && (manifest_path || argc - optind != 3)) LOG_EXIT("Stream mode (-s) takes a single input of single-end reads.\n");
+    if(stream && databases.size()) LOG_EXIT("Stream mode (-s) classifies against a single database.\n");
+    if(emit_binary && (emit_fastq || long_reads || window || report_path))
+        LOG_EXIT("Binary output (-y) lists runs of hits, and cannot be combined with -f, -L, -W or --report.\n");
     Database<khash_t(c)> db(argv[optind]);
-    //reportDB<khash_t(c)>(&db, stderr);
-    //for(auto &i: db._s) --i; // subtract by one since we'll re-subtract during construction.
-    ClassifierGeneric<score::Lex> c(db.db_, db.s_, db.k_, db.k_, num_threads,
-                                   emit_all, emit_fastq, emit_kraken, canonicalize);
-    khash_t(p) *taxmap(build_parent_map(argv[optind + 1]));
-    // We can use optind + 3 for both single-end and paired-end mode since the argument at
-    // index argc is null when argc - optind == 3.
-    process_dataset(c, taxmap, argv[optind + 2], argv[optind + 3],
-                    ofp, chunk_size, per_set);
-    if(ofp != stdout) std::fclose(ofp);
-    kh_destroy(p, taxmap);
+    std::unique_ptr<HostFilter> host(host_path ? new HostFilter(host_path): nullptr);
+    if(host) LOG_INFO("Screening for host reads with a %zu-byte filter of %" PRIu64 " %u-mers.\n", host->nbytes(), host->nkmers(), host->k());
+    if(chunk_size <= 0) chunk_size = long_reads ? CLASSIFY_LONG_READ_CHUNK_BASES: CLASSIFY_CHUNK_BASES;
+    auto load_taxonomy = [](const char *path) {
+        khash_t(p) *taxmap(build_parent_map(path));
+        std::unique_ptr<TaxonomyIndex> ret(new TaxonomyIndex(taxmap));
+        kh_destroy(p, taxmap);
+        return ret;
+    };
+    const std::unique_ptr<TaxonomyIndex> taxp(load_taxonomy(argv[optind + 1]));
+    const TaxonomyIndex &tax(*taxp);
+    std::vector<std::unique_ptr<Database<khash_t(c)>>> dbs;
+    std::vector<std::unique_ptr<TaxonomyIndex>> taxes;
+    for(const auto &database: databases) {
+        dbs.emplace_back(new Database<khash_t(c)>(database.db_.data()));
+        taxes.push_back(load_taxonomy(database.tax_.data()));
+    }
+    unsigned w(db.w_);
+    with_score_scheme(db.score_, db.k_, w, [&](auto scorer) {
+        using ScoreType = decltype(scorer);
+        // Every database is looked up with the same settings; masking and host screening apply to the reads, once.
+        auto configure = [&](ClassifierGeneric<ScoreType> &c, const Database<khash_t(c)> &db) {
+            use_tables(c, db, use_khash, use_filter);
+            c.set_prefetch_khash(prefetch_khash);
+            c.set_summarize_hits(long_reads);
+            c.set_window(window);
+            c.set_cache_bits(cache_bits);
+            c.set_report_only(report_path != nullptr);
+            c.set_emit_binary(emit_binary);
+        };
+        ClassifierGeneric<ScoreType> c(db.db_, db.s_, db.k_, w, num_threads,
+                                       emit_all, emit_fastq, emit_kraken, canonicalize);
+        configure(c, db);
+        c.set_min_quality(min_quality);
+        c.set_dust_threshold(dust_threshold);
+        c.set_host_filter(host.get(), host_fraction);
+        for(const auto &extraction: extractions) c.add_extraction(CladeSet(tax, extraction.taxids_, extraction.unclassified_));
+        std::vector<std::unique_ptr<ClassifierGeneric<ScoreType>>> others;
+        for(size_t i(0); i < dbs.size(); ++i) {
+            const Database<khash_t(c)> &odb(*dbs[i]);
+            unsigned ow(odb.w_);
+            bool same_score(false);
+            with_score_scheme(odb.score_, odb.k_, ow, [&](auto oscorer) {same_score = std::is_same<decltype(oscorer), ScoreType>::value;});
+            if(!same_score) LOG_EXIT("%s chose its minimizers by a different score than %s.\n", databases[i].db_.data(), argv[optind]);
+            others.emplace_back(new ClassifierGeneric<ScoreType>(odb.db_, odb.s_, odb.k_, ow, num_threads,
+                                                                 emit_all, emit_fastq, emit_kraken, canonicalize));
+            configure(*others.back(), odb);
+            c.add_database(*others.back(), *taxes[i]);
+        }
+        // The pool, per-thread buffers and chunks are set up once and kept for all samples.
+        ClassifyPipeline<ScoreType> pipeline(c);
+        for(const auto &sample: samples) {
+            // With a manifest, paths are prefixes to the sample name; otherwise, they are used as given.
+            auto path = [&](const char *arg, const char *suffix) {
+                return manifest_path ? std::string(arg) + sample.name_ + suffix: std::string(arg);
+            };
+            std::FILE *ofp(open_output(path(out_path ? out_path: manifest_path ? "./": "-", ".out"))),
+                      *host_ofp(host_out_path ? open_output(path(host_out_path, ".host")): nullptr),
+                      *report_ofp(report_path ? open_output(path(report_path, ".report")): nullptr);
+            std::vector<std::FILE *> database_ofps;
+            for(const auto &database: databases)
+                database_ofps.push_back(open_output(path(database.out_.data(), report_path ? ".report": ".out")));
+            std::vector<std::FILE *> extract_ofps;
+            for(const auto &extraction: extractions) extract_ofps.push_back(open_output(path(extraction.out_.data(), ".reads")));
+            if(manifest_path) {
+                c.reset_counts();
+                for(auto &other: others) other->reset_counts();
+            }
+            if(stream)
+                process_stream(pipeline, c, tax, sample.fq1_.data(), ofp, batch_reads, batch_ms, host_ofp, extract_ofps);
+            else
+                process_dataset(pipeline, c, tax, sample.fq1_.data(), sample.fq2_.empty() ? nullptr: sample.fq2_.data(),
+                                ofp, chunk_size, decompress_threads >= 0 ? decompress_threads
+                                                        : num_threads > 0 ? num_threads: int(std::thread::hardware_concurrency()),
+                                host_ofp, database_ofps, extract_ofps);
+            if(manifest_path)
+                LOG_INFO("Sample %s: classified %" PRIu64 " of %" PRIu64 " reads.\n", sample.name_.data(),
+                         c.n_classified(), c.n_classified() + c.n_unclassified());
+            if(host)
+                LOG_INFO("Screened out %" PRIu64 " of %" PRIu64 " reads as host (%0.2lf%%). Screening took %0.2lfs of thread time "
+                         "and classifying the rest %0.2lfs, so skipping host reads saved ~%0.2lfs.\n",
+                         c.n_host_reads(), c.n_screened_reads(), c.n_screened_reads() ? 100. * c.n_host_reads() / c.n_screened_reads(): 0.,
+                         c.screen_seconds(), c.classify_seconds(), c.host_seconds_saved());
+            if(report_ofp) c.write_report(tax, report_ofp);
+            for(size_t i(0); i < others.size(); ++i) {
+                LOG_INFO("%s: classified %" PRIu64 " of %" PRIu64 " reads.\n", databases[i].db_.data(),
+                         others[i]->n_classified(), others[i]->n_classified() + others[i]->n_unclassified());
+                if(report_ofp) others[i]->write_report(*taxes[i], database_ofps[i]);
+                if(database_ofps[i] != stdout) std::fclose(database_ofps[i]);
+            }
+            if(min_quality || dust_threshold)
+                LOG_INFO("Masked %" PRIu64 " bases for low quality and %" PRIu64 " for low complexity.\n",
+                         c.n_masked_low_quality(), c.n_masked_low_complexity());
+            if(cache_bits)
+                LOG_INFO("Lookup cache answered %" PRIu64 " of %" PRIu64 " lookups (%0.1lf%%).\n", c.n_cache_hits(), c.n_cache_lookups(),
+                         c.n_cache_lookups() ? 100. * c.n_cache_hits() / c.n_cache_lookups(): 0.);
+            for(std::FILE *fp: {ofp, host_ofp, report_ofp})
+                if(fp && fp != stdout) std::fclose(fp);
+            for(std::FILE *fp: extract_ofps)
+                if(fp != stdout) std::fclose(fp);
+        }
+    });
     LOG_INFO("Successfully completed classify!\n");
     return EXIT_SUCCESS;
 }
@@ -86,7 +359,9 @@ bool endswith(const std::string &path, const std::string &suf) {
 
 int phase2_main(int argc, char *argv[]) {
     int c, mode(score_scheme::LEX), wsz(-1), num_threads(1), k(31);
-    bool canon(true);
+    bool canon(true), write_mmap(false), write_table(false);
+    double bloom_bits(0.), compact_fpr(0.);
+    unsigned bin_l(0);
     WRITE write_fmt = UNCOMPRESSED;
     std::size_t start_size(1<<16);
     std::string spacing, tax_path, seq2taxpath, paths_file;
@@ -108,10 +383,18 @@ int phase2_main(int argc, char *argv[]) {
                      "-M: Set seq2taxpath.\n"
                      "-S: Set spacing.\n"
                      "-z: Write gzip-compressed.\n"
+                     "-m: Write memory-mappable database. classify maps it directly instead of reading it into memory.\n"
+                     "-c: With -m, also store a cache-line-compact lookup table, which classify uses instead of the hash table.\n"
+                     "-b: With -m, also store a Bloom filter of the k-mers with <arg> bits per k-mer (e.g., 10), which classify consults\n"
+                     "    before each lookup. This pays off when most k-mers looked up are absent, as in most metagenomes.\n"
+                     "-K: With -m, store a probabilistic compact hash table instead of the hash table, 3-4x smaller, which wrongly\n"
+                     "    reports an absent k-mer as present with probability at most <arg> (e.g., 1e-3). Incompatible with -c.\n"
+                     "-G: With -m, store the k-mers grouped into bins by their <arg>-mer minimizer (e.g., 15) instead of the hash table,\n"
+                     "    so that the overlapping k-mers of a read are looked up in the same few cache lines. Incompatible with -c and -K.\n"
                      , *argv);
         std::exit(EXIT_FAILURE);
     }
-    while((c = getopt(argc, argv, "Cw:M:S:p:k:T:F:tefHh?")) >= 0) {
+    while((c = getopt(argc, argv, "Cw:M:S:s:p:k:T:F:b:K:G:tefmczHh?")) >= 0) {
         switch(c) {
             case 'C': canon = false; break;
             case 'h': case '?': goto usage;
@@ -127,6 +410,11 @@ int phase2_main(int argc, char *argv[]) {
             case 'F': paths_file = optarg; break;
             case 'e': mode = score_scheme::ENTROPY; break;
             case 'z': write_fmt = ZLIB; break;
+            case 'm': write_mmap = true; break;
+            case 'c': write_table = true; break;
+            case 'b': bloom_bits = std::atof(optarg); break;
+            case 'K': compact_fpr = std::atof(optarg); break;
+            case 'G': bin_l = std::atoi(optarg); break;
         }
     }
     dbpath = argv[optind];
@@ -137,7 +425,13 @@ int phase2_main(int argc, char *argv[]) {
 #else
     const std::string suf(".gz");
 #endif
-    if(endswith(dbpath, suf))     write_fmt = ZLIB;
+    if(write_mmap) {
+        if(write_fmt) LOG_WARNING("Memory-mappable databases are written uncompressed. Ignoring -z.\n");
+        write_fmt = UNCOMPRESSED;
+    } else if(write_table || bloom_bits > 0. || compact_fpr > 0. || bin_l) LOG_EXIT("-c, -b, -K and -G require -m.\n");
+    else if(endswith(dbpath, suf)) write_fmt = ZLIB;
+    if(bin_l && (write_table || compact_fpr > 0.)) LOG_EXIT("-G is incompatible with -c and -K.\n");
+    if(write_table && compact_fpr > 0.) LOG_EXIT("-c and -K are incompatible.\n");
     if(write_fmt && !endswith(dbpath, ".gz"))
         dbpath += suf, LOG_INFO("Writing gzipped, but without a .gz suffix. Adding it.\n");
     LOG_INFO("db output path: %s\n", dbpath.data());
@@ -175,25 +469,29 @@ int phase2_main(int argc, char *argv[]) {
         khash_t(p) *taxmap(build_parent_map(tax_path.data()));
         //LOG_INFO("I just feel like stopping this executable now for testing.\n");
         //goto fail;
+        phase2_map.score_ = score_scheme::LEX == mode ? LEX: ENTROPY; // As chosen below.
         phase2_map.db_ = score_scheme::LEX == mode ? lca_map<score::Lex>(inpaths, taxmap, seq2taxpath.data(), sp, num_threads, canon, hash_size)
                                                    : lca_map<score::Entropy>(inpaths, taxmap, seq2taxpath.data(), sp, num_threads, canon, hash_size);
-        phase2_map.write(dbpath.data(), write_fmt);
+        if(write_mmap) phase2_map.write_mmap(dbpath.data(), write_table, bloom_bits, compact_fpr, bin_l);
+        else           phase2_map.write(dbpath.data(), write_fmt);
         //fail:
         kh_destroy(p, taxmap);
         return EXIT_SUCCESS;
     }
     LOG_INFO("Making minimized map\n");
-    Database<khash_t(64)> phase1_map{Database<khash_t(64)>(dbpath.data())};
+    Database<khash_t(64)> phase1_map(dbpath.data());
     Database<khash_t(c)>  phase2_map{phase1_map};
     Spacer sp(k, wsz, phase1_map.s_);
     khash_t(p) *taxmap(tax_path.empty() ? nullptr: build_parent_map(tax_path.data()));
+    phase2_map.score_ = score_scheme(mode);
     phase2_map.db_ = minimized_map<score::Hash>(inpaths, phase1_map.db_, seq2taxpath.data(), taxmap, sp, num_threads, start_size, canon);
     std::string dbpath2 = argv[optind + 1];
-    if(endswith(dbpath2, suf))     write_fmt = ZLIB;
+    if(!write_mmap && endswith(dbpath2, suf)) write_fmt = ZLIB;
     if(write_fmt && !endswith(dbpath2, ".gz"))
         dbpath2 += suf, LOG_INFO("Writing gzipped, but without a .gz suffix. Adding it.\n");
     // Write minimized map
-    phase2_map.write(dbpath2.data(), write_fmt);
+    if(write_mmap) phase2_map.write_mmap(dbpath2.data(), write_table, bloom_bits, compact_fpr, bin_l);
+    else           phase2_map.write(dbpath2.data(), write_fmt);
     if(taxmap) kh_destroy(p, taxmap);
     return EXIT_SUCCESS;
 }
@@ -279,7 +577,10 @@ int hist_main(int argc, char *argv[]) {
     std::FILE *ofp(stdout);
     count::Counter<u32> counter;
     if(argc > 2) ofp = std::fopen(argv[2], "w");
-    for(khiter_t ki(0); ki != kh_end(map); ++ki) if(kh_exist(map, ki)) counter.add(kh_val(map, ki));
+    if(map) {
+        for(khiter_t ki(0); ki != kh_end(map); ++ki) if(kh_exist(map, ki)) counter.add(kh_val(map, ki));
+    } else if(!db.cht_.empty()) db.cht_.for_each_taxon([&](tax_t taxon) {counter.add(taxon);});
+    else db.mbt_.for_each_taxon([&](tax_t taxon) {counter.add(taxon);});
     auto &cmap(counter.get_map());
     using elcount = std::pair<tax_t, u32>;
     std::vector<elcount> structs;
@@ -291,8 +592,143 @@ int hist_main(int argc, char *argv[]) {
      return EXIT_SUCCESS;
  }
 
+int hostfilter_main(int argc, char *argv[]) {
+    int c, k(31);
+    double bits_per_kmer(HOST_DEFAULT_BITS_PER_KMER);
+    std::string spacing;
+    if(argc < 3) {
+        usage:
+        std::fprintf(stderr, "Builds a filter of a host genome's k-mers for classify -x, which screens out host reads before classification.\n"
+                             "Usage: bonsai %s <flags> <out.filter> <host.fa> [<host.fa>...]\nFlags:\n"
+                             "-k: Set k. [31]\n"
+                             "-s: Set spacing, as for build.\n"
+                             "-b: Bits per k-mer of the filter. The filter is sized by the reference's bases. [%0.0lf]\n",
+                     *argv, HOST_DEFAULT_BITS_PER_KMER);
+        std::exit(EXIT_FAILURE);
+    }
+    while((c = getopt(argc, argv, "k:s:b:h?")) >= 0) {
+        switch(c) {
+            case 'h': case '?': goto usage;
+            case 'k': k = std::atoi(optarg); break;
+            case 's': spacing = optarg; break;
+            case 'b': bits_per_kmer = std::atof(optarg); break;
+        }
+    }
+    if(argc - optind < 2) goto usage;
+    if(k <= 0 || unsigned(k) > Spacer::max_k) LOG_EXIT("k must be in [1, %u].\n", Spacer::max_k);
+    const HostFilter filter(std::vector<std::string>(argv + optind + 1, argv + argc), k, parse_spacing(spacing.data(), k), bits_per_kmer);
+    LOG_INFO("Built %zu-byte host filter of %" PRIu64 " %i-mers.\n", filter.nbytes(), filter.nkmers(), k);
+    filter.write(argv[optind]);
+    return EXIT_SUCCESS;
+}
+
+int serve_main(int argc, char *argv[]) {
+    int co, num_threads(1), emit_all(0), chunk_size(SERVE_CHUNK_BASES);
+    bool use_khash(false), use_filter(true), emit_binary(false);
+    unsigned cache_bits(0);
+    if(argc < 4) {
+        usage:
+        std::fprintf(stderr, "Keeps a database loaded and classifies reads sent by `bonsai query` over a Unix socket.\n"
+                             "Usage: bonsai %s <flags> <socket> <dbpath> <tax_path>\nFlags:\n"
+                             "-p: Set number of threads, shared by all jobs. [1] (Set -1 to use all threads.)\n"
+                             "-c: Set chunk size in bases. Concurrent jobs take turns chunk by chunk. [%u]\n"
+                             "-a: Emit all records, not just classified.\n"
+                             "-y: Write compact binary records instead of kraken-style text.\n"
+                             "-H: Look up k-mers in the hash table even if the database has a compact lookup table.\n"
+                             "-B: Do not consult the database's Bloom filter before lookups.\n"
+                             "-R: Cache lookups in 2^<arg> entries per thread. [0: off]\n"
+                             "The server runs until a client sends `bonsai query -S <socket>`.\n",
+                     *argv, SERVE_CHUNK_BASES);
+        std::exit(EXIT_FAILURE);
+    }
+    while((co = getopt(argc, argv, "p:c:R:ayHBh?")) >= 0) {
+        switch(co) {
+            case 'h': case '?': goto usage;
+            case 'p': num_threads = std::atoi(optarg); break;
+            case 'c': chunk_size = std::atoi(optarg); break;
+            case 'R': cache_bits = std::strtoul(optarg, nullptr, 10); break;
+            case 'a': emit_all = 1; break;
+            case 'y': emit_binary = true; break;
+            case 'H': use_khash = true; break;
+            case 'B': use_filter = false; break;
+        }
+    }
+    if(argc - optind != 3 || chunk_size <= 0) goto usage;
+    Database<khash_t(c)> db(argv[optind + 1]);
+    khash_t(p) *taxmap(build_parent_map(argv[optind + 2]));
+    const TaxonomyIndex tax(taxmap);
+    kh_destroy(p, taxmap);
+    unsigned w(db.w_);
+    with_score_scheme(db.score_, db.k_, w, [&](auto scorer) {
+        ClassifierGeneric<decltype(scorer)> c(db.db_, db.s_, db.k_, w, num_threads, emit_all, false, true);
+        use_tables(c, db, use_khash, use_filter);
+        c.set_cache_bits(cache_bits);
+        c.set_emit_binary(emit_binary);
+        ClassifyServer<decltype(scorer)> server(c, tax, argv[optind], chunk_size);
+        LOG_INFO("Serving at %s with %u threads.\n", argv[optind], unsigned(c.nt_));
+        server.serve();
+    });
+    LOG_INFO("Server stopped.\n");
+    return EXIT_SUCCESS;
+}
+
+int query_main(int argc, char *argv[]) {
+    int co;
+    const char *stream_path(nullptr);
+    bool shutdown(false);
+    std::FILE *ofp(stdout);
+    if(argc < 2) {
+        usage:
+        std::fprintf(stderr, "Classifies reads with a database kept loaded by `bonsai serve`, and writes the output it streams back.\n"
+                             "Usage: bonsai %s <flags> <socket> <r1.fq> [<r2.fq>]\n"
+                             "       bonsai %s -s <reads.fq|-> <socket>\n"
+                             "       bonsai %s -S <socket>\nFlags:\n"
+                             "-o: Write output to path instead of stdout.\n"
+                             "-s: Send the reads at path (- for stdin) over the socket, instead of having the server open files.\n"
+                             "    Use this for reads the server cannot see, or that are still being written.\n"
+                             "-S: Stop the server once its running jobs finish.\n",
+                     *argv, *argv, *argv);
+        std::exit(EXIT_FAILURE);
+    }
+    while((co = getopt(argc, argv, "o:s:Sh?")) >= 0) {
+        switch(co) {
+            case 'h': case '?': goto usage;
+            case 'o': if((ofp = std::fopen(optarg, "w")) == nullptr) throw file_open_error(optarg); break;
+            case 's': stream_path = optarg; break;
+            case 'S': shutdown = true; break;
+        }
+    }
+    std::string request;
+    int stream_fd(-1);
+    if(shutdown || stream_path) {
+        if(argc - optind != 1 || (shutdown && stream_path)) goto usage;
+        request = shutdown ? "SHUTDOWN": "STREAM";
+        if(stream_path && (stream_fd = std::strcmp(stream_path, "-") ? ::open(stream_path, O_RDONLY): STDIN_FILENO) < 0)
+            throw file_open_error(stream_path);
+    } else {
+        if(argc - optind < 2 || argc - optind > 3) goto usage;
+        // The server resolves paths from its own working directory.
+        request = "CLASSIFY";
+        for(int i(optind + 1); i < argc; ++i) {
+            std::unique_ptr<char, decltype(&std::free)> path(::realpath(argv[i], nullptr), &std::free);
+            if(!path) throw file_open_error(argv[i]);
+            if(std::strpbrk(path.get(), " \t\n")) LOG_EXIT("Cannot send path %s, which contains whitespace. Use -s.\n", path.get());
+            request += ' ', request += path.get();
+        }
+    }
+    try {
+        const std::string summary(query_server(argv[optind], request, ofp, stream_fd));
+        LOG_INFO("%s\n", summary.data());
+    } catch(const std::exception &ex) {
+        LOG_EXIT("%s\n", ex.what());
+    }
+    if(stream_fd > STDIN_FILENO) ::close(stream_fd);
+    if(ofp != stdout) std::fclose(ofp);
+    return EXIT_SUCCESS;
+}
+
 int err_main(int argc, char *argv[]) {
-    std::fprintf(stderr, "[bonsai:%s] No valid subcommand provided. Options: prebuild/p1/phase, build/p2/phase2, classify, metatree\n", BONSAI_VERSION);
+    std::fprintf(stderr, "[bonsai:%s] No valid subcommand provided. Options: prebuild/p1/phase, build/p2/phase2, classify, hostfilter, serve, query, metatree\n", BONSAI_VERSION);
     return EXIT_FAILURE;
 }
 
@@ -447,7 +883,10 @@ int main(int argc, char *argv[]) {
         {"lca",      phase1_main},
         {"hist",     hist_main},
         {"metatree", metatree_main},
-        {"classify", classify_main}
+        {"classify", classify_main},
+        {"hostfilter", hostfilter_main},
+        {"serve",    serve_main},
+        {"query",    query_main}
     };
     if(std::find_if(argv, argv + argc, [&](char *s) {return std::strcmp("-v", s) == 0 || std::strcmp("--version", s) == 0;}) != argv + argc) {
         std::fprintf(stdout, "bonsai|%s\n", BONSAI_VERSION);
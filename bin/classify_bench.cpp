@@ -0,0 +1,266 @@
+#include <getopt.h>
+#include "database.h"
+#include "classifier.h"
+
+using namespace bns;
+
+// Benchmarks the k-mer lookup structures used by classify on the k-mers of a set of reads,
+// e.g., kraken_benchmarks/HiSeq_accuracy.fa.
+
+namespace {
+
+struct lookup_stats_t {
+    u64 hits_   = 0;
+    u64 sum_    = 0; // Order-independent checksum of returned taxa.
+    double ns_  = std::numeric_limits<double>::max();
+};
+
+template<typename Func>
+lookup_stats_t time_lookups(const std::vector<u64> &kmers, int nreps, const Func &func) {
+    lookup_stats_t ret;
+    for(int rep(0); rep < nreps; ++rep) {
+        u64 hits(0), sum(0);
+        auto start(std::chrono::steady_clock::now());
+        for(const u64 kmer: kmers) {
+            const tax_t tax(func(kmer));
+            hits += tax != 0;
+            sum  += tax;
+        }
+        auto stop(std::chrono::steady_clock::now());
+        ret.ns_   = std::min(ret.ns_, double(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count()));
+        ret.hits_ = hits, ret.sum_ = sum;
+    }
+    return ret;
+}
+
+// Resolves the k-mers in read-sized blocks through ClassifierGeneric::lookup_batch, as classify_seq does,
+// or through lookup_batch_cached if cache is set. The cache is cleared before each repetition.
+template<typename ScoreType>
+lookup_stats_t time_batched(const std::vector<u64> &kmers, int nreps, const ClassifierGeneric<ScoreType> &c, size_t block,
+                            LookupCache *cache=nullptr) {
+    lookup_stats_t ret;
+    for(int rep(0); rep < nreps; ++rep) {
+        u64 hits(0), sum(0);
+        auto func = [&](tax_t tax) {hits += tax != 0; sum += tax;};
+        if(cache) *cache = LookupCache(c.cache_bits_);
+        auto start(std::chrono::steady_clock::now());
+        for(size_t i(0); i < kmers.size(); i += block) {
+            const size_t n(std::min(block, kmers.size() - i));
+            if(cache) c.lookup_batch_cached(kmers.data() + i, 0, n, *cache, func);
+            else      c.lookup_batch(kmers.data() + i, 0, n, n, func);
+        }
+        auto stop(std::chrono::steady_clock::now());
+        ret.ns_   = std::min(ret.ns_, double(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count()));
+        ret.hits_ = hits, ret.sum_ = sum;
+    }
+    return ret;
+}
+
+void report(const char *name, size_t nbytes, const lookup_stats_t &stats, size_t nkmers, std::FILE *ofp) {
+    std::fprintf(ofp, "%s\t%zu\t%0.3lf\t%0.0lf\t%" PRIu64 "\t%" PRIu64 "\n",
+                 name, nbytes, stats.ns_ / nkmers, nkmers / stats.ns_ * 1e9, stats.hits_, nkmers - stats.hits_);
+}
+
+int usage(const char *arg) {
+    std::fprintf(stderr, "Usage: %s <flags> <db.path> <reads.fa/fq> [<reads.fa/fq>...]\n"
+                         "Flags:\n"
+                         "-C:\tDo not canonicalize k-mers.\n"
+                         "-n:\tNumber of repetitions; the fastest is reported. [3]\n"
+                         "-l:\tLoad factor for building a compact table if the database does not contain one. [0.7]\n"
+                         "-b:\tNumber of k-mers per batch for prefetched lookups (~k-mers per read). [120]\n"
+                         "-B:\tBits per key for building a Bloom filter if the database does not contain one. [10]\n"
+                         "-K:\tExpected false-positive rate for building a probabilistic compact hash table. [1e-3]\n"
+                         "-g:\tMinimizer length for building a minimizer-binned table. [15, or k if smaller]\n"
+                         "-R:\tLog2 entries of the lookup cache in front of the cltable. [18]\n"
+                         "\nEmits a tab-delimited table of method, bytes used, ns/lookup, lookups/s, hits and misses,\n"
+                         "then the fraction of misses the Bloom filter rejects and the speedup it gives each table,\n"
+                         "then the compact hash table's expected and observed false-positive rates and the fraction of hits\n"
+                         "it assigns a different taxon, then the binned table's bins, k-mers and bin loads per read, and reads/s\n"
+                         "through khash and the binned table, then the lookup cache's size and hit rate.\n"
+                         "The database must have its hash table, which the others are checked against.\n"
+                         "The cltable rows store 16-bit indices into the table of taxa if the database has at most 65535 taxa;\n"
+                         "the cltable16 or cltable32 rows show the other value width.\n",
+                 arg);
+    return EXIT_FAILURE;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    int c, nreps(3);
+    size_t block(120);
+    bool canon(true);
+    unsigned bin_l(15), cache_bits(18);
+    double load(0.7), bloom_bits(10.), compact_fpr(1e-3);
+    while((c = getopt(argc, argv, "B:K:R:b:g:n:l:Ch?")) >= 0) {
+        switch(c) {
+            case 'C': canon = false;                  break;
+            case 'n': nreps = std::atoi(optarg);      break;
+            case 'l': load  = std::atof(optarg);      break;
+            case 'b': block = std::strtoull(optarg, nullptr, 10); break;
+            case 'B': bloom_bits = std::atof(optarg); break;
+            case 'K': compact_fpr = std::atof(optarg); break;
+            case 'g': bin_l = std::atoi(optarg);       break;
+            case 'R': cache_bits = std::atoi(optarg);  break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    if(argc - optind < 2) return usage(*argv);
+    Database<khash_t(c)> db(argv[optind]);
+    if(db.db_ == nullptr) LOG_EXIT("%s has no hash table to check results against.\n", argv[optind]);
+    unsigned w(db.w_);
+    std::vector<u64> kmers;
+    std::vector<size_t> read_ends; // Each read's k-mers end at read_ends[i].
+    u64 nreads(0);
+    with_score_scheme(db.score_, db.k_, w, [&](auto scorer) {
+        Spacer sp(db.k_, w, db.s_);
+        Encoder<decltype(scorer)> enc(sp, canon);
+        for(char **p(argv + optind + 1); *p; ++p) {
+            gzFile fp(gzopen(*p, "rb"));
+            if(fp == nullptr) throw file_open_error(*p);
+            kseq_t *ks(kseq_init(fp));
+            while(kseq_read(ks) >= 0) {
+                // As in classify_seq, consecutive windows sharing a minimizer need a single lookup.
+                const size_t first(kmers.size());
+                enc.for_each([&](u64 kmer) {
+                    if(sp.unwindowed() || kmers.size() == first || kmers.back() != kmer) kmers.push_back(kmer);
+                }, ks->seq.s, ks->seq.l);
+                read_ends.push_back(kmers.size());
+                ++nreads;
+            }
+            kseq_destroy(ks);
+            gzclose(fp);
+        }
+    });
+    LOG_INFO("Extracted %zu k-mers from %" PRIu64 " reads.\n", kmers.size(), nreads);
+    if(kmers.empty()) LOG_EXIT("No k-mers to look up.\n");
+
+    CacheLineTable built;
+    const CacheLineTable *table(&db.ct_);
+    if(table->empty()) {
+        built = CacheLineTable::from_khash(db.db_, load);
+        table = &built;
+    }
+    BlockedBloomFilter built_filter;
+    const BlockedBloomFilter *filter(&db.bf_);
+    if(filter->empty()) {
+        built_filter = BlockedBloomFilter::from_khash(db.db_, bloom_bits);
+        filter = &built_filter;
+    } else bloom_bits = filter->nbytes() * 8. / kh_size(db.db_);
+    const CompactHashTable compact(CompactHashTable::from_khash(db.db_, compact_fpr));
+    const MinimizerBinTable bins(MinimizerBinTable::from_khash(db.db_, db.k_, std::min(bin_l, db.k_)));
+    // The other value width, for comparison.
+    const CacheLineTable other(CacheLineTable::from_khash(db.db_, load, table->taxa() == nullptr));
+    const khash_t(c) *map(db.db_);
+    const size_t khash_bytes(kh_end(map) * (sizeof(*map->keys) + sizeof(*map->vals)) + __ac_fsize(kh_end(map)) * sizeof(*map->flags));
+
+    auto kh_stats(time_lookups(kmers, nreps, [map](u64 kmer) -> tax_t {
+        khiter_t ki(kh_get(c, map, kmer));
+        return ki == kh_end(map) ? 0: kh_val(map, ki);
+    }));
+    auto ct_stats(time_lookups(kmers, nreps, [table](u64 kmer) {return table->get(kmer);}));
+    ClassifierGeneric<score::Lex> classifier(db.db_, db.s_, db.k_, w, 1); // Lookups do not depend on the scheme.
+    classifier.set_prefetch_khash(true);
+    auto kh_pf_stats(time_batched(kmers, nreps, classifier, block));
+    classifier.set_table(table);
+    auto ct_pf_stats(time_batched(kmers, nreps, classifier, block));
+    classifier.set_cache_bits(cache_bits);
+    LookupCache cache;
+    auto cache_ct_pf_stats(time_batched(kmers, nreps, classifier, block, &cache));
+    classifier.set_filter(filter);
+    auto bf_ct_pf_stats(time_batched(kmers, nreps, classifier, block));
+    auto bf_ct_stats(time_lookups(kmers, nreps, [&classifier](u64 kmer) {return classifier.lookup(kmer);}));
+    classifier.set_table(nullptr);
+    auto bf_kh_pf_stats(time_batched(kmers, nreps, classifier, block));
+    classifier.set_prefetch_khash(false);
+    auto bf_kh_stats(time_lookups(kmers, nreps, [&classifier](u64 kmer) {return classifier.lookup(kmer);}));
+    for(const auto *stats: {&ct_stats, &kh_pf_stats, &ct_pf_stats, &cache_ct_pf_stats, &bf_kh_stats, &bf_ct_stats, &bf_kh_pf_stats, &bf_ct_pf_stats})
+        if(kh_stats.hits_ != stats->hits_ || kh_stats.sum_ != stats->sum_)
+            LOG_EXIT("Results differ from khash: %" PRIu64 " vs %" PRIu64 " hits.\n", stats->hits_, kh_stats.hits_);
+    // The compact table's results differ by design, and are checked k-mer by k-mer below.
+    classifier.set_filter(nullptr);
+    classifier.set_table(&compact);
+    auto ch_pf_stats(time_batched(kmers, nreps, classifier, block));
+    auto ch_stats(time_lookups(kmers, nreps, [&compact](u64 kmer) {return compact.get(kmer);}));
+    auto other_stats(time_lookups(kmers, nreps, [&other](u64 kmer) {return other.get(kmer);}));
+    classifier.set_table(&other);
+    auto other_pf_stats(time_batched(kmers, nreps, classifier, block));
+    auto bins_stats(time_lookups(kmers, nreps, [&bins](u64 kmer) {return bins.get(kmer);}));
+    // Lookups through the classifier keep the bounds of the last bin; blocks are reads here.
+    classifier.set_table(nullptr);
+    classifier.set_table(&bins);
+    lookup_stats_t bins_cache_stats;
+    for(int rep(0); rep < nreps; ++rep) {
+        u64 hits(0), sum(0);
+        auto func = [&](tax_t tax) {hits += tax != 0; sum += tax;};
+        auto start(std::chrono::steady_clock::now());
+        for(size_t i(0), beg(0); i < read_ends.size(); beg = read_ends[i++])
+            classifier.lookup_batch(kmers.data() + beg, 0, read_ends[i] - beg, read_ends[i] - beg, func);
+        auto stop(std::chrono::steady_clock::now());
+        bins_cache_stats.ns_   = std::min(bins_cache_stats.ns_, double(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count()));
+        bins_cache_stats.hits_ = hits, bins_cache_stats.sum_ = sum;
+    }
+    for(const auto *stats: {&other_stats, &other_pf_stats, &bins_stats, &bins_cache_stats})
+        if(kh_stats.hits_ != stats->hits_ || kh_stats.sum_ != stats->sum_)
+            LOG_EXIT("Results differ from khash: %" PRIu64 " vs %" PRIu64 " hits.\n", stats->hits_, kh_stats.hits_);
+
+    std::fputs("#Method\tBytes\tns/lookup\tlookups/s\tHits\tMisses\n", stdout);
+    report("khash",  khash_bytes,      kh_stats, kmers.size(), stdout);
+    report("cltable", table->nbytes(), ct_stats, kmers.size(), stdout);
+    report("khash+prefetch",   khash_bytes,      kh_pf_stats, kmers.size(), stdout);
+    report("cltable+prefetch", table->nbytes(), ct_pf_stats, kmers.size(), stdout);
+    report("cache+cltable+prefetch", table->nbytes() + cache.nbytes(), cache_ct_pf_stats, kmers.size(), stdout);
+    report("bloom+khash",   khash_bytes + filter->nbytes(),     bf_kh_stats, kmers.size(), stdout);
+    report("bloom+cltable", table->nbytes() + filter->nbytes(), bf_ct_stats, kmers.size(), stdout);
+    report("bloom+khash+prefetch",   khash_bytes + filter->nbytes(),     bf_kh_pf_stats, kmers.size(), stdout);
+    report("bloom+cltable+prefetch", table->nbytes() + filter->nbytes(), bf_ct_pf_stats, kmers.size(), stdout);
+    const std::string other_name(ks::sprintf("cltable%u", other.value_bits()).data());
+    report(other_name.data(), other.nbytes(), other_stats, kmers.size(), stdout);
+    report((other_name + "+prefetch").data(), other.nbytes(), other_pf_stats, kmers.size(), stdout);
+    report("compact",          compact.nbytes(), ch_stats,    kmers.size(), stdout);
+    report("compact+prefetch", compact.nbytes(), ch_pf_stats, kmers.size(), stdout);
+    report("bins",       bins.nbytes(), bins_stats,       kmers.size(), stdout);
+    report("bins+cache+prefetch", bins.nbytes(), bins_cache_stats, kmers.size(), stdout);
+
+    const u64 nmisses(kmers.size() - kh_stats.hits_);
+    u64 nrejected(0);
+    for(const u64 kmer: kmers) nrejected += !filter->may_contain(kmer);
+    std::fputs("#BitsPerKey\tHashes\tBytes\tMissesRejected\tFalsePositiveRate\tSpeedup(khash)\tSpeedup(cltable)"
+               "\tSpeedup(khash+prefetch)\tSpeedup(cltable+prefetch)\n", stdout);
+    std::fprintf(stdout, "%0.2lf\t%u\t%zu\t%0.4lf\t%0.4lf\t%0.2lf\t%0.2lf\t%0.2lf\t%0.2lf\n", bloom_bits, BlockedBloomFilter::NHASHES, filter->nbytes(),
+                 nmisses ? double(nrejected) / nmisses: 1., nmisses ? double(nmisses - nrejected) / nmisses: 0.,
+                 kh_stats.ns_ / bf_kh_stats.ns_, ct_stats.ns_ / bf_ct_stats.ns_,
+                 kh_pf_stats.ns_ / bf_kh_pf_stats.ns_, ct_pf_stats.ns_ / bf_ct_pf_stats.ns_);
+
+    u64 nfalse(0), nwrong(0);
+    for(const u64 kmer: kmers) {
+        const tax_t expected(table->get(kmer)), got(compact.get(kmer));
+        if(expected == 0) nfalse += got != 0;
+        else              nwrong += got != expected;
+    }
+    const double compact_load(double(compact.size()) / compact.nslots());
+    std::fputs("#CompactLoad\tValueBits\tBytes\tExpectedFalsePositiveRate\tFalsePositiveRate\tHitsMisassigned\n", stdout);
+    std::fprintf(stdout, "%0.3lf\t%u\t%zu\t%0.3g\t%0.3g\t%0.3g\n", compact_load, compact.value_bits(), compact.nbytes(),
+                 CompactHashTable::expected_fpr(compact_load, compact.value_bits()),
+                 nmisses ? double(nfalse) / nmisses: 0., kh_stats.hits_ ? double(nwrong) / kh_stats.hits_: 0.);
+
+    // Each hash table lookup reads an unrelated line; the binned table reads new lines only when the minimizer changes.
+    u64 nloads(0);
+    for(size_t i(0), beg(0); i < read_ends.size(); beg = read_ends[i++]) {
+        MinimizerBinTable::bin_cache_t cache;
+        for(size_t j(beg); j < read_ends[i]; ++j) {
+            const u64 m(bins.minimizer(kmers[j]));
+            nloads += m != cache.minimizer_;
+            cache.minimizer_ = m;
+        }
+    }
+    std::fputs("#MinimizerLength\tBins\tBytes\tKmersPerRead\tBinLoadsPerRead\tKmersPerBinLoad\tReads/s(khash)\tReads/s(bins+cache+prefetch)\n", stdout);
+    std::fprintf(stdout, "%u\t%zu\t%zu\t%0.2lf\t%0.2lf\t%0.2lf\t%0.0lf\t%0.0lf\n", bins.l(), size_t(bins.nbins()), bins.nbytes(),
+                 double(kmers.size()) / nreads, double(nloads) / nreads, nloads ? double(kmers.size()) / nloads: 0.,
+                 nreads / kh_stats.ns_ * 1e9, nreads / bins_cache_stats.ns_ * 1e9);
+
+    std::fputs("#CacheBits\tBytes\tHitRate\tSpeedup(cltable+prefetch)\n", stdout);
+    std::fprintf(stdout, "%u\t%zu\t%0.4lf\t%0.2lf\n", cache_bits, cache.nbytes(),
+                 cache.lookups_ ? double(cache.hits_) / cache.lookups_: 0., ct_pf_stats.ns_ / cache_ct_pf_stats.ns_);
+    return EXIT_SUCCESS;
+}
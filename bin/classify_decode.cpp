@@ -0,0 +1,79 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "binout.h"
+#include "kseq_declare.h"
+
+using namespace bns;
+
+// Converts binary classification records (bonsai classify -y) back to the kraken-style text classify writes.
+// Read names are taken from the reads classified (the first file of a pair), by index; without them, reads are named by index.
+
+namespace {
+
+int usage(const char *arg) {
+    std::fprintf(stderr, "Usage: %s <flags> <classified.bin> [<reads.fa/fq>]\n"
+                         "Flags:\n"
+                         "-o:\tWrite to path instead of stdout.\n",
+                 arg);
+    return EXIT_FAILURE;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    int c;
+    std::FILE *ofp(stdout);
+    while((c = getopt(argc, argv, "o:h?")) >= 0) {
+        switch(c) {
+            case 'o': if((ofp = std::fopen(optarg, "w")) == nullptr) throw file_open_error(optarg); break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    if(argc - optind < 1 || argc - optind > 2) return usage(*argv);
+    const int fd(::open(argv[optind], O_RDONLY));
+    if(fd < 0) throw file_open_error(argv[optind]);
+    struct stat sb;
+    if(fstat(fd, &sb) || size_t(sb.st_size) < sizeof(CLS_BINARY_MAGIC)) LOG_EXIT("%s is too small to hold binary classification records.\n", argv[optind]);
+    void *map(mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0));
+    if(map == MAP_FAILED) LOG_EXIT("Could not mmap %s\n", argv[optind]);
+    const char *p(static_cast<const char *>(map)), *end(p + sb.st_size);
+    if(std::memcmp(p, CLS_BINARY_MAGIC, sizeof(CLS_BINARY_MAGIC))) LOG_EXIT("%s does not hold binary classification records.\n", argv[optind]);
+    p += sizeof(CLS_BINARY_MAGIC);
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+    gzFile rfp(nullptr);
+    kseq_t *ks(nullptr);
+    if(argc - optind == 2) {
+        if((rfp = gzopen(argv[optind + 1], "rb")) == nullptr) throw file_open_error(argv[optind + 1]);
+        ks = kseq_init(rfp);
+    }
+    u64 nread(0); // Reads taken from ks so far.
+    cls_record_t rec;
+    std::vector<std::pair<tax_t, u32>> runs;
+    ks::string out(1u << 16), name;
+    while(read_binary_record(p, end, rec, runs)) {
+        if(ks) {
+            for(; nread <= rec.read_; ++nread)
+                if(kseq_read(ks) < 0) LOG_EXIT("Record for read %" PRIu64 " past the end of the reads.\n", rec.read_);
+            append_kraken_text(rec, runs, ks->name.s, out);
+        } else {
+            name.clear();
+            name.putl_(rec.read_);
+            name.terminate();
+            append_kraken_text(rec, runs, name.data(), out);
+        }
+        if(out.size() >= (1u << 16)) {
+            if(std::fwrite(out.data(), 1, out.size(), ofp) != out.size()) LOG_EXIT("Could not write output.\n");
+            out.clear();
+        }
+    }
+    if(out.size() && std::fwrite(out.data(), 1, out.size(), ofp) != out.size()) LOG_EXIT("Could not write output.\n");
+    if(ks) kseq_destroy(ks), gzclose(rfp);
+    munmap(map, sb.st_size);
+    ::close(fd);
+    if(ofp != stdout) std::fclose(ofp);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+#include <getopt.h>
+#include <queue>
+#include "database.h"
+#include "classifier.h"
+
+using namespace bns;
+
+// Thread-scaling benchmark for classify_seqs: compares dividing a chunk into tasks of a fixed number of reads,
+// handed out in input order (the former -S option), with the base-balanced, largest-first tasks classify now uses.
+// The tail effect shows with reads of very different lengths, e.g., short reads mixed with long reads.
+
+namespace {
+
+// Tasks of per_task reads in input order, as classify_seqs used to divide chunks.
+template<typename ScoreType>
+void plan_by_records(ClassifyArena<ScoreType> &arena, const bseq1_t *bs, unsigned n, unsigned per_task) {
+    arena.starts_.clear(), arena.bases_.clear();
+    for(unsigned i(0); i < n; i += per_task) {
+        arena.starts_.push_back(i);
+        u64 bases(0);
+        for(unsigned j(i), e(std::min(i + per_task, n)); j < e; bases += bs[j++].l_seq);
+        arena.bases_.push_back(bases);
+    }
+    arena.starts_.push_back(n);
+    arena.order_.resize(arena.bases_.size());
+    std::iota(arena.order_.begin(), arena.order_.end(), 0u);
+    if(arena.segments_.size() < arena.bases_.size()) arena.segments_.resize(arena.bases_.size());
+}
+
+// Time to classify the tasks planned on nthreads threads, in bases, if each task takes time proportional
+// to its bases and is given to the first idle thread in the order planned.
+template<typename ScoreType>
+u64 modeled_makespan(const ClassifyArena<ScoreType> &arena, unsigned nthreads) {
+    std::priority_queue<u64, std::vector<u64>, std::greater<u64>> free_at;
+    for(unsigned i(0); i < nthreads; ++i) free_at.push(0);
+    u64 makespan(0);
+    for(const u32 task: arena.order_) {
+        const u64 done(free_at.top() + arena.bases_[task]);
+        free_at.pop();
+        free_at.push(done);
+        makespan = std::max(makespan, done);
+    }
+    return makespan;
+}
+
+int usage(const char *arg) {
+    std::fprintf(stderr, "Usage: %s <flags> <db.path> <taxonomy> <reads.fa/fq> [<reads.fa/fq>...]\n"
+                         "Flags:\n"
+                         "-C:\tDo not canonicalize k-mers.\n"
+                         "-t:\tComma-separated thread counts. [1,2,4,8]\n"
+                         "-n:\tNumber of repetitions; the fastest is reported. [3]\n"
+                         "-S:\tReads per task for the fixed-size division. [32]\n"
+                         "-c:\tBases per chunk, as classify -c. Use 0 to classify all reads as one chunk. [%d]\n"
+                         "\nEmits a tab-delimited table of threads, division, tasks per chunk, wall time (ms), reads/s,\n"
+                         "speedup over the first thread count and modeled efficiency: the fraction of thread time spent\n"
+                         "working if tasks took time proportional to their bases, which shows the tail effect and chunks\n"
+                         "divided into too few tasks independently of the number of cores available.\n",
+                 arg, CLASSIFY_CHUNK_BASES);
+    return EXIT_FAILURE;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    int c, nreps(3);
+    unsigned per_task(32);
+    u64 chunk_size(CLASSIFY_CHUNK_BASES);
+    bool canon(true);
+    std::vector<unsigned> thread_counts;
+    while((c = getopt(argc, argv, "t:n:S:c:Ch?")) >= 0) {
+        switch(c) {
+            case 'C': canon = false;                      break;
+            case 'n': nreps = std::atoi(optarg);          break;
+            case 'S': per_task = std::atoi(optarg);       break;
+            case 'c': chunk_size = std::strtoull(optarg, nullptr, 10); break;
+            case 't':
+                for(char *p(optarg); *p; p += *p == ',')
+                    thread_counts.push_back(std::strtoul(p, &p, 10));
+                break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    if(argc - optind < 3 || per_task == 0) return usage(*argv);
+    if(thread_counts.empty()) thread_counts = {1, 2, 4, 8};
+    Database<khash_t(c)> db(argv[optind]);
+    khash_t(p) *taxmap(build_parent_map(argv[optind + 1]));
+    const TaxonomyIndex tax(taxmap);
+    kh_destroy(p, taxmap);
+    // Read everything, then divide it into chunks as bseq_read would.
+    bseq1_t *seqs(nullptr);
+    int n(0), m(0);
+    std::vector<bseq1_t> all;
+    for(char **p(argv + optind + 2); *p; ++p) {
+        gzFile fp(gzopen(*p, "rb"));
+        if(fp == nullptr) throw file_open_error(*p);
+        kseq_t *ks(kseq_init(fp));
+        while((seqs = bseq_reuse_read(1 << 30, &n, &m, (void *)ks, nullptr, seqs)), n > 0) {
+            all.insert(all.end(), seqs, seqs + n);
+            for(int i(0); i < n; ++i) std::memset(seqs + i, 0, sizeof(*seqs)); // all now owns these records.
+        }
+        kseq_destroy(ks);
+        gzclose(fp);
+    }
+    for(int i(0); i < m; bseq_destroy(seqs + i++));
+    std::free(seqs);
+    const unsigned nreads(all.size());
+    if(nreads == 0) LOG_EXIT("No reads.\n");
+    u64 nbases(0);
+    std::vector<unsigned> chunks(1, 0); // Chunk i holds reads [chunks[i], chunks[i + 1]).
+    for(unsigned i(0), bases(0); i < nreads; ++i) {
+        nbases += all[i].l_seq, bases += all[i].l_seq;
+        if(chunk_size && bases >= chunk_size) chunks.push_back(i + 1), bases = 0;
+    }
+    if(chunks.back() < nreads) chunks.push_back(nreads);
+    LOG_INFO("Classifying %u reads with %" PRIu64 " bases in %zu chunks.\n", nreads, nbases, chunks.size() - 1);
+
+    std::fputs("#Threads\tDivision\tTasksPerChunk\tWall(ms)\tReads/s\tSpeedup\tModeledEfficiency\n", stdout);
+    double base_ms[2]{0, 0};
+    unsigned w(db.w_);
+    with_score_scheme(db.score_, db.k_, w, [&](auto scorer) {
+        for(const unsigned nthreads: thread_counts) {
+            ClassifierGeneric<decltype(scorer)> classifier(db.db_, db.s_, db.k_, w, nthreads, true, false, true, canon);
+            if(!db.ct_.empty()) classifier.set_table(&db.ct_);
+            classifier.set_table(&db.cht_);
+            classifier.set_table(&db.mbt_);
+            classifier.set_filter(&db.bf_);
+            ForPool pool(nthreads);
+            ClassifyArena<decltype(scorer)> arena(classifier);
+            ks::string out(256u);
+            for(int division(0); division < 2; ++division) {
+                double best(std::numeric_limits<double>::max());
+                u64 ntasks(0), makespan(0);
+                for(int rep(0); rep < nreps; ++rep) {
+                    ntasks = makespan = 0;
+                    auto start(std::chrono::steady_clock::now());
+                    for(size_t i(0); i + 1 < chunks.size(); ++i) {
+                        bseq1_t *const bs(all.data() + chunks[i]);
+                        const unsigned n(chunks[i + 1] - chunks[i]);
+                        out.clear();
+                        if(division == 0) plan_by_records(arena, bs, n, per_task);
+                        else              arena.plan(bs, n, 0, nthreads);
+                        classify_tasks(classifier, tax, bs, out, 0, pool, arena);
+                        ntasks += arena.ntasks(), makespan += modeled_makespan(arena, nthreads);
+                    }
+                    auto stop(std::chrono::steady_clock::now());
+                    best = std::min(best, std::chrono::duration<double, std::milli>(stop - start).count());
+                }
+                if(base_ms[division] == 0) base_ms[division] = best;
+                std::fprintf(stdout, "%u\t%s\t%0.1lf\t%0.2lf\t%0.0lf\t%0.2lf\t%0.3lf\n", nthreads, division ? "bases": "records",
+                             double(ntasks) / (chunks.size() - 1), best, nreads / best * 1e3, base_ms[division] / best,
+                             makespan ? double(nbases) / nthreads / makespan: 1.);
+            }
+        }
+    });
+    for(auto &bs: all) bseq_destroy(&bs);
+    return EXIT_SUCCESS;
+}
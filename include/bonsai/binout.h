@@ -0,0 +1,84 @@
+#pragma once
+#include "kspp/ks.h"
+#include "krakenout.h"
+#include "util.h"
+
+namespace bns {
+
+/*
+ * Binary per-read classification output, as written by classify -y.
+ *
+ * The text records spend most of their bytes and formatting time on read names and decimal taxids,
+ * which downstream tools then parse back. Here a file starts with CLS_BINARY_MAGIC, followed by one record per
+ * read (pair) output, of LEB128 varints:
+ *     the read index in the input (pairs count once), taxon, read length, missing and ambiguous k-mers,
+ *     the number of runs of hits, then each run's taxon and length.
+ * Runs are those of the text output (krakenout.h): consecutive hits to the same taxon. Unclassified reads have none.
+ * Fields are varints rather than fixed-width because they are mostly small: an unclassified 100-base read among
+ * the first 2M takes 8 bytes, where a fixed-width header alone took 24.
+ * Names are not stored: classify_decode recovers them from the reads, by index, when converting back to Kraken text.
+ */
+static const char CLS_BINARY_MAGIC[8] {'B', 'N', 'S', 'C', 'L', 'S', '\0', '\1'};
+
+struct cls_record_t { // A record's fields, before its runs.
+    u64 read_;
+    u32 taxon_;
+    u32 length_;
+    u32 missing_;
+    u32 ambig_;
+};
+
+INLINE void put_varint(u64 v, ks::string &out) {
+    char buf[10];
+    unsigned n(0);
+    for(; v >= 0x80; v >>= 7) buf[n++] = char(v | 0x80);
+    buf[n++] = char(v);
+    out.putsn_(buf, n);
+}
+
+// Returns false if the varint runs past end.
+INLINE bool get_varint(const char *&p, const char *end, u64 &v) {
+    v = 0;
+    for(unsigned shift(0); p < end && shift < 64; shift += 7) {
+        const u8 byte(*p++);
+        v |= u64(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Appends rec and its (taxon, length) runs to out.
+template<typename RunFunc>
+inline void put_binary_record(const cls_record_t &rec, size_t nruns, const RunFunc &for_each_run, ks::string &out) {
+    put_varint(rec.read_, out);
+    put_varint(rec.taxon_, out);
+    put_varint(rec.length_, out);
+    put_varint(rec.missing_, out);
+    put_varint(rec.ambig_, out);
+    put_varint(nruns, out);
+    for_each_run([&](tax_t taxon, u64 length) {put_varint(taxon, out), put_varint(length, out);});
+}
+
+// Reads the record at p, advancing p past it, and sets runs to its (taxon, length) runs.
+// Returns false at end, and throws if the record is truncated.
+inline bool read_binary_record(const char *&p, const char *end, cls_record_t &rec, std::vector<std::pair<tax_t, u32>> &runs) {
+    if(p == end) return false;
+    u64 fields[6], taxon, length;
+    for(auto &field: fields)
+        if(!get_varint(p, end, field)) RUNTIME_ERROR("Truncated binary classification record.");
+    rec = cls_record_t{fields[0], tax_t(fields[1]), u32(fields[2]), u32(fields[3]), u32(fields[4])};
+    runs.clear();
+    for(u64 nruns(fields[5]); nruns--;) {
+        if(!get_varint(p, end, taxon) || !get_varint(p, end, length)) RUNTIME_ERROR("Truncated binary classification record.");
+        runs.emplace_back(tax_t(taxon), u32(length));
+    }
+    return true;
+}
+
+// Appends the Kraken text record classify would have written for rec, with the given read name.
+inline void append_kraken_text(const cls_record_t &rec, const std::vector<std::pair<tax_t, u32>> &runs, const char *name, ks::string &out) {
+    append_kraken_header(rec.taxon_, name, rec.length_, rec.missing_, rec.ambig_, out);
+    append_kraken_runs(rec.taxon_, [&](auto &&put) {for(const auto &run: runs) put(run.first, run.second);}, out);
+}
+
+} // namespace bns
@@ -0,0 +1,121 @@
+#pragma once
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include "util.h"
+#if __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace bns {
+
+/*
+ * Read-only Bloom filter whose probes for a key all fall in one 64-byte block.
+ *
+ * Most k-mers from a metagenome are absent from the database. Rejecting one through
+ * the filter costs a single cache line, and the filter is small enough (bits_per_key / 8 bytes per key,
+ * against ~18 for CacheLineTable and more for khash) to stay in cache far longer than the table.
+ *
+ * Each key sets one bit in each of the block's eight words, chosen by multiplying a 32-bit hash by a
+ * different odd constant per word. A test needs no loop or data-dependent indexing, and with AVX2 takes
+ * a handful of vector instructions: ~4.5 ns for a cached block, against ~11 ns with the eight bits placed
+ * anywhere in the block by double hashing. The price is a fixed eight hashes and more false positives than
+ * an unblocked filter of the same size: 1.1% instead of 0.8% at 10 bits per key, 2.9% at 8 and 0.09% at 16.
+ *
+ * Keys which pass still need a lookup in the table, so the filter only pays off when most keys miss.
+ */
+struct alignas(64) bloom_block_t {
+    static constexpr unsigned NWORDS = 8;
+    u64 words_[NWORDS];
+};
+static_assert(sizeof(bloom_block_t) == 64, "bloom_block_t must be exactly one cache line.");
+
+class BlockedBloomFilter {
+    const bloom_block_t *data_;
+    bloom_block_t       *owned_;
+    u64                  nblocks_;
+
+    // murmur3's finalizer. Uses different constants from CacheLineTable::bucket so that keys sharing a
+    // table bucket do not also share filter bits.
+    static INLINE u64 hash(u64 key) {
+        key ^= key >> 33;
+        key *= UINT64_C(0xc4ceb9fe1a85ec53);
+        key ^= key >> 33;
+        key *= UINT64_C(0xff51afd7ed558ccd);
+        return key ^ (key >> 33);
+    }
+    // The block is chosen by the high bits of the hash and the bits within it by the low 32.
+    INLINE u64 block(u64 h) const {return static_cast<u64>((static_cast<__uint128_t>(h) * nblocks_) >> 64);}
+#define BNS_BLOOM_SALTS 0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+    static INLINE u64 bit(u32 h, unsigned word) {
+        static constexpr u32 SALTS[bloom_block_t::NWORDS] {BNS_BLOOM_SALTS};
+        return u64(1) << ((h * SALTS[word]) >> 26);
+    }
+public:
+    static constexpr u32 NHASHES = bloom_block_t::NWORDS;
+    BlockedBloomFilter(): data_(nullptr), owned_(nullptr), nblocks_(0) {}
+    // Non-owning view, e.g. into a memory-mapped database.
+    BlockedBloomFilter(const bloom_block_t *data, u64 nblocks): data_(data), owned_(nullptr), nblocks_(nblocks) {}
+    BlockedBloomFilter(const BlockedBloomFilter &) = delete;
+    BlockedBloomFilter(BlockedBloomFilter &&o): data_(o.data_), owned_(o.owned_), nblocks_(o.nblocks_) {
+        o.data_ = o.owned_ = nullptr;
+        o.nblocks_ = 0;
+    }
+    BlockedBloomFilter &operator=(BlockedBloomFilter &&o) {
+        std::swap(data_, o.data_);
+        std::swap(owned_, o.owned_);
+        std::swap(nblocks_, o.nblocks_);
+        return *this;
+    }
+    ~BlockedBloomFilter() {std::free(owned_);}
+
+    // An empty filter sized for nkeys at bits_per_key bits each.
+    BlockedBloomFilter(u64 nkeys, double bits_per_key): BlockedBloomFilter() {
+        if(!(bits_per_key > 0.)) RUNTIME_ERROR("Bits per key must be positive.");
+        nblocks_ = std::max(u64(1), static_cast<u64>(std::ceil(nkeys * bits_per_key / (sizeof(bloom_block_t) * CHAR_BIT))));
+        void *p;
+        if(posix_memalign(&p, sizeof(bloom_block_t), nblocks_ * sizeof(bloom_block_t)))
+            throw std::bad_alloc();
+        std::memset(p, 0, nblocks_ * sizeof(bloom_block_t));
+        data_ = owned_ = static_cast<bloom_block_t *>(p);
+    }
+    template<typename T>
+    static BlockedBloomFilter from_khash(const T *map, double bits_per_key) {
+        static_assert(std::is_same<T, khash_t(c)>::value, "Only khash_t(c) is supported.");
+        BlockedBloomFilter ret(kh_size(map), bits_per_key);
+        for(khiter_t ki(0); ki != kh_end(map); ++ki)
+            if(kh_exist(map, ki)) ret.insert(kh_key(map, ki));
+        return ret;
+    }
+    void insert(u64 key) {
+        assert(owned_);
+        const u64 h(hash(key));
+        bloom_block_t &b(owned_[block(h)]);
+        for(unsigned i(0); i < bloom_block_t::NWORDS; ++i) b.words_[i] |= bit(h, i);
+    }
+    // False only if key was never inserted.
+    INLINE bool may_contain(u64 key) const {
+        const u64 h(hash(key));
+        const bloom_block_t &b(data_[block(h)]);
+#if __AVX2__
+        // The same bits as bit(), computed for all eight words at once.
+        const __m256i shifts(_mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(u32(h)), _mm256_setr_epi32(BNS_BLOOM_SALTS)), 26)),
+                      one(_mm256_set1_epi64x(1));
+        const __m256i *words(reinterpret_cast<const __m256i *>(b.words_));
+        return _mm256_testc_si256(_mm256_load_si256(words), _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(shifts))))
+             & _mm256_testc_si256(_mm256_load_si256(words + 1), _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(shifts, 1))));
+#else
+        u64 missing(0);
+        for(unsigned i(0); i < bloom_block_t::NWORDS; ++i) missing |= bit(h, i) & ~b.words_[i];
+        return missing == 0;
+#endif
+    }
+    INLINE void prefetch(u64 key) const {__builtin_prefetch(data_ + block(hash(key)));}
+    const bloom_block_t *data() const {return data_;}
+    u64 nblocks()   const {return nblocks_;}
+    bool empty()    const {return nblocks_ == 0;}
+    size_t nbytes() const {return nblocks_ * sizeof(bloom_block_t);}
+#undef BNS_BLOOM_SALTS
+};
+
+} // namespace bns
@@ -0,0 +1,168 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include "util.h"
+#if __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace bns {
+
+/*
+ * Read-only k-mer -> taxon table in 32-bit slots, after Kraken 2's compact hash table.
+ *
+ * Keys are not stored. Each slot packs a fingerprint of its key (bits of the key's hash, above bit value_bits)
+ * with the index of its taxon in the table of taxa used (dense_taxa(), in the low value_bits bits), and keys are placed
+ * by linear probing. With the array holding at most a few hundred thousand taxa, this takes 4 / load bytes
+ * per key: 5.7 at the maximum load of 0.7, as in Kraken 2 (khash_t(c) takes 12.25 / load, with load between 0.38 and 0.77).
+ *
+ * The price is false positives. A lookup for an absent k-mer compares its fingerprint against each occupied slot
+ * before the first empty one, (1 / (1 - load)^2 - 1) / 2 slots on average, so it reports a taxon with probability
+ *     fpr = (1 / (1 - load)^2 - 1) / 2 / 2^(32 - value_bits).
+ * from_khash chooses the highest load (at most MAX_LOAD) that keeps fpr at or below the rate asked for:
+ * with 17 value bits, a rate of 1e-4 allows a load of 0.64.
+ * A k-mer in the table can likewise be shadowed by another whose fingerprint matches earlier in its probe sequence,
+ * in which case it reports that k-mer's taxon. from_khash counts these, which are rarer, since fewer slots precede a key
+ * than an empty slot.
+ *
+ * MAX_LOAD trades memory for speed rather than accuracy: the run of slots scanned for a miss grows as 1 / (1 - load)^2,
+ * to 50 slots at 0.9, 12 at 0.8 and 5 at 0.7, where a miss in a 30M-key table took 220, 78 and 50 ns.
+ * Probes do not wrap around: slots_ extends past nslots_ far enough to end every run and leave GROUP slots to spare,
+ * so that with AVX2 a lookup compares GROUP slots at a time without bounds checks.
+ *
+ * Taxon 0 is never stored, so it doubles as the "missing" return value.
+ */
+class CompactHashTable {
+    const u32          *slots_;
+    const tax_t        *taxa_;  // taxa_[0] is 0, and taxa_[i] the taxon of slots with value i.
+    std::vector<u32>    owned_slots_;
+    std::vector<tax_t>  owned_taxa_;
+    u64                 ntaxa_; // Including taxa_[0].
+    u64                 nslots_; // Slots a key can hash to.
+    u64                 nstored_; // Length of slots_: nslots_ and the tail runs spill into.
+    u64                 size_;
+    u32                 value_bits_;
+
+    // Not the hash CacheLineTable or BlockedBloomFilter use, so that a filter in front of this table is independent of it.
+    static INLINE u64 hash(u64 key) {
+        key ^= key >> 31;
+        key *= UINT64_C(0x7fb5d329728ea185);
+        key ^= key >> 27;
+        key *= UINT64_C(0x81dadef4bc2dd44d);
+        return key ^ (key >> 33);
+    }
+    // Slots are chosen by the high bits of the hash, fingerprints taken from the low 32.
+    INLINE u64 slot(u64 h) const {return static_cast<u64>((static_cast<__uint128_t>(h) * nslots_) >> 64);}
+    INLINE u32 value_mask() const {return (u32(1) << value_bits_) - 1;}
+public:
+    static constexpr double MAX_LOAD = 0.7;
+    static constexpr unsigned GROUP = 8;
+
+    CompactHashTable(): slots_(nullptr), taxa_(nullptr), ntaxa_(0), nslots_(0), nstored_(0), size_(0), value_bits_(0) {}
+    // Non-owning view, e.g. into a memory-mapped database.
+    CompactHashTable(const u32 *slots, u64 nslots, u64 nstored, const tax_t *taxa, u64 ntaxa, u64 size, u32 value_bits):
+        slots_(slots), taxa_(taxa), ntaxa_(ntaxa), nslots_(nslots), nstored_(nstored), size_(size), value_bits_(value_bits)
+    {
+        if(value_bits_ == 0 || value_bits_ > 24 || ntaxa_ == 0 || ntaxa_ - 1 > value_mask() || nstored_ < nslots_ + GROUP
+           || std::any_of(slots_ + nstored_ - GROUP, slots_ + nstored_, [](u32 s) {return s != 0;}))
+            RUNTIME_ERROR("Inconsistent CompactHashTable dimensions.");
+    }
+    CompactHashTable(const CompactHashTable &) = delete;
+    CompactHashTable(CompactHashTable &&o) = default;
+    CompactHashTable &operator=(CompactHashTable &&o) = default;
+
+    static double expected_fpr(double load, u32 value_bits) {
+        return (1. / ((1. - load) * (1. - load)) - 1.) / 2. / std::ldexp(1., 32 - value_bits);
+    }
+    // Highest load at which expected_fpr(load, value_bits) <= fpr.
+    static double load_for(double fpr, u32 value_bits) {
+        return std::min(double(MAX_LOAD), 1. - 1. / std::sqrt(2. * fpr * std::ldexp(1., 32 - value_bits) + 1.));
+    }
+    // fpr is the highest acceptable expected false-positive rate per absent key.
+    // If nshadowed is set, it receives the number of keys which read another key's taxon.
+    template<typename T>
+    static CompactHashTable from_khash(const T *map, double fpr, u64 *nshadowed=nullptr) {
+        static_assert(std::is_same<T, khash_t(c)>::value, "Only khash_t(c) is supported.");
+        if(!(fpr > 0. && fpr < 1.)) RUNTIME_ERROR("False-positive rate must be in (0, 1).");
+        CompactHashTable ret;
+        ret.owned_taxa_ = dense_taxa(map);
+        ret.ntaxa_ = ret.owned_taxa_.size();
+        const u64 ntaxa(ret.ntaxa_ - 1);
+        ret.value_bits_ = ntaxa ? 64 - __builtin_clzll(ntaxa): 1;
+        if(ret.value_bits_ > 24)
+            RUNTIME_ERROR(ks::sprintf("%zu taxa leave too few bits for fingerprints in a CompactHashTable.", size_t(ntaxa)).data());
+        const double load(load_for(fpr, ret.value_bits_));
+        ret.nslots_ = std::max(u64(1), static_cast<u64>(std::ceil(kh_size(map) / load)));
+        ret.owned_slots_.assign(ret.nslots_ + GROUP, 0);
+        u64 shadowed(0);
+        for(khiter_t ki(0); ki != kh_end(map); ++ki) {
+            if(!kh_exist(map, ki)) continue;
+            shadowed += !ret.insert(kh_key(map, ki), dense_index(ret.owned_taxa_, kh_val(map, ki)));
+        }
+        ret.slots_   = ret.owned_slots_.data();
+        ret.nstored_ = ret.owned_slots_.size();
+        ret.taxa_    = ret.owned_taxa_.data();
+        if(nshadowed) *nshadowed = shadowed;
+        return ret;
+    }
+private:
+    // Returns false, leaving the table unchanged, if a key with the same fingerprint is found first.
+    // Keeps GROUP empty slots at the end of owned_slots_.
+    bool insert(u64 key, u32 value) {
+        assert(value && value <= value_mask());
+        const u64 h(hash(key));
+        const u32 fp(u32(h) & ~value_mask());
+        for(u64 i(slot(h));; ++i) {
+            u32 &s(owned_slots_[i]);
+            if(s == 0) {
+                s = fp | value;
+                ++size_;
+                if(i + GROUP >= owned_slots_.size()) owned_slots_.push_back(0);
+                return true;
+            }
+            if((s & ~value_mask()) == fp) return false;
+        }
+    }
+public:
+    // Returns 0 if key is absent, or, with the probability documented above, the taxon of another key.
+    INLINE tax_t get(u64 key) const {
+        const u64 h(hash(key));
+        const u32 fp(u32(h) & ~value_mask());
+        const u32 *p(slots_ + slot(h));
+#if __AVX2__
+        // An empty slot whose fingerprint bits match is returned as taxa_[0], which is 0 too.
+        const __m256i fps(_mm256_set1_epi32(fp)), mask(_mm256_set1_epi32(~value_mask()));
+        for(;; p += GROUP) {
+            const __m256i v(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+            const unsigned empty(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, _mm256_setzero_si256())))),
+                           match(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(v, mask), fps))));
+            if(empty | match) {
+                const unsigned i(__builtin_ctz(empty | match));
+                return taxa_[p[i] & value_mask()];
+            }
+        }
+#else
+        for(;; ++p) {
+            if(*p == 0) return 0;
+            if((*p & ~value_mask()) == fp) return taxa_[*p & value_mask()];
+        }
+#endif
+    }
+    INLINE void prefetch(u64 key) const {__builtin_prefetch(slots_ + slot(hash(key)));}
+    // Calls func(taxon) for each key stored.
+    template<typename Func>
+    void for_each_taxon(const Func &func) const {
+        for(u64 i(0); i < nstored_; ++i) if(slots_[i]) func(taxa_[slots_[i] & value_mask()]);
+    }
+    const u32   *data()  const {return slots_;}
+    const tax_t *taxa()  const {return taxa_;}
+    u64 ntaxa()          const {return ntaxa_;}
+    u64 nslots()         const {return nslots_;}
+    u64 nstored()        const {return nstored_;}
+    u64 size()           const {return size_;}
+    u32 value_bits()     const {return value_bits_;}
+    bool empty()         const {return size_ == 0;}
+    size_t nbytes()      const {return nstored_ * sizeof(u32);}
+};
+
+} // namespace bns
@@ -1,13 +1,48 @@
 #pragma once
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <mutex>
+#include <numeric>
 #include "kspp/ks.h"
+#include "binout.h"
+#include "blockbloom.h"
+#include "chtable.h"
+#include "cltable.h"
 #include "encoder.h"
 #include "feature_min.h"
+#include "hostfilter.h"
+#include "krakenout.h"
+#include "mask.h"
+#include "mbtable.h"
 #include "klib/kthread.h"
+#include "pdecompress.h"
+#include "taxindex.h"
 #include "util.h"
 
 namespace bns {
-using tax_counter = linear::counter<tax_t, u16>;
+// Hits per taxon, as linear::counter counts them: by linear search, as a read hits few taxa.
+// Counts are 32-bit, as a long read can hit one taxon more than 65535 times. clear() keeps the capacity,
+// so that a worker's counters stop allocating after the first few reads.
+class tax_counter {
+    std::vector<tax_t> keys_;
+    std::vector<u32>   vals_;
+public:
+    void add(tax_t key, u32 inc=1) {
+        const auto it(std::find(keys_.begin(), keys_.end(), key));
+        if(it == keys_.end()) keys_.push_back(key), vals_.push_back(inc);
+        else                  vals_[it - keys_.begin()] += inc;
+    }
+    u32 count(tax_t key) const {
+        const auto it(std::find(keys_.begin(), keys_.end(), key));
+        return it == keys_.end() ? 0: vals_[it - keys_.begin()];
+    }
+    size_t size() const {return keys_.size();}
+    void clear() {keys_.clear(), vals_.clear();}
+    const std::vector<tax_t> &keys() const {return keys_;}
+    const std::vector<u32>   &vals() const {return vals_;}
+};
 
 static void append_kraken_classification(const tax_counter &hit_counts,
                                   const std::vector<tax_t> &taxa,
@@ -20,122 +55,110 @@ static void append_fastq_classification(const tax_counter &hit_counts,
 static void append_taxa_runs(tax_t taxon, const std::vector<tax_t> &taxa, kstring_t *bks);
 
 
-enum output_format: int {
-    KRAKEN   = 1,
-    FASTQ    = 2,
-    EMIT_ALL = 4
-};
+// How many k-mers ahead of the one being resolved classify_seq prefetches.
+// Enough to keep ~10-16 outstanding misses per core without evicting lines before use.
+static constexpr unsigned CLASSIFY_PREFETCH_DIST = 16;
 
+// Reads (or windows) with at least this many hits are counted by sorting them rather than by a linear search
+// of the counter per hit, which degrades with the number of distinct taxa a long read hits.
+static constexpr unsigned CLASSIFY_SORT_COUNT_MIN = 512;
 
-INLINE void append_taxa_run(const tax_t last_taxa,
-                            const u32 taxa_run,
-                            ks::string &bks) {
-    // U for unclassified (unambiguous but not in database)
-    // A for ambiguous: ambiguous nucleotides
-    // Actual taxon otherwise.
-    switch(last_taxa) {
-        case 0:            bks.putc_('U'); break;
-        case (tax_t)-1:    bks.putc_('A'); break;
-        default:           bks.putuw_(last_taxa); break;
-    }
-    bks.putc_(':'); bks.putuw_(taxa_run); bks.putc_('\t');
-}
+// Bases process_dataset reads per chunk by default. Long reads get larger chunks so that a chunk still splits
+// into enough tasks to keep every thread busy; memory is bounded by the base count either way.
+static constexpr int CLASSIFY_CHUNK_BASES           = 1 << 20;
+static constexpr int CLASSIFY_LONG_READ_CHUNK_BASES = 1 << 26;
 
+// Taxa listed in a hit summary (see ClassifierGeneric::set_summarize_hits) before the rest are pooled.
+static constexpr unsigned CLASSIFY_SUMMARY_TAXA = 16;
 
-inline void append_taxa_runs(tax_t taxon, const std::vector<tax_t> &taxa, ks::string &bks) {
-    if(taxon) {
-        tax_t last_taxa(taxa[0]);
-        unsigned taxa_run(1);
-        for(unsigned i(1), end(taxa.size()); i != end; ++i) {
-            if(taxa[i] == last_taxa) ++taxa_run;
-            else {
-                append_taxa_run(last_taxa, taxa_run, bks);
-                last_taxa = taxa[i];
-                taxa_run  = 1;
-            }
-        }
-        append_taxa_run(last_taxa, taxa_run, bks); // Add last run.
-        bks.back() = '\n'; // We add an extra tab. Replace  that with a newline.
-        bks.terminate();
-    } else bks.putsn("0:0\n", 4);
-}
+// Largest LookupCache, in log2 entries: 4 GiB per thread.
+static constexpr unsigned CLASSIFY_MAX_CACHE_BITS = 28;
 
-INLINE void append_counts(u32 count, const char character, ks::string &ks) {
-    if(count) {
-        char buf[] {character, ':'};
-        ks.putsn_(buf, 2);
-        ks.putuw_(count);
-        ks.putc_('\t');
-    }
-}
+/*
+ * Direct-mapped k-mer -> taxon cache, one per classifying thread, in front of the database.
+ *
+ * High-coverage samples (amplicons, host-heavy data) and overlapping mates look up the same k-mers again and again.
+ * Each k-mer maps to one entry, which holds the last k-mer looked up there and its taxon, missing k-mers included.
+ * An entry is 16 bytes, so a cache of 2^16 entries fits in L2; a hit costs a cached line rather than a probe
+ * of the database. Hits and lookups are counted, and ClassifierGeneric::n_cache_hits sums them over threads.
+ */
+class LookupCache {
+    struct entry_t {
+        u64   key_;
+        tax_t tax_;
+    };
+    std::vector<entry_t> entries_;
+    u32                  shift_;
+public:
+    std::vector<u64>   missed_; // Scratch for ClassifierGeneric::lookup_batch_cached.
+    std::vector<u32>   positions_;
+    std::vector<tax_t> taxa_;
+    u64 hits_ = 0, lookups_ = 0;
 
-inline void append_fastq_classification(const tax_counter &,
-                                 const std::vector<tax_t> &taxa,
-                                 const tax_t taxon, const u32 ambig_count, const u32 missing_count,
-                                 bseq1_t *bs, ks::string &bks, const int verbose, const int is_paired) {
-    char *cms, *cme; // comment start, comment end -- used for using comment in both output reads.
-    bks.puts(bs->name);
-    bks.putc_(' ');
-    cms = bks.data() + bks.size();
-    static const char lut[] {'C', 'U'};
-    char tmp[] {lut[taxon == 0], '\t'};
-    bks.putsn_(tmp, 2);
-    bks.putuw_(taxon);
-    bks.putc_('\t');
-    bks.putl_(bs->l_seq);
-    bks.putc_('\t');
-    append_counts(missing_count, 'M', bks);
-    append_counts(ambig_count,   'A', bks);
-    if(verbose) append_taxa_runs(taxon, taxa, bks);
-    else        bks.back() = '\n';
-    cme = bks.end();
-    // And now add the rest of the fastq record
-    bks.putsn_(bs->seq, bs->l_seq);
-    bks.putsn_("\n+\n", 3);
-    bks.putsn_(bs->qual ? bs->qual: bs->seq, bs->l_seq); // Append sequence if it's a fasta record
-    bks.putc_('\n');
-    if(is_paired) {
-        bks.puts((bs + 1)->name);
-        bks.putc_(' ');
-        bks.putsn_(cms, (int)(cme - cms)); // Add comment section in.
-        bks.putc_('\n');
-        bks.putsn_((bs + 1)->seq, (bs + 1)->l_seq);
-        bks.putsn_("\n+\n", 3);
-        bks.putsn_((bs + 1)->qual ? (bs + 1)->qual: (bs + 1)->seq, (bs + 1)->l_seq);
-        bks.putc_('\n');
+    // bits is the log2 number of entries. 0 disables the cache.
+    explicit LookupCache(unsigned bits=0): shift_(64 - bits) {
+        if(bits > CLASSIFY_MAX_CACHE_BITS) RUNTIME_ERROR(ks::sprintf("Lookup cache of 2^%u entries is too large.", bits).data());
+        if(bits == 0) return;
+        // Each entry starts out holding a key which does not map to it, so that no key hits before it is inserted.
+        u64 absent(0);
+        while(slot(absent) == 0) ++absent;
+        entries_.assign(size_t(1) << bits, entry_t{0, 0});
+        entries_[0].key_ = absent;
     }
-    bks.terminate();
-}
+    INLINE size_t slot(u64 key) const {return (key * UINT64_C(0x9e3779b97f4a7c15)) >> shift_;}
+    // Sets tax and returns true if key is cached.
+    INLINE bool get(u64 key, tax_t &tax) const {
+        const entry_t &e(entries_[slot(key)]);
+        tax = e.tax_;
+        return e.key_ == key;
+    }
+    INLINE void put(u64 key, tax_t tax) {entries_[slot(key)] = entry_t{key, tax};}
+    bool enabled() const {return !entries_.empty();}
+    size_t size()  const {return entries_.size();}
+    size_t nbytes() const {return entries_.size() * sizeof(entry_t);}
+};
 
+enum output_format: int {
+    KRAKEN   = 1,
+    FASTQ    = 2,
+    EMIT_ALL = 4,
+    BINARY   = 8  // cls_record_t records (binout.h) instead of text.
+};
 
 
-inline void append_kraken_classification(const tax_counter &,
-                                  const std::vector<tax_t> &taxa,
-                                  const tax_t taxon, const u32 ambig_count, const u32 missing_count,
-                                  bseq1_t *bs, ks::string &bks) {
-    static const char tbl[]{'C', 'U'};
-    bks.putc_(tbl[!taxon]);
-    bks.putc_('\t');
-    bks.puts(bs->name);
-    bks.putc_('\t');
-    bks.putuw_(taxon);
-    bks.putc_('\t');
-    bks.putw_(bs->l_seq);
-    bks.putc_('\t');
-    append_counts(missing_count, 'M', bks);
-    append_counts(ambig_count,   'A', bks);
-    append_taxa_runs(taxon, taxa, bks);
-    bks.terminate();
+inline void append_taxa_runs(tax_t taxon, const std::vector<tax_t> &taxa, ks::string &bks) {
+    append_kraken_runs(taxon, [&](auto &&put) {for_each_taxa_run(taxa.data(), taxa.data() + taxa.size(), put);}, bks);
 }
 
 template<typename ScoreType>
 struct ClassifierGeneric {
     const khash_t(c) *db_;
+    const CacheLineTable *ct_; // If set, used instead of db_ for lookups.
+    const CompactHashTable *cht_; // Likewise, for compact databases, which have no db_.
+    const MinimizerBinTable *mbt_; // Likewise, for binned databases, which have no db_.
+    const BlockedBloomFilter *bf_; // If set, k-mers it rejects are reported missing without a lookup.
+    const HostFilter *host_;   // If set, reads it recognizes are screened out before classification.
+    double host_fraction_;     // Fraction of a read's k-mers host_ must contain for the read to be screened out.
+    bool prefetch_khash_;      // Prefetch db_ buckets in lookup_batch. Other tables are always prefetched.
+    bool summarize_hits_;      // Report hits per taxon instead of every run of hits.
+    u32  window_;              // If nonzero, also classify each window of this many k-mer positions.
+    u32  cache_bits_;          // If nonzero, each thread caches lookups in a LookupCache of 2^cache_bits_ entries.
+    u32  min_quality_;         // If nonzero, bases with lower Phred scores are masked before k-mers are taken.
+    u32  dust_threshold_;      // If nonzero, low-complexity windows scoring above this are masked (mask.h).
+    bool report_only_;         // Count reads per taxon instead of formatting a record for each.
     const Spacer sp_;
     Encoder<ScoreType> enc_;
     uint32_t          nt_:16;
     uint32_t output_flag_:16;
     mutable std::atomic<u64> classified_[2];
+    mutable std::atomic<u64> cache_hits_, cache_lookups_; // Summed over threads' LookupCaches.
+    mutable std::atomic<u64> masked_[2]; // Bases masked for low quality and low complexity.
+    mutable std::atomic<u64> host_reads_, screened_reads_; // Reads (pairs) screened out as host, of those screened.
+    mutable std::atomic<u64> screen_ns_, classify_ns_; // Thread time screening, and classifying the rest, with host_ set.
+    mutable std::mutex       taxon_reads_mutex_;
+    mutable std::vector<u64> taxon_reads_; // In report-only mode, reads assigned to each dense taxon index, once merged.
+    std::vector<std::pair<const ClassifierGeneric *, const TaxonomyIndex *>> databases_; // Also classified against; see add_database.
+    std::vector<CladeSet> extract_; // Reads assigned a taxon in each are also written out; see add_extraction.
     public:
     void set_emit_all(bool setting) {
         if(setting) output_flag_ |= output_format::EMIT_ALL;
@@ -152,14 +175,36 @@ struct ClassifierGeneric {
     INLINE int get_emit_all()    const {return output_flag_ & output_format::EMIT_ALL;}
     INLINE int get_emit_kraken() const {return output_flag_ & output_format::KRAKEN;}
     INLINE int get_emit_fastq()  const {return output_flag_ & output_format::FASTQ;}
+    void set_emit_binary(bool setting) {
+        if(setting) output_flag_ |= output_format::BINARY;
+        else        output_flag_ &= (~output_format::BINARY);
+    }
+    INLINE int get_emit_binary() const {return output_flag_ & output_format::BINARY;}
     ClassifierGeneric(const khash_t(c) *map, const spvec_t &spaces, u8 k, std::uint16_t wsz, int num_threads=16,
                       bool emit_all=true, bool emit_fastq=true, bool emit_kraken=false, bool canonicalize=true):
         db_(map),
+        ct_(nullptr),
+        cht_(nullptr),
+        mbt_(nullptr),
+        bf_(nullptr),
+        host_(nullptr),
+        host_fraction_(HOST_DEFAULT_FRACTION),
+        prefetch_khash_(false),
+        summarize_hits_(false),
+        window_(0),
+        cache_bits_(0),
+        min_quality_(0),
+        dust_threshold_(0),
+        report_only_(false),
         sp_(k, wsz, spaces),
         enc_(sp_, canonicalize),
-        nt_(num_threads > 0 ? (uint16_t)(num_threads): (uint16_t)std::thread::hardware_concurrency())
+        nt_(num_threads > 0 ? (uint16_t)(num_threads): (uint16_t)std::thread::hardware_concurrency()),
+        output_flag_(0)
     {
         for(auto &c: classified_) c.store(0);
+        cache_hits_.store(0), cache_lookups_.store(0);
+        for(auto &m: masked_) m.store(0);
+        host_reads_.store(0), screened_reads_.store(0), screen_ns_.store(0), classify_ns_.store(0);
         set_emit_all(emit_all);
         set_emit_fastq(emit_fastq);
         set_emit_kraken(emit_kraken);
@@ -167,8 +212,211 @@ struct ClassifierGeneric {
     ClassifierGeneric(const char *dbpath, const spvec_t &spaces, u8 k, std::uint16_t wsz, int num_threads=16,
                       bool emit_all=true, bool emit_fastq=true, bool emit_kraken=false, bool canonicalize=true):
         ClassifierGeneric(khash_load<khash_t(c)>(dbpath), spaces, k, wsz, num_threads, emit_all, emit_fastq, emit_kraken, canonicalize) {}
+    // Selects the table used for lookups. Passing null or an empty table reverts to db_.
+    void set_table(const CacheLineTable *table) {
+        ct_ = table && !table->empty() ? table: nullptr;
+    }
+    void set_table(const CompactHashTable *table) {
+        cht_ = table && !table->empty() ? table: nullptr;
+    }
+    void set_table(const MinimizerBinTable *table) {
+        mbt_ = table && !table->empty() ? table: nullptr;
+    }
+    void set_table(std::nullptr_t) {ct_ = nullptr, cht_ = nullptr, mbt_ = nullptr;}
+    // Selects a filter to consult before each lookup. Passing null or an empty filter disables it.
+    void set_filter(const BlockedBloomFilter *filter) {
+        bf_ = filter && !filter->empty() ? filter: nullptr;
+    }
+    // Screens reads against filter before classifying them: a read (pair) at least fraction of whose k-mers
+    // the filter contains is dropped, or passed to classify_tasks' host output. Passing null disables screening.
+    // Call before creating a ClassifyArena, whose workers copy the filter's encoder.
+    void set_host_filter(const HostFilter *filter, double fraction=HOST_DEFAULT_FRACTION) {
+        if(!(fraction > 0. && fraction <= 1.)) RUNTIME_ERROR("Host k-mer fraction must be in (0, 1].");
+        if(filter && filter->k() > Spacer::max_k) RUNTIME_ERROR("Host filter k is too large.");
+        host_ = filter;
+        host_fraction_ = fraction;
+    }
+    // Also classifies each read against other's database and taxonomy, in the same pass: reads are encoded once,
+    // and each k-mer looked up in every database. other's tables, output format, counts and report are its own,
+    // and its records go to an output of their own (see process_dataset). Masking and host screening are this classifier's.
+    // other must have the same k, spacing and canonicalization; w may differ.
+    // Call before creating a ClassifyArena, which sets up buffers for each database.
+    void add_database(const ClassifierGeneric &other, const TaxonomyIndex &tax) {
+        if(other.sp_.k_ != sp_.k_ || other.sp_.s_ != sp_.s_ || other.enc_.canonicalize() != enc_.canonicalize())
+            RUNTIME_ERROR("Databases classified together must have the same k, spacing and canonicalization.");
+        if(!other.databases_.empty()) RUNTIME_ERROR("A database classified alongside another cannot have databases of its own.");
+        databases_.emplace_back(&other, &tax);
+    }
+    // Also writes out each read (pair) assigned a taxon in clades, as FASTA/FASTQ records, pairs interleaved, to an output
+    // of its own (see process_dataset), e.g., to pull out a pathogen's reads or strip a contaminant's without a second pass.
+    // Reads are tested against every extraction added, by the taxon this classifier assigns them. Host reads screened out are not.
+    // Call before creating a ClassifyArena.
+    void add_extraction(CladeSet clades) {extract_.push_back(std::move(clades));}
+    // Returns 0 if kmer is not in the database.
+    INLINE tax_t lookup(u64 kmer) const {
+        if(bf_ && !bf_->may_contain(kmer)) return 0;
+        return lookup_table(kmer);
+    }
+    // As lookup, without the filter.
+    INLINE tax_t lookup_table(u64 kmer) const {
+        if(ct_) return ct_->get(kmer);
+        if(cht_) return cht_->get(kmer);
+        if(mbt_) return mbt_->get(kmer);
+        khiter_t ki(kh_get(c, db_, kmer));
+        return ki == kh_end(db_) ? 0: kh_val(db_, ki);
+    }
+    void set_prefetch_khash(bool setting) {prefetch_khash_ = setting;}
+    // For long reads, whose runs of hits can run to megabytes: replaces the runs with <taxid>:<count> for the
+    // CLASSIFY_SUMMARY_TAXA taxa hit most, followed by O:<count> for hits to any other taxa.
+    void set_summarize_hits(bool setting) {summarize_hits_ = setting;}
+    // Adds a W: field listing the taxon each window of nkmers k-mers is assigned, e.g., to spot chimeric long reads.
+    // On a windowed database a window holds nkmers minimizer windows, so windows start at fixed positions either way.
+    // Windows restart at the second read of a pair. 0 disables.
+    void set_window(u32 nkmers) {window_ = nkmers;}
+    // Masks bases with Phred scores below min_quality, in reads with qualities. 0 disables.
+    void set_min_quality(u32 min_quality) {min_quality_ = min_quality;}
+    // Masks low-complexity windows scoring above threshold (20 as in dustmasker). 0 disables.
+    void set_dust_threshold(u32 threshold) {dust_threshold_ = threshold;}
+    // Skips per-read output: each thread counts the reads assigned to each taxon, and ClassifyArena::merge_taxon_reads
+    // adds the counts up at the end, for write_report.
+    void set_report_only(bool setting) {report_only_ = setting;}
+    // Adds reads per dense taxon index to the totals.
+    void add_taxon_reads(const std::vector<u64> &counts) const {
+        std::lock_guard<std::mutex> lock(taxon_reads_mutex_);
+        if(taxon_reads_.size() < counts.size()) taxon_reads_.resize(counts.size());
+        for(size_t i(0); i < counts.size(); ++i) taxon_reads_[i] += counts[i];
+    }
+    // Writes a kraken-report style clade report of the reads counted in report-only mode.
+    void write_report(const TaxonomyIndex &tax, std::FILE *fp) const {
+        std::lock_guard<std::mutex> lock(taxon_reads_mutex_);
+        taxon_reads_.resize(tax.size() + 1);
+        write_kraken_report(tax, taxon_reads_, n_unclassified(), fp);
+    }
+    // Zeroes the read, base and time counts and the report, e.g., between samples classified with one classifier.
+    void reset_counts() {
+        for(auto &c: classified_) c.store(0);
+        cache_hits_.store(0), cache_lookups_.store(0);
+        for(auto &m: masked_) m.store(0);
+        host_reads_.store(0), screened_reads_.store(0), screen_ns_.store(0), classify_ns_.store(0);
+        std::lock_guard<std::mutex> lock(taxon_reads_mutex_);
+        taxon_reads_.clear();
+    }
+    // Gives each thread a LookupCache of 2^bits entries. 0 disables caching.
+    void set_cache_bits(u32 bits) {
+        if(bits > CLASSIFY_MAX_CACHE_BITS) RUNTIME_ERROR(ks::sprintf("Lookup cache of 2^%u entries is too large.", bits).data());
+        cache_bits_ = bits;
+    }
+    // Prefetches the lines the first probe for kmer will read.
+    INLINE void prefetch(u64 kmer) const {
+        if(ct_) {
+            ct_->prefetch(kmer);
+            return;
+        }
+        if(cht_) {
+            cht_->prefetch(kmer);
+            return;
+        }
+        if(mbt_) { // The bin's keys can only be prefetched once its bounds have arrived; lookup_batch does both.
+            mbt_->prefetch_bounds(mbt_->minimizer(kmer));
+            return;
+        }
+        // Values are only needed on hits, which are the minority.
+        const khint_t i(kh_int64_hash_func(kmer) & (db_->n_buckets - 1));
+        __builtin_prefetch(db_->flags + (i >> 4));
+        __builtin_prefetch(db_->keys + i);
+    }
+    // Calls func(lookup(kmers[i])) for i in [beg, end), in order, prefetching CLASSIFY_PREFETCH_DIST ahead.
+    // n bounds the prefetches, so a buffer resolved in several ranges keeps the pipeline full across them.
+    // The first range should start at 0, which primes the pipeline.
+    template<typename Func>
+    INLINE void lookup_batch(const u64 *kmers, size_t beg, size_t end, size_t n, const Func &func) const {
+        if(mbt_ && !ct_ && !cht_) {
+            // Consecutive k-mers mostly share a bin, whose bounds the cache keeps and whose keys are then cached,
+            // so bins rather than k-mers are prefetched, by the first k-mer of each run sharing a minimizer:
+            // bounds BIN_AHEAD k-mers ahead, then keys CLASSIFY_PREFETCH_DIST ahead. Minimizers are computed once,
+            // into a ring of the next BIN_AHEAD. Prefetches stay within [beg, end).
+            // The filter is skipped: a k-mer it rejects would save little, and one it passes would cost a miss of its own.
+            static constexpr size_t BIN_AHEAD = 3 * CLASSIFY_PREFETCH_DIST, RING = 64;
+            static_assert(BIN_AHEAD < RING && (RING & (RING - 1)) == 0, "RING must be a power of two holding BIN_AHEAD minimizers.");
+            MinimizerBinTable::bin_cache_t cache;
+            u64 minimizers[RING];
+            size_t ahead(beg);
+            auto advance = [&]() {
+                const u64 m(mbt_->minimizer(kmers[ahead]));
+                if(ahead == beg || m != minimizers[(ahead - 1) % RING]) mbt_->prefetch_bounds(m);
+                minimizers[ahead++ % RING] = m;
+            };
+            for(const size_t e(std::min(end, beg + BIN_AHEAD)); ahead < e; advance());
+            for(size_t i(beg); i < end; ++i) {
+                if(ahead < end) advance();
+                const size_t j(i + CLASSIFY_PREFETCH_DIST);
+                if(j < end && minimizers[j % RING] != minimizers[(j - 1) % RING]) mbt_->prefetch_keys(minimizers[j % RING]);
+                func(mbt_->get(kmers[i], minimizers[i % RING], cache));
+            }
+            return;
+        }
+        if(bf_) {
+            // Filter blocks are prefetched ahead of the table lines, which are only prefetched for the few k-mers
+            // passing the filter: the filter is tested CLASSIFY_PREFETCH_DIST k-mers ahead and its blocks fetched twice as far
+            // ahead. Testing again at i reads lines already fetched, and keeps ranges independent of each other.
+            const bool prefetch_table(ct_ || cht_ || prefetch_khash_);
+            const size_t dist(prefetch_table ? 2 * CLASSIFY_PREFETCH_DIST: CLASSIFY_PREFETCH_DIST);
+            if(beg == 0)
+                for(size_t i(0), e(std::min(n, dist)); i < e; bf_->prefetch(kmers[i++]));
+            for(size_t i(beg); i < end; ++i) {
+                if(i + dist < n) bf_->prefetch(kmers[i + dist]);
+                if(prefetch_table && i + CLASSIFY_PREFETCH_DIST < n && bf_->may_contain(kmers[i + CLASSIFY_PREFETCH_DIST]))
+                    prefetch(kmers[i + CLASSIFY_PREFETCH_DIST]);
+                func(bf_->may_contain(kmers[i]) ? lookup_table(kmers[i]): tax_t(0));
+            }
+            return;
+        }
+        if(!ct_ && !cht_ && !prefetch_khash_) {
+            // A khash probe needs two to three lines, and in classify_bench prefetching them cost more than it hid.
+            for(size_t i(beg); i < end; func(lookup_table(kmers[i++])));
+            return;
+        }
+        if(beg == 0)
+            for(size_t i(0), e(std::min(n, size_t(CLASSIFY_PREFETCH_DIST))); i < e; prefetch(kmers[i++]));
+        for(size_t i(beg); i < end; ++i) {
+            if(i + CLASSIFY_PREFETCH_DIST < n) prefetch(kmers[i + CLASSIFY_PREFETCH_DIST]);
+            func(lookup_table(kmers[i]));
+        }
+    }
+    // As lookup_batch, answering from cache the k-mers it holds. The rest are looked up together, then cached.
+    template<typename Func>
+    INLINE void lookup_batch_cached(const u64 *kmers, size_t beg, size_t end, LookupCache &cache, const Func &func) const {
+        std::vector<u64> &missed(cache.missed_);
+        std::vector<u32> &positions(cache.positions_);
+        std::vector<tax_t> &taxa(cache.taxa_);
+        missed.clear(), positions.clear();
+        taxa.resize(end - beg);
+        for(size_t i(beg); i < end; ++i)
+            if(!cache.get(kmers[i], taxa[i - beg])) missed.push_back(kmers[i]), positions.push_back(i - beg);
+        cache.lookups_ += end - beg;
+        cache.hits_    += end - beg - missed.size();
+        size_t j(0);
+        lookup_batch(missed.data(), 0, missed.size(), missed.size(), [&](tax_t tax) {
+            cache.put(missed[j], tax);
+            taxa[positions[j++]] = tax;
+        });
+        for(const tax_t tax: taxa) func(tax);
+    }
     u64 n_classified()   const {return classified_[0];}
     u64 n_unclassified() const {return classified_[1];}
+    u64 n_masked_low_quality()    const {return masked_[0];}
+    u64 n_masked_low_complexity() const {return masked_[1];}
+    u64 n_cache_hits()    const {return cache_hits_;}
+    u64 n_cache_lookups() const {return cache_lookups_;}
+    u64 n_host_reads()     const {return host_reads_;}
+    u64 n_screened_reads() const {return screened_reads_;}
+    double screen_seconds()   const {return screen_ns_ * 1e-9;}
+    double classify_seconds() const {return classify_ns_ * 1e-9;}
+    // Thread time not spent classifying host reads, net of screening, estimated from the time taken by the others.
+    double host_seconds_saved() const {
+        const u64 nclassified(screened_reads_ - host_reads_);
+        return (nclassified ? classify_seconds() / nclassified * host_reads_: 0.) - screen_seconds();
+    }
 };
 
 INLINE void append_taxa_run(const tax_t last_taxa,
@@ -197,143 +445,705 @@ INLINE void append_counts(u32 count, const char character, kstring_t *ks) {
 }
 
 using Classifier = ClassifierGeneric<score::Lex>;
+
+// Calls func(ScoreType()) for the ScoreType by which a database built with scheme chose its minimizers.
+// Feature-count and taxonomic-depth minimizers are chosen by scores the database does not keep, so for those
+// w is set to k: looking up every k-mer still finds each window's minimizer.
+template<typename Func>
+void with_score_scheme(score_scheme scheme, unsigned k, unsigned &w, const Func &func) {
+    switch(scheme) {
+        case LEX:     func(score::Lex());     break;
+        case ENTROPY: func(score::Entropy()); break;
+        case TAX_DEPTH: case FEATURE_COUNT:
+            if(w > k) LOG_WARNING("Minimizers were chosen by scores not stored in the database. Looking up every k-mer.\n");
+            w = k;
+            func(score::Lex());
+            break;
+        default: RUNTIME_ERROR(ks::sprintf("Unknown score scheme %i in database.", int(scheme)).data());
+    }
+}
+
+// Per-thread state reused across reads and chunks. Once its buffers have grown to fit
+// the longest read (pair), classifying a read does not touch the heap.
+template<typename ScoreType>
+struct ClassifyWorker {
+    Encoder<ScoreType> enc_;
+    std::vector<tax_t> taxa_;
+    std::vector<u64>   kmers_;
+    std::vector<u32>   runs_;    // Windows in a row sharing each minimizer in kmers_, if windowed.
+    tax_counter        hit_counts_;
+    std::vector<u32>   dense_;   // Scratch for resolve_tree.
+    std::vector<tax_t> sorted_;  // Scratch for count_taxa.
+    std::vector<u32>   order_;   // Scratch for append_hit_summary.
+    tax_counter        window_counts_;
+    std::vector<tax_t> windows_; // Taxon of each window, if windowed.
+    LookupCache        cache_;
+    std::vector<char>  masked_;  // Copy of the read being masked, if masking.
+    u64                nmasked_[2] {0, 0}; // Bases masked for low quality and low complexity, until added to the classifier's.
+    std::unique_ptr<Encoder<score::Lex>> host_enc_; // Copy of the host filter's encoder, if screening.
+    std::vector<char>  host_;    // Whether each read (pair) of the current task was screened out.
+    std::vector<u64>   taxon_reads_; // Reads assigned to each dense taxon index, in report-only mode.
+    size_t             nfirst_ = 0;  // K-mers taken from the first read of the pair, when encoding for several databases.
+    tax_t              taxon_ = 0;   // Taxon assigned to the read (pair) last classified.
+    ClassifyWorker(const Encoder<ScoreType> &enc, unsigned cache_bits=0, const HostFilter *host=nullptr):
+        enc_(enc), cache_(cache_bits), host_enc_(host ? new Encoder<score::Lex>(host->enc_): nullptr) {}
+};
+
+// classify_seqs splits a chunk into about this many tasks per thread, so that threads which finish early
+// can take more work, but never into tasks of fewer bases than CLASSIFY_MIN_TASK_BASES.
+// The minimum only bounds per-task overhead, which is small: it is about 32 short reads, so that the chunks
+// of serve (SERVE_CHUNK_BASES) and stream batches of a thousand reads still spread over many threads.
+static constexpr unsigned CLASSIFY_TASKS_PER_THREAD = 16;
+static constexpr u64      CLASSIFY_MIN_TASK_BASES   = 1 << 12;
+
+/*
+ * Buffers for classify_seqs, kept by the caller across chunks:
+ * a worker per pool thread and an output segment per task, plus one for its host reads if they are written out.
+ * Each task formats its reads into its own segment; segments are concatenated in task order.
+ *
+ * Tasks are consecutive runs of reads with about the same number of bases, as classification time
+ * is proportional to bases rather than reads. They are handed out largest first, so a task holding one
+ * very long read starts early instead of leaving the other threads idle at the end of the chunk.
+ */
+template<typename ScoreType>
+struct ClassifyArena {
+    std::vector<ClassifyWorker<ScoreType>> workers_;
+    std::vector<ks::string>                segments_;
+    std::vector<ks::string>                host_segments_; // Host reads of each task, if written out.
+    std::vector<u32>                       starts_; // Task i covers reads [starts_[i], starts_[i + 1]).
+    std::vector<u64>                       bases_;  // Bases in each task.
+    std::vector<u32>                       order_;  // Tasks in the order they are handed out.
+    u64                                    first_read_ = 0; // Index in the input of the chunk's first read (pair), for binary records.
+    std::vector<std::vector<ClassifyWorker<ScoreType>>> database_workers_;  // For each of the classifier's databases_, a worker per thread.
+    std::vector<std::vector<ks::string>>                database_segments_; // For each of the classifier's databases_, a segment per task.
+    std::vector<std::vector<ks::string>>                extract_segments_;  // For each of the classifier's extract_, a segment per task.
+    // Workers are built in place, as they own their host encoder and are not copied.
+    ClassifyArena(const ClassifierGeneric<ScoreType> &c):
+        database_workers_(c.databases_.size()), database_segments_(c.databases_.size()), extract_segments_(c.extract_.size())
+    {
+        workers_.reserve(c.nt_);
+        for(unsigned i(0); i < c.nt_; ++i) workers_.emplace_back(c.enc_, c.cache_bits_, c.host_);
+        for(size_t i(0); i < c.databases_.size(); ++i) {
+            database_workers_[i].reserve(c.nt_);
+            for(unsigned j(0); j < c.nt_; ++j)
+                database_workers_[i].emplace_back(c.databases_[i].first->enc_, c.databases_[i].first->cache_bits_);
+        }
+    }
+    unsigned ntasks() const {return bases_.size();}
+    // Adds the workers' per-taxon read counts to c's and its databases', once all reads have been classified.
+    void merge_taxon_reads(const ClassifierGeneric<ScoreType> &c) {
+        auto merge = [](const ClassifierGeneric<ScoreType> &c, std::vector<ClassifyWorker<ScoreType>> &workers) {
+            for(auto &w: workers) {
+                if(w.taxon_reads_.empty()) continue;
+                c.add_taxon_reads(w.taxon_reads_);
+                std::fill(w.taxon_reads_.begin(), w.taxon_reads_.end(), 0);
+            }
+        };
+        merge(c, workers_);
+        for(size_t i(0); i < database_workers_.size(); ++i) merge(*c.databases_[i].first, database_workers_[i]);
+    }
+    void plan(const bseq1_t *bs, unsigned n, int is_paired, unsigned nthreads, u64 min_bases=CLASSIFY_MIN_TASK_BASES) {
+        const unsigned inc(is_paired ? 2: 1);
+        u64 total(0);
+        for(unsigned i(0); i < n; total += bs[i++].l_seq);
+        const u64 target(std::max(total / (u64(nthreads) * CLASSIFY_TASKS_PER_THREAD) + 1, min_bases));
+        starts_.assign(1, 0);
+        bases_.clear();
+        u64 bases(0);
+        for(unsigned i(0); i < n; i += inc) {
+            bases += bs[i].l_seq + (is_paired && i + 1 < n ? bs[i + 1].l_seq: 0);
+            if(bases >= target) {
+                starts_.push_back(std::min(i + inc, n));
+                bases_.push_back(bases);
+                bases = 0;
+            }
+        }
+        if(starts_.back() < n) starts_.push_back(n), bases_.push_back(bases);
+        order_.resize(bases_.size());
+        std::iota(order_.begin(), order_.end(), 0u);
+        std::sort(order_.begin(), order_.end(), [this](u32 a, u32 b) {return bases_[a] > bases_[b];});
+        if(segments_.size() < bases_.size()) segments_.resize(bases_.size());
+        for(auto *all: {&database_segments_, &extract_segments_})
+            for(auto &segments: *all)
+                if(segments.size() < bases_.size()) segments.resize(bases_.size());
+    }
+};
+
+// Sets counts to the number of occurrences of each taxon in [beg, end).
+inline void count_taxa(const tax_t *beg, const tax_t *end, std::vector<tax_t> &scratch, tax_counter &counts) {
+    counts.clear();
+    if(size_t(end - beg) < CLASSIFY_SORT_COUNT_MIN) {
+        for(;beg != end; counts.add(tax_t(*beg++)));
+        return;
+    }
+    scratch.assign(beg, end);
+    std::sort(scratch.begin(), scratch.end());
+    for(auto it(scratch.cbegin()), e(scratch.cend()); it != e;) {
+        const auto next(std::upper_bound(it, e, *it));
+        counts.add(tax_t(*it), next - it);
+        it = next;
+    }
+}
+
+inline void append_windows(const std::vector<tax_t> &windows, ks::string &bks) {
+    bks.putsn_("W:", 2);
+    for(const tax_t taxon: windows) bks.putuw_(taxon), bks.putc_(',');
+    bks.back() = '\t';
+}
+
+inline void append_hit_summary(const tax_counter &hit_counts, std::vector<u32> &order, ks::string &bks) {
+    if(hit_counts.size() == 0) {
+        bks.putsn("0:0\n", 4);
+        return;
+    }
+    const auto &keys(hit_counts.keys());
+    const auto &vals(hit_counts.vals());
+    order.resize(keys.size());
+    std::iota(order.begin(), order.end(), 0u);
+    const unsigned nlisted(std::min(unsigned(keys.size()), CLASSIFY_SUMMARY_TAXA));
+    std::partial_sort(order.begin(), order.begin() + nlisted, order.end(), [&](u32 a, u32 b) {
+        return vals[a] != vals[b] ? vals[a] > vals[b]: keys[a] < keys[b];
+    });
+    for(unsigned i(0); i < nlisted; ++i) bks.putuw_(keys[order[i]]), bks.putc_(':'), bks.putuw_(vals[order[i]]), bks.putc_('\t');
+    u64 rest(0);
+    for(unsigned i(nlisted); i < keys.size(); rest += vals[order[i++]]);
+    if(rest) bks.putsn_("O:", 2), bks.putuw_(rest), bks.putc_('\t');
+    bks.back() = '\n';
+    bks.terminate();
+}
+
+// The per-k-mer part of a record: windows if requested, then runs of hits or a summary of them.
+template<typename ScoreType>
+INLINE void append_hits(const ClassifierGeneric<ScoreType> &c, ClassifyWorker<ScoreType> &w, const tax_t taxon, ks::string &bks) {
+    if(c.window_ && w.windows_.size()) append_windows(w.windows_, bks);
+    if(c.summarize_hits_) append_hit_summary(w.hit_counts_, w.order_, bks);
+    else                  append_taxa_runs(taxon, w.taxa_, bks);
+}
+
+template<typename ScoreType>
+void append_fastq_classification(const ClassifierGeneric<ScoreType> &c, ClassifyWorker<ScoreType> &w,
+                                 const tax_t taxon, const u32 ambig_count, const u32 missing_count,
+                                 bseq1_t *bs, ks::string &bks, const int verbose, const int is_paired) {
+    char *cms, *cme; // comment start, comment end -- used for using comment in both output reads.
+    bks.puts(bs->name);
+    bks.putc_(' ');
+    cms = bks.data() + bks.size();
+    static const char lut[] {'C', 'U'};
+    char tmp[] {lut[taxon == 0], '\t'};
+    bks.putsn_(tmp, 2);
+    bks.putuw_(taxon);
+    bks.putc_('\t');
+    bks.putl_(bs->l_seq);
+    bks.putc_('\t');
+    append_counts(missing_count, 'M', bks);
+    append_counts(ambig_count,   'A', bks);
+    if(verbose) append_hits(c, w, taxon, bks);
+    else        bks.back() = '\n';
+    cme = bks.end();
+    // And now add the rest of the fastq record
+    bks.putsn_(bs->seq, bs->l_seq);
+    bks.putsn_("\n+\n", 3);
+    bks.putsn_(bs->qual ? bs->qual: bs->seq, bs->l_seq); // Append sequence if it's a fasta record
+    bks.putc_('\n');
+    if(is_paired) {
+        bks.puts((bs + 1)->name);
+        bks.putc_(' ');
+        bks.putsn_(cms, (int)(cme - cms)); // Add comment section in.
+        bks.putc_('\n');
+        bks.putsn_((bs + 1)->seq, (bs + 1)->l_seq);
+        bks.putsn_("\n+\n", 3);
+        bks.putsn_((bs + 1)->qual ? (bs + 1)->qual: (bs + 1)->seq, (bs + 1)->l_seq);
+        bks.putc_('\n');
+    }
+    bks.terminate();
+}
+
+
+
+template<typename ScoreType>
+void append_kraken_classification(const ClassifierGeneric<ScoreType> &c, ClassifyWorker<ScoreType> &w,
+                                  const tax_t taxon, const u32 ambig_count, const u32 missing_count,
+                                  bseq1_t *bs, ks::string &bks) {
+    append_kraken_header(taxon, bs->name, bs->l_seq, missing_count, ambig_count, bks);
+    append_hits(c, w, taxon, bks);
+    bks.terminate();
+}
+
 namespace {
+template<typename ScoreType>
 struct kt_data {
-    const ClassifierGeneric<score::Lex> &c_;
-    const khash_t(p) *taxmap;
+    const ClassifierGeneric<ScoreType> &c_;
+    const TaxonomyIndex &tax_;
     bseq1_t *bs_;
-    const unsigned per_set_;
-    const unsigned total_;
-    std::atomic<u64> &retstr_size_;
+    ClassifyArena<ScoreType> &arena_;
     const int is_paired_;
+    const bool emit_host_;
 };
 }
 
+// Appends bs as a FASTQ record, or a FASTA record if it has no qualities.
+inline void append_record(const bseq1_t *bs, ks::string &out) {
+    out.putc_(bs->qual ? '@': '>');
+    out.puts(bs->name);
+    if(bs->comment) out.putc_(' '), out.puts(bs->comment);
+    out.putc_('\n');
+    out.putsn_(bs->seq, bs->l_seq);
+    if(bs->qual) {
+        out.putsn_("\n+\n", 3);
+        out.putsn_(bs->qual, bs->l_seq);
+    }
+    out.putc_('\n');
+    out.terminate();
+}
+
+// Whether the read (pair) at bs comes from the host: c.host_ contains at least c.host_fraction_ of its k-mers.
+// Stops testing k-mers once the outcome is decided either way.
 template<typename ScoreType>
-unsigned classify_seq(const ClassifierGeneric<ScoreType> &c,
-                      Encoder<ScoreType> &enc,
-                      const khash_t(p) *taxmap, bseq1_t *bs, const int is_paired, std::vector<tax_t> &taxa) {
-    LOG_DEBUG("starting classify_seq with bs at pointer = %p\n", static_cast<const void*>(bs));
-    khiter_t ki;
-    tax_counter hit_counts;
+bool is_host(const ClassifierGeneric<ScoreType> &c, ClassifyWorker<ScoreType> &w, const bseq1_t *bs, const int is_paired) {
+    std::vector<u64> &kmers(w.kmers_);
+    kmers.clear();
+    auto push = [&](u64 kmer) {kmers.push_back(kmer);};
+    assert(w.host_enc_); // Set up with the worker, from the classifier's host filter.
+    w.host_enc_->for_each(push, bs->seq, bs->l_seq);
+    if(is_paired) w.host_enc_->for_each(push, bs[1].seq, bs[1].l_seq);
+    const size_t n(kmers.size());
+    if(n == 0) return false;
+    const size_t needed(std::max(size_t(1), size_t(std::ceil(c.host_fraction_ * n))));
+    for(size_t i(0), e(std::min(n, size_t(CLASSIFY_PREFETCH_DIST))); i < e; c.host_->prefetch(kmers[i++]));
+    size_t hits(0);
+    for(size_t i(0); i < n; ++i) {
+        if(i + CLASSIFY_PREFETCH_DIST < n) c.host_->prefetch(kmers[i + CLASSIFY_PREFETCH_DIST]);
+        hits += c.host_->may_contain(kmers[i]);
+        if(hits >= needed) return true;
+        if(hits + (n - i - 1) < needed) return false;
+    }
+    return false;
+}
+
+template<typename ScoreType>
+void append_binary_classification(const ClassifyWorker<ScoreType> &w, u64 read_index, const tax_t taxon,
+                                  const u32 ambig_count, const u32 missing_count, const bseq1_t *bs, ks::string &bks) {
+    const cls_record_t rec{read_index, taxon, u32(bs->l_seq), missing_count, ambig_count};
+    const tax_t *const beg(w.taxa_.data()), *const end(beg + w.taxa_.size());
+    size_t nruns(0);
+    if(taxon) for_each_taxa_run(beg, end, [&](tax_t, u32) {++nruns;});
+    put_binary_record(rec, nruns, [&](auto &&put) {
+        if(nruns) for_each_taxa_run(beg, end, put);
+    }, bks);
+}
+
+// Calls encode(seq, l) for the bases of b to take k-mers from: a copy with low-quality and low-complexity bases
+// masked, if c masks them. Masked bases become N, which the encoder skips, so the record itself is output unchanged.
+template<typename ScoreType, typename Func>
+INLINE void for_each_masked(const ClassifierGeneric<ScoreType> &c, ClassifyWorker<ScoreType> &w, const bseq1_t *b, const Func &encode) {
+    if(c.min_quality_ == 0 && c.dust_threshold_ == 0) {
+        encode(b->seq, b->l_seq);
+        return;
+    }
+    // Complexity is judged first, on the bases as read.
+    w.masked_.assign(b->seq, b->seq + b->l_seq);
+    w.masked_.push_back('\0');
+    if(c.dust_threshold_) w.nmasked_[1] += mask_low_complexity(w.masked_.data(), b->l_seq, c.dust_threshold_);
+    if(c.min_quality_ && b->qual) w.nmasked_[0] += mask_low_quality(w.masked_.data(), b->qual, b->l_seq, c.min_quality_);
+    encode(w.masked_.data(), b->l_seq);
+}
+
+// Appends kmer to the k-mers w looks up, starting w's buffers for a new read (pair) if first is set.
+// A windowed database only holds window minimizers, and consecutive windows mostly share theirs,
+// so each run of windows with the same minimizer is looked up once and counted once per window.
+// Runs do not continue from one read of a pair into the other, whose k-mers start at w.nfirst_.
+template<typename ScoreType>
+INLINE void push_kmer(ClassifyWorker<ScoreType> &w, u64 kmer) {
+    if(w.enc_.sp_.unwindowed()) w.kmers_.push_back(kmer);
+    else if(w.kmers_.size() > w.nfirst_ && w.kmers_.back() == kmer) ++w.runs_.back();
+    else w.kmers_.push_back(kmer), w.runs_.push_back(1);
+}
+
+template<typename ScoreType>
+INLINE void start_read(ClassifyWorker<ScoreType> &w) {
+    w.taxa_.clear();
+    w.kmers_.clear();
+    w.runs_.clear();
+    w.windows_.clear();
+    w.nfirst_ = 0;
+}
+
+// Looks up the k-mers w has gathered for bs (and bs + 1 if is_paired), w.nfirst_ of them from bs, in c's database.
+// Appends the record to out and returns the number of bytes appended.
+template<typename ScoreType>
+unsigned classify_kmers(const ClassifierGeneric<ScoreType> &c, ClassifyWorker<ScoreType> &w,
+                        const TaxonomyIndex &tax, bseq1_t *bs, const int is_paired, ks::string &out, u64 read_index) {
+    tax_counter &hit_counts(w.hit_counts_);
+    std::vector<tax_t> &taxa(w.taxa_);
+    const std::vector<u64> &kmers(w.kmers_);
+    const std::vector<u32> &runs(w.runs_);
+    const bool windowed(!w.enc_.sp_.unwindowed());
     u32 missing_count(0);
     tax_t taxon(0);
-    ks::string bks(bs->sam, bs->l_sam);
-    bks.clear();
-    taxa.clear();
-
-    auto fn = [&] (u64 kmer) {
+    const size_t start(out.size());
+    const size_t n1(w.nfirst_), n(kmers.size());
+    size_t index(0);
+    // K-mer positions in the current -W window, and where its hits start in taxa.
+    u32 filled(0);
+    size_t window_start(0);
+    auto end_window = [&]() {
+        count_taxa(taxa.data() + window_start, taxa.data() + taxa.size(), w.sorted_, w.window_counts_);
+        w.windows_.push_back(resolve_tree(w.window_counts_, tax, w.dense_));
+        window_start = taxa.size(), filled = 0;
+    };
+    auto fn = [&] (tax_t tax) {
+        u32 run(windowed ? runs[index++]: 1);
         //If the kmer is missing from our database, just say we don't know what it is.
-        if((ki = kh_get(c, c.db_, kmer)) == kh_end(c.db_)) ++missing_count;
-        else taxa.push_back(kh_val(c.db_, ki)), hit_counts.add(kh_val(c.db_, ki));
+        if(tax == 0) missing_count += run;
+        if(c.window_ == 0) {
+            if(tax) taxa.insert(taxa.end(), run, tax);
+            return;
+        }
+        // A run of windows sharing a minimizer is split where a -W window ends, so that each covers c.window_ positions.
+        while(run) {
+            const u32 nused(std::min(run, c.window_ - filled));
+            if(tax) taxa.insert(taxa.end(), nused, tax);
+            run -= nused;
+            if((filled += nused) == c.window_) end_window();
+        }
+    };
+    // Looks up k-mers [beg, end), assigning each window of them a taxon if asked to.
+    auto lookup_range = [&](size_t beg, size_t end) {
+        if(w.cache_.enabled()) c.lookup_batch_cached(kmers.data(), beg, end, w.cache_, fn);
+        else                   c.lookup_batch(kmers.data(), beg, end, n, fn);
+        if(filled) end_window(); // The last window of a read may be short.
+    };
+    // Windows (k-mers, if unwindowed) which yielded no k-mer because of ambiguous bases.
+    auto ambiguous = [&](const bseq1_t *b, size_t nseen) -> u32 {
+        const size_t nwindows(b->l_seq >= int(w.enc_.sp_.w_) ? b->l_seq - w.enc_.sp_.w_ + 1: 0);
+        return nwindows > nseen ? nwindows - nseen: 0;
     };
     // This simplification loses information about the run of congituous labels. Do these matter?
-    enc.for_each(fn, bs->seq, bs->l_seq);
-    unsigned ambig_count(bs->l_seq - enc.sp_.c_ + 1 - taxa.size() - missing_count);
+    lookup_range(0, n1);
+    const size_t nseen1(taxa.size() + missing_count);
+    u32 ambig_count(ambiguous(bs, nseen1));
     if(is_paired) {
-        enc.for_each(fn, (bs + 1)->seq, (bs + 1)->l_seq);
-        ambig_count += (bs + 1)->l_seq - (enc.sp_.c_ - 1) - taxa.size() - missing_count;
+        lookup_range(n1, n);
+        ambig_count += ambiguous(bs + 1, taxa.size() + missing_count - nseen1);
     }
+    count_taxa(taxa.data(), taxa.data() + taxa.size(), w.sorted_, hit_counts);
 
-    ++c.classified_[!(taxon = resolve_tree(hit_counts, taxmap))];
-    if(c.get_emit_all() || taxon) {
+    ++c.classified_[!(w.taxon_ = taxon = resolve_tree(hit_counts, tax, w.dense_))];
+    if(c.report_only_) {
+        if(taxon) {
+            if(w.taxon_reads_.empty()) w.taxon_reads_.assign(tax.size() + 1, 0);
+            const u32 i(tax.index(taxon));
+            ++w.taxon_reads_[i == TaxonomyIndex::MISSING ? 0: i];
+        }
+        return 0;
+    }
+    if(c.get_emit_binary()) {
+        if(c.get_emit_all() || taxon) append_binary_classification(w, read_index, taxon, ambig_count, missing_count, bs, out);
+    } else if(c.get_emit_all() || taxon) {
         switch(c.output_flag_) {
             case EMIT_ALL | FASTQ | KRAKEN: case FASTQ | KRAKEN: case FASTQ: case EMIT_ALL | FASTQ:
-                append_fastq_classification(hit_counts, taxa, taxon, ambig_count, missing_count, bs, bks, c.get_emit_kraken(), is_paired); break;
+                append_fastq_classification(c, w, taxon, ambig_count, missing_count, bs, out, c.get_emit_kraken(), is_paired); break;
             case EMIT_ALL | KRAKEN: case KRAKEN:
-                append_kraken_classification(hit_counts, taxa, taxon, ambig_count, missing_count, bs, bks); break;
+                append_kraken_classification(c, w, taxon, ambig_count, missing_count, bs, out); break;
         }
     }
-    LOG_DEBUG("About to return. Len of bks = %zu. len of string: %d\n", bks.size(), std::strlen(bks.data()));
-    bs->l_sam = bks.size();
-    bs->sam = bks.release();
-    return bs->l_sam;
+    return out.size() - start;
 }
 
+// Appends the record for bs (and bs + 1 if is_paired) to out and returns the number of bytes appended.
+// read_index, the index of the read (pair) in the input, is only used by binary records.
+template<typename ScoreType>
+unsigned classify_seq(const ClassifierGeneric<ScoreType> &c, ClassifyWorker<ScoreType> &w,
+                      const TaxonomyIndex &tax, bseq1_t *bs, const int is_paired, ks::string &out, u64 read_index=0) {
+    LOG_DEBUG("starting classify_seq with bs at pointer = %p\n", static_cast<const void*>(bs));
+    // Gather k-mers for the read (pair) first so that lookups can be prefetched rather than stalling one at a time.
+    start_read(w);
+    auto push = [&](u64 kmer) {push_kmer(w, kmer);};
+    auto encode = [&](const char *seq, u64 l) {w.enc_.for_each(push, seq, l);};
+    for_each_masked(c, w, bs, encode);
+    w.nfirst_ = w.kmers_.size();
+    if(is_paired) for_each_masked(c, w, bs + 1, encode);
+    return classify_kmers(c, w, tax, bs, is_paired, out, read_index);
+}
 
-inline void kt_for_helper(void *data_, long index, int) {
-    kt_data *data((kt_data *)data_);
-    size_t retstr_size(0);
-    const int inc(!!data->is_paired_ + 1);
-    Encoder<score::Lex> enc(data->c_.enc_);
-    std::vector<tax_t> taxa;
-    //static_assert(std::is_same_v<unsigned, std::decay_t<decltype((data->per_set_ + static_cast<unsigned>(1)) * index)>>, "Should be true.");
-    for(unsigned i(index * data->per_set_); i < std::min((data->per_set_ + 1) * static_cast<unsigned>(index), data->total_); retstr_size += classify_seq(data->c_, enc, data->taxmap, data->bs_ + i, data->is_paired_, taxa), i += inc);
-    data->retstr_size_ += retstr_size;
+// As classify_seq, with thread tid's workers in arena, also classifying the read (pair) against each of c.databases_.
+// Records are appended to task's segments. The read is encoded in one pass for all databases if their encoders share
+// positions, which those of windowed and unwindowed databases can, and otherwise by each database's encoder in turn.
+template<typename ScoreType>
+void classify_seq_databases(const ClassifierGeneric<ScoreType> &c, ClassifyArena<ScoreType> &arena, int tid, u32 task,
+                            const TaxonomyIndex &tax, bseq1_t *bs, const int is_paired, u64 read_index) {
+    ClassifyWorker<ScoreType> &w(arena.workers_[tid]);
+    const size_t ndb(c.databases_.size());
+    auto dw = [&](size_t i) -> ClassifyWorker<ScoreType> & {return arena.database_workers_[i][tid];};
+    start_read(w);
+    for(size_t i(0); i < ndb; start_read(dw(i++)));
+    auto encode = [&](const char *seq, u64 l) {
+        if(w.enc_.shares_positions()) {
+            w.enc_.assign(seq, l);
+            for(size_t i(0); i < ndb; dw(i++).enc_.assign(seq, l));
+            w.enc_.for_each_position([&](u64 kmer, bool ambiguous) {
+                u64 min;
+                if((min = w.enc_.next_from_position(kmer, ambiguous)) != BF) push_kmer(w, min);
+                for(size_t i(0); i < ndb; ++i)
+                    if((min = dw(i).enc_.next_from_position(kmer, ambiguous)) != BF) push_kmer(dw(i), min);
+            }, seq, l);
+            return;
+        }
+        w.enc_.for_each([&](u64 kmer) {push_kmer(w, kmer);}, seq, l);
+        for(size_t i(0); i < ndb; ++i) {
+            ClassifyWorker<ScoreType> &x(dw(i));
+            x.enc_.for_each([&](u64 kmer) {push_kmer(x, kmer);}, seq, l);
+        }
+    };
+    for_each_masked(c, w, bs, encode);
+    w.nfirst_ = w.kmers_.size();
+    for(size_t i(0); i < ndb; ++i) dw(i).nfirst_ = dw(i).kmers_.size();
+    if(is_paired) for_each_masked(c, w, bs + 1, encode);
+    classify_kmers(c, w, tax, bs, is_paired, arena.segments_[task], read_index);
+    for(size_t i(0); i < ndb; ++i)
+        classify_kmers(*c.databases_[i].first, dw(i), *c.databases_[i].second, bs, is_paired,
+                       arena.database_segments_[i][task], read_index);
 }
 
 
+// Classifies the index-th task handed out by the pool.
+template<typename ScoreType>
+void kt_for_helper(void *data_, long index, int tid) {
+    kt_data<ScoreType> *data((kt_data<ScoreType> *)data_);
+    const int inc(!!data->is_paired_ + 1);
+    ClassifyArena<ScoreType> &arena(data->arena_);
+    const u32 task(arena.order_[index]);
+    ClassifyWorker<ScoreType> &w(arena.workers_[tid]);
+    const ClassifierGeneric<ScoreType> &c(data->c_);
+    const u32 beg(arena.starts_[task]), end(arena.starts_[task + 1]);
+    ks::string &out(arena.segments_[task]);
+    out.clear();
+    for(auto &segments: arena.database_segments_) segments[task].clear();
+    for(auto &segments: arena.extract_segments_) segments[task].clear();
+    auto classify = [&](u32 i) {
+        if(c.databases_.empty()) classify_seq(c, w, data->tax_, data->bs_ + i, data->is_paired_, out, arena.first_read_ + i / inc);
+        else classify_seq_databases(c, arena, tid, task, data->tax_, data->bs_ + i, data->is_paired_, arena.first_read_ + i / inc);
+        for(size_t j(0); j < c.extract_.size(); ++j) {
+            if(!c.extract_[j].contains(data->tax_, w.taxon_)) continue;
+            ks::string &eout(arena.extract_segments_[j][task]);
+            append_record(data->bs_ + i, eout);
+            if(data->is_paired_) append_record(data->bs_ + i + 1, eout);
+        }
+    };
+    if(c.host_ == nullptr) {
+        for(u32 i(beg); i < end; i += inc) classify(i);
+    } else {
+        // Screening runs over the whole task first, so that its time and that of classifying the rest are measured apart.
+        const auto start(std::chrono::steady_clock::now());
+        w.host_.clear();
+        u64 nhost(0);
+        for(u32 i(beg); i < end; i += inc) {
+            w.host_.push_back(is_host(c, w, data->bs_ + i, data->is_paired_));
+            nhost += w.host_.back();
+        }
+        if(data->emit_host_) {
+            ks::string &hout(arena.host_segments_[task]);
+            hout.clear();
+            for(u32 i(beg), j(0); i < end; i += inc, ++j) {
+                if(!w.host_[j]) continue;
+                append_record(data->bs_ + i, hout);
+                if(data->is_paired_) append_record(data->bs_ + i + 1, hout);
+            }
+        }
+        const auto screened(std::chrono::steady_clock::now());
+        for(u32 i(beg), j(0); i < end; i += inc, ++j)
+            if(!w.host_[j]) classify(i);
+        const auto stop(std::chrono::steady_clock::now());
+        c.host_reads_     += nhost;
+        c.screened_reads_ += w.host_.size();
+        c.screen_ns_      += std::chrono::duration_cast<std::chrono::nanoseconds>(screened - start).count();
+        c.classify_ns_    += std::chrono::duration_cast<std::chrono::nanoseconds>(stop - screened).count();
+    }
+    auto add_cache_counts = [](const ClassifierGeneric<ScoreType> &c, ClassifyWorker<ScoreType> &w) {
+        if(!w.cache_.enabled()) return;
+        c.cache_hits_    += w.cache_.hits_;
+        c.cache_lookups_ += w.cache_.lookups_;
+        w.cache_.hits_ = w.cache_.lookups_ = 0;
+    };
+    add_cache_counts(c, w);
+    for(size_t i(0); i < c.databases_.size(); ++i) add_cache_counts(*c.databases_[i].first, arena.database_workers_[i][tid]);
+    for(unsigned i(0); i < 2; ++i) data->c_.masked_[i] += w.nmasked_[i], w.nmasked_[i] = 0;
+}
 
-using Classifier = ClassifierGeneric<score::Lex>;
 
-inline void classify_seqs(const Classifier &c, const khash_t(p) *taxmap, bseq1_t *bs,
-                          ks::string &cks, const unsigned chunk_size, const unsigned per_set, const int is_paired, ForPool &pool) {
-    assert(per_set && ((per_set & (per_set - 1)) == 0));
-
-    std::atomic<u64> retstr_size(0);
-    kt_data data{c, taxmap, bs, per_set, chunk_size, retstr_size, is_paired};
-    pool.forpool(&kt_for_helper, (void *)&data, chunk_size / per_set + 1);
-    cks.resize(retstr_size.load());
-    const int inc((is_paired != 0) + 1);
-#if !NDEBUG
-    for(u32 i(0); i < chunk_size; i += inc) {
-        cks.putsn_(bs[i].sam, bs[i].l_sam);
-        LOG_DEBUG("sam1: %s. len: %d. chunk size: %u\n", bs[i].sam, bs[i].l_sam, chunk_size);
-    }
-#else
-    for(u32 i(0); i < chunk_size; cks.putsn_(bs[i].sam, bs[i].l_sam), i += inc);
-#endif
+// Appends the first n segments to cks in order.
+inline void concatenate_segments(const std::vector<ks::string> &segments, unsigned n, ks::string &cks) {
+    size_t total(0);
+    for(unsigned i(0); i < n; total += segments[i++].size());
+    cks.resize(cks.size() + total + 1);
+    for(unsigned i(0); i < n; ++i)
+        if(segments[i].size()) cks.putsn_(segments[i].data(), segments[i].size());
     cks.terminate();
 }
 
-struct del_data {
-    bseq1_t *seqs_;
-    unsigned per_set_;
-    unsigned total_;
+// Runs the tasks planned in arena and appends their output to cks in input order.
+// If the classifier screens out host reads and hks is set, they are appended to hks as FASTA/FASTQ records, in input order.
+// If the classifier has further databases and dks is set, the output for the i-th is appended to dks[i].
+// If the classifier extracts reads by clade and eks is set, the reads for the i-th extraction are appended to eks[i], in input order.
+template<typename ScoreType>
+void classify_tasks(const ClassifierGeneric<ScoreType> &c, const TaxonomyIndex &tax, bseq1_t *bs,
+                    ks::string &cks, const int is_paired, ForPool &pool, ClassifyArena<ScoreType> &arena,
+                    ks::string *hks=nullptr, ks::string *dks=nullptr, ks::string *eks=nullptr) {
+    assert(arena.workers_.size() >= c.nt_);
+    const bool emit_host(c.host_ && hks);
+    if(emit_host && arena.host_segments_.size() < arena.ntasks()) arena.host_segments_.resize(arena.ntasks());
+    kt_data<ScoreType> data{c, tax, bs, arena, is_paired, emit_host};
+    pool.forpool(&kt_for_helper<ScoreType>, (void *)&data, arena.ntasks());
+    concatenate_segments(arena.segments_, arena.ntasks(), cks);
+    if(emit_host) concatenate_segments(arena.host_segments_, arena.ntasks(), *hks);
+    if(dks)
+        for(size_t i(0); i < arena.database_segments_.size(); ++i) concatenate_segments(arena.database_segments_[i], arena.ntasks(), dks[i]);
+    if(eks)
+        for(size_t i(0); i < arena.extract_segments_.size(); ++i) concatenate_segments(arena.extract_segments_[i], arena.ntasks(), eks[i]);
+}
+
+template<typename ScoreType>
+void classify_seqs(const ClassifierGeneric<ScoreType> &c, const TaxonomyIndex &tax, bseq1_t *bs,
+                   ks::string &cks, const unsigned chunk_size, const int is_paired, ForPool &pool,
+                   ClassifyArena<ScoreType> &arena, ks::string *hks=nullptr, ks::string *dks=nullptr, ks::string *eks=nullptr) {
+    arena.plan(bs, chunk_size, is_paired, c.nt_);
+    classify_tasks(c, tax, bs, cks, is_paired, pool, arena, hks, dks, eks);
+}
+
+template<typename ScoreType>
+void classify_seqs(const ClassifierGeneric<ScoreType> &c, const TaxonomyIndex &tax, bseq1_t *bs,
+                   ks::string &cks, const unsigned chunk_size, const int is_paired, ForPool &pool) {
+    ClassifyArena<ScoreType> arena(c);
+    classify_seqs(c, tax, bs, cks, chunk_size, is_paired, pool, arena);
+    arena.merge_taxon_reads(c);
+}
+
+// One chunk of reads in flight through process_dataset, with the output formatted for it.
+struct ClassifyChunk {
+    bseq1_t   *seqs_;
+    int        n_, m_; // Records read, records allocated.
+    ks::string out_, host_; // Output, and host reads if written out.
+    std::vector<ks::string> database_out_; // Output for each of the classifier's further databases.
+    std::vector<ks::string> extract_out_;  // Reads extracted for each of the classifier's clade sets.
+    ClassifyChunk(): seqs_(nullptr), n_(0), m_(0), out_(256u), host_(256u) {}
+    ClassifyChunk(const ClassifyChunk &) = delete;
+    ~ClassifyChunk() {
+        for(int i(0); i < m_; bseq_destroy(seqs_ + i++));
+        std::free(seqs_);
+    }
+    int read(unsigned chunk_size, kseq_t *ks1, kseq_t *ks2) {
+        seqs_ = bseq_reuse_read(chunk_size, &n_, &m_, (void *)ks1, (void *)ks2, seqs_);
+        return n_;
+    }
 };
 
+// What process_dataset keeps between datasets: the thread pool, the per-thread buffers and the chunks of reads.
+// Classifying many samples (bonsai classify -M) with one saves setting these up for each.
+template<typename ScoreType>
+struct ClassifyPipeline {
+    ForPool                  pool_;
+    ClassifyArena<ScoreType> arena_;
+    ClassifyChunk            chunks_[2];
+    ClassifyPipeline(const ClassifierGeneric<ScoreType> &c): pool_(c.nt_), arena_(c) {}
+    ClassifyPipeline(const ClassifyPipeline &) = delete;
+};
 
-inline void process_dataset(const Classifier &c, const khash_t(p) *taxmap, const char *fq1, const char *fq2,
-                            std::FILE *out, unsigned chunk_size,
-                            unsigned per_set) {
-    // TODO: consider reusing buffers for processing large numbers of files.
-    int nseq(0), max_nseq(0);
-    gzFile ifp1(gzopen(fq1, "rb")), ifp2(fq2 ? gzopen(fq2, "rb"): nullptr);
-    kseq_t *ks1(kseq_init(ifp1)), *ks2(ifp2 ? kseq_init(ifp2): nullptr);
-    ks::string cks(256u);
-    const int fn = fileno(out), is_paired(fq2 != 0);
-    del_data dd{nullptr, per_set, chunk_size};
-    ForPool pool(c.nt_);
-    if((dd.seqs_ = bseq_read(chunk_size, &nseq, (void *)ks1, (void *)ks2)) == nullptr) {
-        LOG_WARNING("Could not get any sequences from file, fyi.\n");
-        goto fail; // Wheeeeee
-    }
-    classify_seqs(c, taxmap, dd.seqs_, cks, nseq, per_set, is_paired, pool);
-    std::fprintf(stderr, "nseq: %i\n", nseq);
-    max_nseq = std::max(max_nseq, nseq);
-    while((dd.seqs_ = bseq_realloc_read(chunk_size, &nseq, (void *)ks1, (void *)ks2, dd.seqs_)) && nseq) {
-        LOG_INFO("Read %i seqs with chunk size %u\n", nseq, chunk_size);
-        max_nseq = std::max(max_nseq, nseq);
-        // Classify
-        classify_seqs(c, taxmap, dd.seqs_, cks, nseq, per_set, is_paired, pool);
-        // Write out
-        LOG_DEBUG("Emitting batch. str: %s", cks.data());
-        if(cks.size() > (1ull << 16)) {
-            cks.write(fn);
-            cks.clear();
-        }
+/*
+ * Reading, classification and writing overlap: while the pool classifies chunk i,
+ * a reader thread fills chunk i + 1 and a writer thread flushes the output of chunk i - 1.
+ * Chunks are written in input order, so output is identical to classifying serially.
+ * BGZF and multi-frame zstd inputs are decompressed by decompress_threads threads (see pdecompress.h).
+ * chunk_size counts bases, not reads: a chunk ends with the read (pair) that brings it to chunk_size bases.
+ * If the classifier screens out host reads and host_out is set, they are written there, pairs interleaved.
+ * In report-only mode nothing is written to out, and the threads' per-taxon read counts are added to c's at the end.
+ * If c classifies against further databases (ClassifierGeneric::add_database), database_out holds the output for each,
+ * and if it extracts reads by clade (ClassifierGeneric::add_extraction), extract_out that for each extraction.
+ */
+template<typename ScoreType>
+void process_dataset(ClassifyPipeline<ScoreType> &pipeline, const ClassifierGeneric<ScoreType> &c, const TaxonomyIndex &tax,
+                     const char *fq1, const char *fq2, std::FILE *out, unsigned chunk_size, unsigned decompress_threads=1,
+                     std::FILE *host_out=nullptr, const std::vector<std::FILE *> &database_out={},
+                     const std::vector<std::FILE *> &extract_out={}) {
+    if(database_out.size() != c.databases_.size())
+        RUNTIME_ERROR(ks::sprintf("%zu outputs given for %zu further databases.", database_out.size(), c.databases_.size()).data());
+    if(extract_out.size() != c.extract_.size())
+        RUNTIME_ERROR(ks::sprintf("%zu outputs given for %zu clade extractions.", extract_out.size(), c.extract_.size()).data());
+    // The readers are declared after the decompressors, so that if classifying or writing throws, they are closed first:
+    // a decompressor's destructor waits for its producer, which may be blocked on a full socket until its reader is gone.
+    using gz_ptr   = std::unique_ptr<gzFile_s, int(*)(gzFile)>;
+    using kseq_ptr = std::unique_ptr<kseq_t, void(*)(kseq_t *)>;
+    std::unique_ptr<ParallelDecompressor> dec1, dec2;
+    gz_ptr ifp1(gzopen_parallel(fq1, decompress_threads, dec1), &gzclose),
+           ifp2(fq2 ? gzopen_parallel(fq2, decompress_threads, dec2): nullptr, &gzclose);
+    if(ifp1 == nullptr) throw file_open_error(fq1);
+    if(fq2 && ifp2 == nullptr) throw file_open_error(fq2);
+    kseq_ptr ks1p(kseq_init(ifp1.get()), &kseq_destroy), ks2p(ifp2 ? kseq_init(ifp2.get()): nullptr, &kseq_destroy);
+    kseq_t *const ks1(ks1p.get()), *const ks2(ks2p.get());
+    const int fn = fileno(out), hfn(host_out ? fileno(host_out): -1), is_paired(fq2 != 0);
+    std::vector<int> dfns, efns;
+    for(std::FILE *fp: database_out) dfns.push_back(fileno(fp));
+    for(std::FILE *fp: extract_out) efns.push_back(fileno(fp));
+    ForPool &pool(pipeline.pool_);
+    ClassifyArena<ScoreType> &arena(pipeline.arena_);
+    ClassifyChunk *const chunks(pipeline.chunks_);
+    auto read_chunk = [&](ClassifyChunk &chunk) {return chunk.read(chunk_size, ks1, ks2);};
+    std::future<int> reader(std::async(std::launch::async, read_chunk, std::ref(chunks[0])));
+    std::future<void> writer;
+    size_t nchunks(0);
+    arena.first_read_ = 0;
+    auto write_magic = [](const ClassifierGeneric<ScoreType> &c, int fd) {
+        if(c.get_emit_binary() && ::write(fd, CLS_BINARY_MAGIC, sizeof(CLS_BINARY_MAGIC)) != ssize_t(sizeof(CLS_BINARY_MAGIC)))
+            RUNTIME_ERROR(std::string("Could not write classification output: ") + std::strerror(errno));
+    };
+    write_magic(c, fn);
+    for(size_t i(0); i < dfns.size(); ++i) write_magic(*c.databases_[i].first, dfns[i]);
+    for(auto &chunk: pipeline.chunks_) chunk.database_out_.resize(dfns.size()), chunk.extract_out_.resize(efns.size());
+    for(int nseq; (nseq = reader.get()) > 0; ++nchunks) {
+        ClassifyChunk &cur(chunks[nchunks & 1]);
+        // The other chunk's records were classified last iteration; only its output may still be in use.
+        reader = std::async(std::launch::async, read_chunk, std::ref(chunks[(nchunks + 1) & 1]));
+        LOG_DEBUG("Read %i seqs with chunk size %u\n", nseq, chunk_size);
+        cur.out_.clear(), cur.host_.clear();
+        for(auto &dout: cur.database_out_) dout.clear();
+        for(auto &eout: cur.extract_out_) eout.clear();
+        classify_seqs(c, tax, cur.seqs_, cur.out_, nseq, is_paired, pool, arena, hfn >= 0 ? &cur.host_: nullptr,
+                      cur.database_out_.data(), cur.extract_out_.data());
+        arena.first_read_ += is_paired ? nseq / 2: nseq;
+        if(writer.valid()) writer.get();
+        writer = std::async(std::launch::async, [fn,hfn,&dfns,&efns](const ClassifyChunk *chunk) {
+            auto write_all = [](int fd, const ks::string &str) {
+                for(const char *p(str.data()), *e(p + str.size()); p < e;) {
+                    const ssize_t nwritten(::write(fd, p, e - p));
+                    if(nwritten < 0) {
+                        if(errno == EINTR) continue;
+                        RUNTIME_ERROR(std::string("Could not write classification output: ") + std::strerror(errno));
+                    }
+                    p += nwritten;
+                }
+            };
+            write_all(fn, chunk->out_);
+            if(hfn >= 0) write_all(hfn, chunk->host_);
+            for(size_t i(0); i < dfns.size(); ++i) write_all(dfns[i], chunk->database_out_[i]);
+            for(size_t i(0); i < efns.size(); ++i) write_all(efns[i], chunk->extract_out_[i]);
+        }, &cur);
     }
-    cks.write(fn);
-    cks.clear();
-    // No use parallelizing the frees, there's a global lock on the freeing anyhow.
-    for(int i(0); i < max_nseq; bseq_destroy(dd.seqs_ + i++));
-    free(dd.seqs_);
-    fail:
+    if(writer.valid()) writer.get();
+    arena.merge_taxon_reads(c);
+    if(nchunks == 0) LOG_WARNING("Could not get any sequences from file, fyi.\n");
     // Clean up.
-    gzclose(ifp1);
-    kseq_destroy(ks1);
-    if(ks2) kseq_destroy(ks2);
-    if(ifp2) gzclose(ifp2);
+    ks1p.reset(), ks2p.reset();
+    ifp1.reset(), ifp2.reset();
+    // Reports truncated or corrupted compressed input, which otherwise just looks like the end of the reads.
+    if(dec1) dec1->finish();
+    if(dec2) dec2->finish();
+}
+
+template<typename ScoreType>
+void process_dataset(const ClassifierGeneric<ScoreType> &c, const TaxonomyIndex &tax, const char *fq1, const char *fq2,
+                     std::FILE *out, unsigned chunk_size, unsigned decompress_threads=1, std::FILE *host_out=nullptr,
+                     const std::vector<std::FILE *> &database_out={}, const std::vector<std::FILE *> &extract_out={}) {
+    ClassifyPipeline<ScoreType> pipeline(c);
+    process_dataset(pipeline, c, tax, fq1, fq2, out, chunk_size, decompress_threads, host_out, database_out, extract_out);
 }
 
 static void append_fastq_classification(const tax_counter &,
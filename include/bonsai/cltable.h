@@ -0,0 +1,155 @@
+#pragma once
+#include <cstdlib>
+#include "util.h"
+
+namespace bns {
+
+/*
+ * Read-only exact k-mer -> taxon table laid out in 64-byte buckets.
+ *
+ * khash_t(c) keeps flags, keys and values in three separate arrays, so a single probe
+ * touches up to three cache lines and a miss may chase several buckets.
+ * Here each bucket holds its keys with their taxa and a small header in one cache line.
+ * Keys are placed in the bucket chosen by their hash or, if it is full, in the next bucket with room,
+ * marking each full bucket passed as overflowed. A lookup therefore stops at the first bucket
+ * which has not overflowed.
+ *
+ * A database rarely uses more than a few hundred thousand taxa. If it uses at most 65535, buckets store the
+ * 16-bit index of each taxon in the table of taxa used (dense_taxa()) instead of the taxon, which makes room
+ * for six keys instead of five: the table shrinks by a sixth at the same load, and a hit costs one more load
+ * from a table small enough to stay in cache.
+ *
+ * The default load (70% of slots) leaves ~14% of buckets overflowed, so almost all lookups read one line
+ * and the overflow branch is predictable. Higher loads shrink the table but make that branch, and thus
+ * every lookup, slower: at 85%, lookups were twice as slow as khash in our tests.
+ *
+ * Taxon 0 is never stored, so it doubles as the "missing" return value.
+ */
+template<typename ValueType>
+struct alignas(64) basic_cl_bucket_t {
+    static constexpr unsigned NSLOTS   = (64 - sizeof(u32)) / (sizeof(u64) + sizeof(ValueType));
+    static constexpr u32      OVERFLOW = 1u << 31;
+    u64       keys_[NSLOTS];
+    ValueType vals_[NSLOTS];
+    u32       meta_; // Low bits: number of slots used. High bit: some key for this bucket was placed later.
+    unsigned used()       const {return meta_ & 0x7u;}
+    bool     overflowed() const {return meta_ & OVERFLOW;}
+};
+using cl_bucket_t   = basic_cl_bucket_t<tax_t>;
+using cl_bucket16_t = basic_cl_bucket_t<u16>; // Values index the table of taxa.
+static_assert(sizeof(cl_bucket_t) == 64 && cl_bucket_t::NSLOTS == 5, "cl_bucket_t must be exactly one cache line.");
+static_assert(sizeof(cl_bucket16_t) == 64 && cl_bucket16_t::NSLOTS == 6, "cl_bucket16_t must be exactly one cache line.");
+
+class CacheLineTable {
+    const void         *data_; // cl_bucket16_t if taxa_ is set, else cl_bucket_t.
+    void               *owned_;
+    const tax_t        *taxa_;
+    std::vector<tax_t>  owned_taxa_;
+    u64                 ntaxa_;
+    u64                 nbuckets_;
+    u64                 size_;
+
+    // Cheaper than wang_hash, which matters more here than mixing quality.
+    INLINE u64 bucket(u64 key) const {
+        key ^= key >> 33;
+        key *= UINT64_C(0xff51afd7ed558ccd);
+        key ^= key >> 33;
+        return static_cast<u64>((static_cast<__uint128_t>(key) * nbuckets_) >> 64);
+    }
+    // All slots are compared regardless of how many are used, so the loop bound does not depend on loaded data.
+    // Unused slots follow the used ones and hold a zero value, so a match there correctly reports a miss.
+    template<typename Bucket>
+    INLINE u32 find(u64 key) const {
+        const Bucket *buckets(static_cast<const Bucket *>(data_));
+        for(u64 i(bucket(key));;) {
+            const Bucket &b(buckets[i]);
+            for(unsigned j(0); j < Bucket::NSLOTS; ++j)
+                if(b.keys_[j] == key) return b.vals_[j];
+            if(!b.overflowed()) return 0;
+            if(++i == nbuckets_) i = 0;
+        }
+    }
+    template<typename Bucket, typename ValueType>
+    void insert(u64 key, ValueType val) {
+        Bucket *buckets(static_cast<Bucket *>(owned_));
+        for(u64 i(bucket(key));;) {
+            Bucket &b(buckets[i]);
+            const unsigned n(b.used());
+            if(n < Bucket::NSLOTS) {
+                b.keys_[n] = key, b.vals_[n] = val;
+                ++b.meta_;
+                ++size_;
+                return;
+            }
+            b.meta_ |= Bucket::OVERFLOW;
+            if(++i == nbuckets_) i = 0;
+        }
+    }
+public:
+    CacheLineTable(): data_(nullptr), owned_(nullptr), taxa_(nullptr), ntaxa_(0), nbuckets_(0), size_(0) {}
+    // Non-owning view, e.g. into a memory-mapped database. Buckets are cl_bucket16_t if taxa is set, else cl_bucket_t.
+    CacheLineTable(const void *data, u64 nbuckets, u64 size, const tax_t *taxa=nullptr, u64 ntaxa=0):
+        data_(data), owned_(nullptr), taxa_(taxa), ntaxa_(ntaxa), nbuckets_(nbuckets), size_(size)
+    {
+        if(taxa_ && (ntaxa_ == 0 || ntaxa_ > u64(std::numeric_limits<u16>::max()) + 1 || taxa_[0] != 0))
+            RUNTIME_ERROR("Inconsistent CacheLineTable taxa.");
+    }
+    CacheLineTable(const CacheLineTable &) = delete;
+    CacheLineTable(CacheLineTable &&o): CacheLineTable() {*this = std::move(o);}
+    CacheLineTable &operator=(CacheLineTable &&o) {
+        std::swap(data_, o.data_);
+        std::swap(owned_, o.owned_);
+        std::swap(taxa_, o.taxa_);
+        std::swap(owned_taxa_, o.owned_taxa_);
+        std::swap(ntaxa_, o.ntaxa_);
+        std::swap(nbuckets_, o.nbuckets_);
+        std::swap(size_, o.size_);
+        return *this;
+    }
+    ~CacheLineTable() {std::free(owned_);}
+
+    // load is the target fraction of slots filled.
+    // Values are stored as 16-bit indices into the table of taxa if there are few enough taxa, unless narrow is false.
+    template<typename T>
+    static CacheLineTable from_khash(const T *map, double load=0.7, bool narrow=true) {
+        static_assert(std::is_same<T, khash_t(c)>::value, "Only khash_t(c) is supported.");
+        if(load <= 0. || load >= 1.) RUNTIME_ERROR("Load factor must be in (0, 1).");
+        CacheLineTable ret;
+        std::vector<tax_t> taxa(dense_taxa(map));
+        narrow = narrow && taxa.size() <= u64(std::numeric_limits<u16>::max()) + 1;
+        const unsigned nslots(narrow ? cl_bucket16_t::NSLOTS: cl_bucket_t::NSLOTS);
+        ret.nbuckets_ = std::max(u64(1), static_cast<u64>(kh_size(map) / (nslots * load)) + 1);
+        void *p;
+        if(posix_memalign(&p, sizeof(cl_bucket_t), ret.nbuckets_ * sizeof(cl_bucket_t)))
+            throw std::bad_alloc();
+        std::memset(p, 0, ret.nbuckets_ * sizeof(cl_bucket_t));
+        ret.data_ = ret.owned_ = p;
+        for(khiter_t ki(0); ki != kh_end(map); ++ki) {
+            if(!kh_exist(map, ki)) continue;
+            if(narrow) ret.insert<cl_bucket16_t>(kh_key(map, ki), u16(dense_index(taxa, kh_val(map, ki))));
+            else       ret.insert<cl_bucket_t>(kh_key(map, ki), kh_val(map, ki));
+        }
+        if(narrow) {
+            ret.owned_taxa_ = std::move(taxa);
+            ret.taxa_  = ret.owned_taxa_.data();
+            ret.ntaxa_ = ret.owned_taxa_.size();
+        }
+        return ret;
+    }
+    // Returns 0 if key is absent.
+    INLINE tax_t get(u64 key) const {
+        return taxa_ ? taxa_[find<cl_bucket16_t>(key)]: find<cl_bucket_t>(key);
+    }
+    INLINE void prefetch(u64 key) const {__builtin_prefetch(static_cast<const cl_bucket_t *>(data_) + bucket(key));}
+    const void  *data() const {return data_;}
+    // Table of taxa indexed by 16-bit values, or null if buckets hold taxa.
+    const tax_t *taxa() const {return taxa_;}
+    u64 ntaxa()      const {return ntaxa_;}
+    u32 value_bits() const {return taxa_ ? 16: 32;}
+    u64 nbuckets()   const {return nbuckets_;}
+    u64 size()       const {return size_;}
+    bool empty()     const {return size_ == 0;}
+    size_t nbytes()  const {return nbuckets_ * sizeof(cl_bucket_t);}
+};
+
+} // namespace bns
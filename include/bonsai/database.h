@@ -1,7 +1,12 @@
 #ifndef _DATABASE_H__
 #define _DATABASE_H__
 
+#include "blockbloom.h"
+#include "chtable.h"
+#include "cltable.h"
 #include "encoder.h"
+#include "mbtable.h"
+#include "mmdb.h"
 #include "util.h"
 #include <cinttypes>
 #include <forward_list>
@@ -12,15 +17,23 @@
 
 namespace bns {
 
+// Files in the original format record the score_scheme in the bits of w_ above this shift, which older files leave zero.
+static constexpr unsigned DB_SCORE_SHIFT = 24;
 
 template <typename T>
 struct Database {
 
     unsigned k_, w_;
+    score_scheme score_; // Scheme by which minimizers were chosen. Classification must choose them the same way.
     T       *db_;
     int      owns_hash_;
     spvec_t  s_;
     Spacer  *sp_;
+    MMapDB  *mm_; // Non-null if db_ points into a read-only mapping.
+    CacheLineTable ct_; // Optional compact copy of db_ for classification. Empty unless stored in a mapped database.
+    BlockedBloomFilter bf_; // Optional filter of db_'s keys, consulted before lookups. Empty unless stored in a mapped database.
+    CompactHashTable cht_;  // Lossy replacement for db_, which is then null. Empty unless stored in a mapped database.
+    MinimizerBinTable mbt_; // Exact replacement for db_, which is then null. Empty unless stored in a mapped database.
 
     Spacer *make_sp() {
         //std::fprintf(stderr, "Making sp with spacer = %s\n", str(s_).data());
@@ -30,32 +43,39 @@ struct Database {
         return ret;
     }
 
-    Database(const char *fn): owns_hash_(1), sp_(nullptr) {
+    Database(const char *fn): score_(LEX), owns_hash_(1), sp_(nullptr), mm_(nullptr) {
+        if(MMapDB::is_mmdb(fn)) {
+            load_mmdb(fn);
+            return;
+        }
         int filetype(0);
         {
             std::string fns = fn;
             std::string gzsuf   = ".gz";
             std::string zstdsuf = ".zst";
             if(std::equal(std::crbegin(gzsuf), std::crend(gzsuf), std::crbegin(fns))) filetype = 1;
-            else if(std::equal(std::crbegin(gzsuf), std::crend(gzsuf), std::crbegin(fns))) filetype = 2;
+            else if(std::equal(std::crbegin(zstdsuf), std::crend(zstdsuf), std::crbegin(fns))) filetype = 2;
         }
         std::FILE *fp = filetype ? popen((std::string(filetype == 1 ? "gzip -dc " : "zstd -qdc ") + fn).data(), "rb"): std::fopen(fn, "rb");
         if (fp) {
             __fr(k_, fp);
             __fr(w_, fp);
+            score_ = score_scheme(w_ >> DB_SCORE_SHIFT);
+            w_ &= (1u << DB_SCORE_SHIFT) - 1;
             s_ = spvec_t(k_ - 1);
             LOG_DEBUG("reading %zu bytes from file for vector, with %zu reserved\n", s_.size(), s_.capacity());
-            if(std::fread(s_.data(), s_.size(), sizeof(uint8_t), fp) != s_.size() * sizeof(uint8_t))
+            if(std::fread(s_.data(), sizeof(uint8_t), s_.size(), fp) != s_.size() * sizeof(uint8_t))
                 throw std::runtime_error("Error: Could not read spacing from file");
             db_ = khash_load_impl<T>(fp);
         } else LOG_EXIT("Could not open %s for reading.\n", fn);
         sp_ = make_sp();
         assert(sp_);
         LOG_DEBUG("Read database!\n");
-        std::fclose(fp);
+        if(filetype) pclose(fp);
+        else         std::fclose(fp);
     }
     Database(unsigned k, unsigned w, const spvec_t &s, unsigned owns=1, T *db=nullptr):
-        k_(k), w_(w), db_(db), owns_hash_(owns), s_(s), sp_(make_sp())
+        k_(k), w_(w), score_(LEX), db_(db), owns_hash_(owns), s_(s), sp_(make_sp()), mm_(nullptr)
     {
     }
     Database(Spacer sp, unsigned owns=1, T *db=nullptr):
@@ -67,25 +87,138 @@ struct Database {
     Database(Database<O> &other, unsigned owns=0):
         k_(other.k_),
         w_(other.w_),
+        score_(other.score_),
         db_(nullptr),
         owns_hash_(owns),
         s_(other.s_),
-        sp_(make_sp())
+        sp_(make_sp()),
+        mm_(nullptr)
     {
     }
 
     ~Database() {
-        if(owns_hash_) khash_destroy(db_);
+        if(mm_) {
+            std::free(db_);
+            delete mm_;
+        } else if(owns_hash_) khash_destroy(db_);
         if(sp_)        delete sp_;
     }
+    void load_mmdb(const char *fn) {
+        mm_ = new MMapDB(fn);
+        const auto &h(mm_->header());
+        k_ = h.k_;
+        w_ = h.w_;
+        score_ = score_scheme(h.score_);
+        u64 n;
+        const u8 *sp(mm_->section<u8>(MMDB_SPACING, &n));
+        if(n != k_ - 1) RUNTIME_ERROR("Spacing section does not match k.");
+        s_ = spvec_t(sp, sp + n);
+        // Compact and binned databases store cht_ or mbt_ instead of the hash table.
+        db_ = mm_->find(MMDB_KH_KEYS) ? khash_from_mmdb<T>(*mm_): nullptr;
+        owns_hash_ = 0;
+        if(const mmdb_section_t *sec = mm_->find(MMDB_CL_TABLE)) {
+            const cl_bucket_t *buckets(mm_->section<cl_bucket_t>(MMDB_CL_TABLE));
+            if(h.cl_value_bits_ == 16) {
+                const tax_t *taxa(mm_->section<tax_t>(MMDB_TAXA, &n));
+                ct_ = CacheLineTable(buckets, sec->nbytes_ / sizeof(cl_bucket_t), h.cl_size_, taxa, n);
+            } else ct_ = CacheLineTable(buckets, sec->nbytes_ / sizeof(cl_bucket_t), h.cl_size_);
+        }
+        if(const mmdb_section_t *sec = mm_->find(MMDB_BLOOM)) {
+            if(h.bloom_hashes_ != BlockedBloomFilter::NHASHES)
+                RUNTIME_ERROR(ks::sprintf("Bloom filter with %u hashes is not supported.", h.bloom_hashes_).data());
+            const bloom_block_t *blocks(mm_->section<bloom_block_t>(MMDB_BLOOM));
+            bf_ = BlockedBloomFilter(blocks, sec->nbytes_ / sizeof(bloom_block_t));
+        }
+        if(const mmdb_section_t *sec = mm_->find(MMDB_COMPACT)) {
+            const u32 *slots(mm_->section<u32>(MMDB_COMPACT));
+            const tax_t *taxa(mm_->section<tax_t>(MMDB_TAXA, &n));
+            cht_ = CompactHashTable(slots, h.ch_nslots_, sec->nbytes_ / sizeof(u32), taxa, n, h.ch_size_, h.ch_value_bits_);
+        }
+        if(const mmdb_section_t *sec = mm_->find(MMDB_MB_OFFSETS)) {
+            u64 nvals;
+            const u64 *keys(mm_->section<u64>(MMDB_MB_KEYS, &n));
+            const tax_t *vals(mm_->section<tax_t>(MMDB_MB_VALS, &nvals));
+            if(nvals != n) RUNTIME_ERROR("Binned table values do not match its keys.");
+            mbt_ = MinimizerBinTable(mm_->section<u64>(MMDB_MB_OFFSETS), sec->nbytes_ / sizeof(u64) - 1, keys, vals, n, k_, h.mb_l_);
+        }
+        if(db_ == nullptr && cht_.empty() && mbt_.empty()) RUNTIME_ERROR(std::string("No k-mer table in ") + fn);
+        sp_ = make_sp();
+        LOG_DEBUG("Mapped database of %zu bytes from %s\n", mm_->size(), fn);
+    }
+    // If with_table is set, a CacheLineTable is built (unless already mapped) and stored alongside the hash table.
+    // If bloom_bits_per_key is positive, a BlockedBloomFilter of the keys with that many bits per key is stored too.
+    // If compact_fpr is positive, a CompactHashTable with at most that expected false-positive rate is stored
+    // instead of the hash table, which takes ~3-4x less space at the cost of a few wrong hits.
+    // If bin_l is positive, a MinimizerBinTable with minimizers of that length is stored instead of the hash table.
+    void write_mmap(const char *fn, bool with_table=false, double bloom_bits_per_key=0., double compact_fpr=0., unsigned bin_l=0) const {
+        if(db_ == nullptr) RUNTIME_ERROR("Only databases with a hash table can be written.");
+        MMapDBWriter writer(k_, w_);
+        writer.header().score_ = score_;
+        writer.add(MMDB_SPACING, s_.data(), s_.size() * sizeof(s_[0]), sizeof(s_[0]));
+        CompactHashTable cht;
+        MinimizerBinTable mbt;
+        if(bin_l && compact_fpr > 0.) RUNTIME_ERROR("A database cannot hold both a compact and a binned table.");
+        if(compact_fpr > 0.) {
+            if(with_table) RUNTIME_ERROR("A compact database cannot also hold a lookup table.");
+            u64 nshadowed;
+            cht = CompactHashTable::from_khash(db_, compact_fpr, &nshadowed);
+            const double load(double(cht.size()) / cht.nslots());
+            LOG_INFO("Built %zu-byte compact table for %zu keys (khash: %zu bytes) with %u-bit fingerprints at load %0.3lf. "
+                     "Expected false-positive rate: %0.3g. Keys shadowed by another's fingerprint: %zu.\n",
+                     cht.nbytes(), size_t(kh_size(db_)),
+                     size_t(kh_end(db_) * (sizeof(*db_->keys) + sizeof(*db_->vals)) + __ac_fsize(kh_end(db_)) * sizeof(*db_->flags)),
+                     32 - cht.value_bits(), load, CompactHashTable::expected_fpr(load, cht.value_bits()), size_t(nshadowed));
+            writer.add(MMDB_COMPACT, cht.data(), cht.nbytes(), sizeof(u32));
+            writer.add(MMDB_TAXA, cht.taxa(), cht.ntaxa() * sizeof(tax_t), sizeof(tax_t));
+            writer.header().ch_size_ = cht.size();
+            writer.header().ch_nslots_ = cht.nslots();
+            writer.header().ch_value_bits_ = cht.value_bits();
+        } else if(bin_l) {
+            if(with_table) RUNTIME_ERROR("A binned database cannot also hold a lookup table.");
+            mbt = MinimizerBinTable::from_khash(db_, k_, bin_l);
+            LOG_INFO("Built %zu-byte binned table for %zu keys in %zu bins of %u-mer minimizers (khash: %zu bytes)\n",
+                     mbt.nbytes(), size_t(mbt.size()), size_t(mbt.nbins()), mbt.l(),
+                     size_t(kh_end(db_) * (sizeof(*db_->keys) + sizeof(*db_->vals)) + __ac_fsize(kh_end(db_)) * sizeof(*db_->flags)));
+            writer.add(MMDB_MB_OFFSETS, mbt.offsets(), (mbt.nbins() + 1) * sizeof(u64), sizeof(u64));
+            writer.add(MMDB_MB_KEYS, mbt.keys(), mbt.size() * sizeof(u64), sizeof(u64));
+            writer.add(MMDB_MB_VALS, mbt.vals(), mbt.size() * sizeof(tax_t), sizeof(tax_t));
+            writer.header().mb_l_ = mbt.l();
+        } else khash_add_to_mmdb(db_, writer);
+        CacheLineTable tmp;
+        if(with_table) {
+            const CacheLineTable *ct(&ct_);
+            if(ct_.empty()) {
+                tmp = CacheLineTable::from_khash(db_);
+                ct = &tmp;
+                LOG_INFO("Built %zu-byte lookup table for %zu keys with %u-bit values (khash: %zu bytes)\n", ct->nbytes(), size_t(ct->size()),
+                         ct->value_bits(),
+                         size_t(kh_end(db_) * (sizeof(*db_->keys) + sizeof(*db_->vals)) + __ac_fsize(kh_end(db_)) * sizeof(*db_->flags)));
+            }
+            writer.add(MMDB_CL_TABLE, ct->data(), ct->nbytes(), sizeof(cl_bucket_t));
+            writer.header().cl_size_ = ct->size();
+            if(ct->taxa()) {
+                writer.add(MMDB_TAXA, ct->taxa(), ct->ntaxa() * sizeof(tax_t), sizeof(tax_t));
+                writer.header().cl_value_bits_ = ct->value_bits();
+            }
+        }
+        BlockedBloomFilter bf;
+        if(bloom_bits_per_key > 0.) {
+            bf = BlockedBloomFilter::from_khash(db_, bloom_bits_per_key);
+            LOG_INFO("Built %zu-byte Bloom filter for %zu keys\n", bf.nbytes(), size_t(kh_size(db_)));
+            writer.add(MMDB_BLOOM, bf.data(), bf.nbytes(), sizeof(bloom_block_t));
+            writer.header().bloom_hashes_ = BlockedBloomFilter::NHASHES;
+        }
+        writer.write(fn);
+    }
     void write(const char *fn, bool write_gz=false) const {
         // TODO: add compression/work with zlib.
+        const unsigned w(w_ | (unsigned(score_) << DB_SCORE_SHIFT));
         if(write_gz) {
             gzFile ofp = gzopen(fn, "wb");
             if(!ofp) LOG_EXIT("Could not open %s for writing.\n", fn);
 #define gzw(_x, ofp) if(gzwrite(ofp, static_cast<const void *>(&_x), sizeof(_x)) != sizeof(_x)) throw std::runtime_error("Error writing to file")
             gzw(k_, ofp);
-            gzw(w_, ofp);
+            gzw(w, ofp);
             gzwrite(ofp, static_cast<const void *>(s_.data()), s_.size() * sizeof(s_[0]));
             khash_write_impl<T>(db_, ofp);
             gzclose(ofp);
@@ -95,8 +228,8 @@ struct Database {
         std::FILE *ofp(std::fopen(fn, "wb"));
         if(!ofp) LOG_EXIT("Could not open %s for writing.\n", fn);
         __fw(k_, ofp);
-        __fw(w_, ofp);
-        if(std::fwrite(s_.data(), s_.size(), sizeof(uint8_t), ofp) != s_.size()) throw std::runtime_error("Error writing database");
+        __fw(w, ofp);
+        if(std::fwrite(s_.data(), sizeof(uint8_t), s_.size(), ofp) != s_.size()) throw std::runtime_error("Error writing database");
         khash_write_impl<T>(db_, ofp);
         std::fclose(ofp);
     }
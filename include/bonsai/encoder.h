@@ -96,7 +96,7 @@ public:
 private:
     u64         pos_; // Current position within the string s_ we're working with.
     void      *data_; // A void pointer for using with scoring. Needed for hash_score.
-    qmap_t     qmap_; // queue of max scores and std::map which keeps kmers, scores, and counts so that we can select the top kmer for a window.
+    qmap_t     qmap_; // Sliding-window minimum of k-mers by score, which selects the k-mer for each window.
     const ScoreType  scorer_; // scoring struct
     bool canonicalize_;
 #if 0
@@ -126,14 +126,15 @@ public:
       scorer_{},
       canonicalize_(canonicalize)
     {
-        if(std::is_same<ScoreType, score::Entropy>::value && sp_.unspaced() && !sp_.unwindowed()) {
+        if(owns_data()) {
             if(data_) UNRECOVERABLE_ERROR("No data pointer must be provided for lex::Entropy minimization.");
             data_ = static_cast<void *>(new CircusEnt(sp_.k_));
         }
     }
     Encoder(const Spacer &sp, void *data, bool canonicalize=true): Encoder(nullptr, 0, sp, data, canonicalize) {}
     Encoder(const Spacer &sp, bool canonicalize=true): Encoder(sp, nullptr, canonicalize) {}
-    Encoder(const Encoder &other): Encoder(other.sp_, other.data_) {
+    // A copy gets its own entropy window, since the window changes with every base encoded.
+    Encoder(const Encoder &other): Encoder(other.sp_, other.owns_data() ? nullptr: other.data_) {
         canonicalize_ = other.canonicalize_;
     }
     Encoder(unsigned k, bool canonicalize=true): Encoder(nullptr, 0, Spacer(k), nullptr, canonicalize) {}
@@ -154,10 +155,52 @@ public:
     template<typename Functor>
     INLINE void for_each_canon_windowed(const Functor &func) {
         u64 min;
+        if(sp_.unspaced()) {
+            // Rolls each k-mer from the previous one rather than encoding it anew, but gives the window the same
+            // values as next_canonicalized_minimizer, including BF for k-mers with ambiguous bases.
+            const u64 mask((UINT64_C(-1)) >> (64 - (sp_.k_ << 1)));
+            u64 kmer(0), next_unambiguous(0); // First position from which a k-mer has no ambiguous bases.
+            for(;pos_ < l_; ++pos_) {
+                const u64 base(cstr_lut[s_[pos_]]);
+                if(base == BF) next_unambiguous = pos_ + 1;
+                kmer = ((kmer << 2) | (base & 3)) & mask;
+                if(pos_ + 1 < sp_.k_) continue;
+                const u64 canon(canonical_representation(next_unambiguous + sp_.k_ <= pos_ + 1 ? kmer: BF, sp_.k_));
+                if((min = qmap_.next_value(canon, scorer_(canon, data_))) != BF)
+                    func(min);
+            }
+            return;
+        }
         while(likely(has_next_kmer()))
             if((min = next_canonicalized_minimizer()) != BF)
                 func(min);
     }
+    // Whether for_each's k-mers can be taken from for_each_position by next_from_position, so that encoders
+    // differing only in w can share one pass over a sequence.
+    bool shares_positions() const {
+        return canonicalize_ && sp_.unspaced() && sp_.k_ < 32 && std::is_same<ScoreType, score::Lex>::value;
+    }
+    // Calls func(kmer, ambiguous) for every k-mer position of [s, s + l): the canonical k-mer, or for those with
+    // ambiguous bases the canonical form of BF, as for_each_canon_windowed puts them in its window.
+    template<typename Functor>
+    INLINE void for_each_position(const Functor &func, const char *s, u64 l) const {
+        const u64 mask((UINT64_C(-1)) >> (64 - (sp_.k_ << 1)));
+        u64 kmer(0), next_unambiguous(0);
+        for(u64 pos(0); pos < l; ++pos) {
+            const u64 base(cstr_lut[s[pos]]);
+            if(base == BF) next_unambiguous = pos + 1;
+            kmer = ((kmer << 2) | (base & 3)) & mask;
+            if(pos + 1 < sp_.k_) continue;
+            const bool ambiguous(next_unambiguous + sp_.k_ > pos + 1);
+            func(canonical_representation(ambiguous ? BF: kmer, sp_.k_), ambiguous);
+        }
+    }
+    // Given the next position from for_each_position of an encoder with the same k, returns the k-mer for_each
+    // would emit there, or BF if none. Requires shares_positions(); assign the sequence first to reset the window.
+    INLINE u64 next_from_position(u64 kmer, bool ambiguous) {
+        if(sp_.unwindowed()) return ambiguous ? BF: kmer;
+        return qmap_.next_value(kmer, scorer_(kmer, data_));
+    }
     template<typename Functor>
     INLINE void for_each_canon_unwindowed(const Functor &func) {
         if(sp_.unspaced())
@@ -485,16 +528,18 @@ public:
         return qmap_.next_value(k, kscore);
     }
     elscore_t max_in_queue() const {
-        return qmap_.begin()->first;
+        return qmap_.min();
     }
     bool canonicalize() const {return canonicalize_;}
     void set_canonicalize(bool value) {canonicalize_ = value;}
     auto pos()   const {return pos_;}
     uint32_t k() const {return sp_.k_;}
+    // Whether data_ is a CircusEnt created for (and freed with) this encoder.
+    bool owns_data() const {
+        return std::is_same<ScoreType, score::Entropy>::value && sp_.unspaced() && !sp_.unwindowed();
+    }
     ~Encoder() {
-        if(std::is_same<ScoreType, score::Entropy>::value && sp_.unspaced() && !sp_.unwindowed()) {
-            delete static_cast<CircusEnt *>(data_);
-        }
+        if(owns_data()) delete static_cast<CircusEnt *>(data_);
     }
 };
 
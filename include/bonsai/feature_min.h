@@ -4,6 +4,7 @@
 #include "spacer.h"
 #include "khash64.h"
 #include "util.h"
+#include "taxindex.h"
 #include "klib/kthread.h"
 #include <set>
 
@@ -23,43 +24,44 @@
 namespace bns {
 
 
-inline khash_t(c) *make_depth_hash(khash_t(c) *lca_map, khash_t(p) *tax_map);
-inline void lca2depth(khash_t(c) *lca_map, khash_t(p) *tax_map);
+inline khash_t(c) *make_depth_hash(khash_t(c) *lca_map, const khash_t(p) *tax_map);
+inline void lca2depth(khash_t(c) *lca_map, const khash_t(p) *tax_map);
 
-inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const khash_t(p) *tax);
+inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const khash_t(p) *tax_map);
 
 
-inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid);
-inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid);
-inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid);
+inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const TaxonomyIndex &tax, tax_t taxid);
+inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const TaxonomyIndex &tax, tax_t taxid);
+inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const TaxonomyIndex &tax, tax_t taxid);
 inline void update_minimized_map(const khash_t(all) *set, const khash_t(64) *full_map, khash_t(c) *ret);
 
 // Wrap these in structs so that downstream code can be managed as a set, not updated one-by-one.
+// tax is null if make_map was given no taxonomy.
 struct LcaMap {
     using ReturnType = khash_t(c) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *r32, khash_t(64) *, tax_t taxid) {
-        update_lca_map(r32, set, tax, taxid);
+    static void update(const TaxonomyIndex *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *r32, khash_t(64) *, tax_t taxid) {
+        update_lca_map(r32, set, *tax, taxid);
     }
 };
 struct TdMap {
     using ReturnType = khash_t(64) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *, khash_t(64) *r64, tax_t taxid) {
-        update_td_map(r64, set, tax, taxid);
+    static void update(const TaxonomyIndex *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *, khash_t(64) *r64, tax_t taxid) {
+        update_td_map(r64, set, *tax, taxid);
     }
 };
 struct FcMap {
     using ReturnType = khash_t(64) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *, khash_t(64) *r64, tax_t taxid) {
-        update_feature_counter(r64, set, tax, taxid);
+    static void update(const TaxonomyIndex *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *, khash_t(64) *r64, tax_t taxid) {
+        update_feature_counter(r64, set, *tax, taxid);
     }
 };
 struct MinMap {
     using ReturnType = khash_t(c) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *, const khash_t(all) *set, const khash_t(64) *d64, khash_t(c) *r32, khash_t(64) *, tax_t) {
+    static void update(const TaxonomyIndex *, const khash_t(all) *set, const khash_t(64) *d64, khash_t(c) *r32, khash_t(64) *, tax_t) {
         update_minimized_map(set, d64, r32);
     }
 };
@@ -88,6 +90,8 @@ template<typename ScoreType, typename MapUpdater>
 typename MapUpdater::ReturnType
 make_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const char *seq2tax_path, const Spacer &sp, int num_threads, bool canon, size_t start_size, const khash_t(64) *data) {
     MapUpdater mu;
+    // Indexed once here so that every shared k-mer costs an O(1) LCA query rather than two root path walks.
+    std::unique_ptr<TaxonomyIndex> tax(tax_map ? new TaxonomyIndex(tax_map): nullptr);
 
     khash_t(c) *r32 = nullptr;
     khash_t(64) *r64 = nullptr;
@@ -140,7 +144,7 @@ make_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const ch
             ++submitted, ++completed;
             LOG_DEBUG("Have now submitted %zu element\n", submitted);
             const tax_t taxid(get_taxid(fns[index].data(), name_hash));
-            mu.update(tax_map, counter, data, r32, r64, taxid);
+            mu.update(tax.get(), counter, data, r32, r64, taxid);
         }
     }
 
@@ -148,7 +152,7 @@ make_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const ch
     for(auto &f: futures) if(f.valid()) {
         const size_t index(f.get());
         const tax_t taxid(get_taxid(fns[index].data(), name_hash));
-        mu.update(tax_map, counters.data() + index, data, r32, r64, taxid);
+        mu.update(tax.get(), counters.data() + index, data, r32, r64, taxid);
         ++completed;
     }
 
@@ -196,7 +200,7 @@ khash_t(64) *taxdepth_map(const std::vector<std::string> &fns, const khash_t(p)
     return make_map<ScoreType, TdMap>(fns, tax_map, seq2tax_path, sp, num_threads, canon, start_size, nullptr);
 }
 
-inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid) {
+inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const TaxonomyIndex &tax, tax_t taxid) {
     int khr;
     khint_t k2;
     static int warn_missing = 1;
@@ -212,7 +216,7 @@ inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_
                 if(unlikely(kh_size(kc) % 1000000 == 0)) LOG_DEBUG("Final hash size %zu\n", kh_size(kc));
 #endif
             } else if(kh_val(kc, k2) != taxid) {
-                kh_val(kc, k2) = lca(tax, taxid, kh_val(kc, k2));
+                kh_val(kc, k2) = tax.lca(taxid, kh_val(kc, k2));
                 if(kh_val(kc, k2) == UINT32_C(1))
                     if(warn_missing) LOG_WARNING("ancestor of %u missing from taxonomy. This is not unexpected considering the issues the NCBI taxonomy has.\n", taxid), warn_missing = 0;
             }
@@ -221,7 +225,7 @@ inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_
     LOG_DEBUG("After updating with set of size %zu, total set current size is %zu.\n", kh_size(set), kh_size(kc));
 }
 
-inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid) {
+inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const TaxonomyIndex &tax, tax_t taxid) {
     int khr;
     khint_t k2;
     tax_t val;
@@ -232,17 +236,17 @@ inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const khash_
                 k2 = kh_put(64, kc, kh_key(set, ki), &khr);
                 if(unlikely(khr < 0))
                     RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", kh_key(set, ki), kh_size(kc)).data());
-                kh_val(kc, k2) = TDencode(node_depth(tax, kh_val(kc, ki)), kh_val(kc, ki));
+                kh_val(kc, k2) = TDencode(tax.node_depth(taxid), taxid);
                 if(unlikely(kh_size(kc) % 1000000 == 0)) LOG_INFO("Final hash size %zu\n", kh_size(kc));
             } else if(kh_val(kc, k2) != taxid) {
-                do val = lca(tax, taxid, kh_val(kc, k2));
-                while(!kh_try_set(64, kc, k2, val == (tax_t)-1 ? 1: TDencode(node_depth(tax, val), val)));
+                do val = tax.lca(taxid, kh_val(kc, k2));
+                while(!kh_try_set(64, kc, k2, val == (tax_t)-1 ? 1: TDencode(tax.node_depth(val), val)));
             }
         }
     }
     LOG_DEBUG("After updating with set of size %zu, total set current size is %zu.\n", kh_size(set), kh_size(kc));
 }
-inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, const tax_t taxid) {
+inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const TaxonomyIndex &tax, const tax_t taxid) {
     // TODO: make this threadsafe.
     int khr;
     khint_t k2;
@@ -252,8 +256,8 @@ inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, con
                 k2 = kh_put(64, kc, kh_key(set, ki), &khr);
                 if(unlikely(khr < 0))
                     RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", kh_key(set, ki), kh_size(kc)).data());
-                kh_val(kc, k2) = FMencode(1, node_depth(tax, taxid));
-            } else while(!kh_try_set(64, kc, k2, FMencode(FMcount(kh_val(kc, k2)), lca(tax, taxid, kh_val(kc, k2)))));
+                kh_val(kc, k2) = FMencode(1, tax.node_depth(taxid));
+            } else while(!kh_try_set(64, kc, k2, FMencode(FMcount(kh_val(kc, k2)), tax.lca(taxid, kh_val(kc, k2)))));
         }
     }
 }
@@ -275,12 +279,14 @@ inline void update_minimized_map(const khash_t(all) *set, const khash_t(64) *ful
 }
 
 inline void lca2depth(khash_t(c) *lca_map, const khash_t(p) *tax_map) {
+    const TaxonomyIndex tax(tax_map);
     for(khiter_t ki(kh_begin(lca_map)); ki < kh_end(lca_map); ++ki)
         if(kh_exist(lca_map, ki))
-            kh_val(lca_map, ki) = node_depth(tax_map, kh_val(lca_map, ki));
+            kh_val(lca_map, ki) = tax.node_depth(kh_val(lca_map, ki));
 }
 
 inline khash_t(c) *make_depth_hash(khash_t(c) *lca_map, const khash_t(p) *tax_map) {
+    const TaxonomyIndex tax(tax_map);
     khash_t(c) *ret(kh_init(c));
     kh_resize(c, ret, kh_size(lca_map));
     khiter_t ki1;
@@ -289,14 +295,15 @@ inline khash_t(c) *make_depth_hash(khash_t(c) *lca_map, const khash_t(p) *tax_ma
         if(kh_exist(lca_map, ki2)) {
             ki1 = kh_put(c, ret, kh_key(lca_map, ki2), &khr);
             if(unlikely(khr < 0)) throw std::runtime_error(ks::sprintf("[%s:%d] Failed to insert into to table of size %zu.", __PRETTY_FUNCTION__, __LINE__, kh_size(ret)).data());
-            kh_val(ret, ki1) = node_depth(tax_map, kh_val(lca_map, ki2));
+            kh_val(ret, ki1) = tax.node_depth(kh_val(lca_map, ki2));
         }
     }
     return ret;
 }
 
 
-inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const khash_t(p) *tax) {
+inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const khash_t(p) *tax_map) {
+    const TaxonomyIndex tax(tax_map);
     khash_t(64) *ret(kh_init(64));
     int khr;
     khiter_t kir;
@@ -304,7 +311,7 @@ inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const khash_t(p) *tax) {
     for(khiter_t ki(0); ki < kh_end(kc); ++ki) {
         if(kh_exist(kc, ki)) {
             kir = kh_put(64, ret, kh_key(kc, ki), &khr);
-            kh_val(ret, kir) = TDencode(node_depth(tax, kh_val(kc, ki)), kh_val(kc, ki));
+            kh_val(ret, kir) = TDencode(tax.node_depth(kh_val(kc, ki)), kh_val(kc, ki));
         }
     }
     return ret;
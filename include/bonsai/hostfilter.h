@@ -0,0 +1,99 @@
+#pragma once
+#include <memory>
+#include "blockbloom.h"
+#include "encoder.h"
+#include "mmdb.h"
+
+namespace bns {
+
+/*
+ * Compact filter of a host genome's k-mers, for dropping host reads before classification.
+ *
+ * Human reads make up most of many clinical samples, and each one otherwise costs a full classify_seq against the
+ * taxonomic database, only to come out as Homo sapiens or unclassified. The filter is a BlockedBloomFilter of every
+ * (canonical) k-mer of the host reference, taken with the same Encoder classification uses, and
+ * ClassifierGeneric::set_host_filter screens each read (pair) against it before any database lookup: a read whose
+ * fraction of k-mers found in the filter reaches the threshold is dropped, or written separately, without being classified.
+ * A test reads one cache line of a filter much smaller than the database, and screening stops as soon as the outcome is known.
+ *
+ * False positives only matter in bulk: at 8 bits per k-mer 2.9% of absent k-mers pass, so a non-host read needs
+ * a large multiple of that rate to reach a threshold of 0.5. Conversely, host reads with variants or errors
+ * still have most of their k-mers in the reference.
+ * Sizing the filter by the reference's bases (an upper bound on its distinct k-mers) costs ~3 GB for GRCh38 at 8 bits.
+ *
+ * Filters are stored as mmdb files (mmdb.h) holding MMDB_SPACING and MMDB_HOST_BLOOM sections, so that they are mapped
+ * rather than read, and shared between processes.
+ */
+static constexpr double HOST_DEFAULT_BITS_PER_KMER = 8.;
+static constexpr double HOST_DEFAULT_FRACTION      = 0.5;
+
+class HostFilter {
+    std::unique_ptr<MMapDB> mm_;
+    BlockedBloomFilter      bf_;
+    u64                     nkmers_; // K-mers inserted, including repeats.
+public:
+    const Encoder<score::Lex> enc_; // Takes every k-mer. ClassifyWorker copies it, as encoders keep per-read state.
+
+    // Builds a filter of the k-mers in the sequences at paths, with spaces as parsed by parse_spacing.
+    HostFilter(const std::vector<std::string> &paths, u32 k, const spvec_t &spaces, double bits_per_kmer=HOST_DEFAULT_BITS_PER_KMER):
+        nkmers_(0), enc_(Spacer(k, k, spaces), true)
+    {
+        // Two passes: the first bounds the number of k-mers by the number of bases, which sizes the filter.
+        u64 nbases(0);
+        for(const auto &path: paths) {
+            gzFile fp(gzopen(path.data(), "rb"));
+            if(fp == nullptr) throw file_open_error(path);
+            kseq_t *ks(kseq_init(fp));
+            while(kseq_read(ks) >= 0) nbases += ks->seq.l;
+            kseq_destroy(ks);
+            gzclose(fp);
+        }
+        if(nbases == 0) RUNTIME_ERROR("No host sequence to build a filter from.");
+        bf_ = BlockedBloomFilter(nbases, bits_per_kmer);
+        Encoder<score::Lex> enc(enc_);
+        for(const auto &path: paths) {
+            gzFile fp(gzopen(path.data(), "rb"));
+            if(fp == nullptr) throw file_open_error(path);
+            enc.for_each([&](u64 kmer) {bf_.insert(kmer), ++nkmers_;}, fp);
+            gzclose(fp);
+        }
+    }
+    // Maps a filter written by write.
+    HostFilter(const char *path): mm_(new MMapDB(path)), nkmers_(mm_->header().size_), enc_(load_spacer(*mm_), true) {
+        const auto &h(mm_->header());
+        if(h.bloom_hashes_ != BlockedBloomFilter::NHASHES)
+            RUNTIME_ERROR(ks::sprintf("Bloom filter with %u hashes is not supported.", h.bloom_hashes_).data());
+        u64 n;
+        const bloom_block_t *blocks(mm_->section<bloom_block_t>(MMDB_HOST_BLOOM, &n));
+        bf_ = BlockedBloomFilter(blocks, n);
+    }
+    HostFilter(const HostFilter &) = delete;
+    void write(const char *path) const {
+        MMapDBWriter writer(enc_.sp_.k_, enc_.sp_.w_);
+        // Spacer keeps offsets between bases, one more than the spaces, which is how databases store them too.
+        const spvec_t &s(enc_.sp_.s_);
+        writer.add(MMDB_SPACING, s.data(), s.size() * sizeof(s[0]), sizeof(s[0]));
+        writer.add(MMDB_HOST_BLOOM, bf_.data(), bf_.nbytes(), sizeof(bloom_block_t));
+        writer.header().size_ = nkmers_;
+        writer.header().bloom_hashes_ = BlockedBloomFilter::NHASHES;
+        writer.write(path);
+    }
+    INLINE bool may_contain(u64 kmer) const {return bf_.may_contain(kmer);}
+    INLINE void prefetch(u64 kmer)    const {bf_.prefetch(kmer);}
+    u32 k()         const {return enc_.sp_.k_;}
+    u64 nkmers()    const {return nkmers_;}
+    size_t nbytes() const {return bf_.nbytes();}
+private:
+    static Spacer load_spacer(const MMapDB &mm) {
+        const auto &h(mm.header());
+        if(mm.find(MMDB_HOST_BLOOM) == nullptr) RUNTIME_ERROR("Not a host filter: no host Bloom filter section.");
+        u64 n;
+        const u8 *sp(mm.section<u8>(MMDB_SPACING, &n));
+        if(n != h.k_ - 1) RUNTIME_ERROR("Spacing section does not match k.");
+        spvec_t s(sp, sp + n);
+        for(auto &i: s) --i;
+        return Spacer(h.k_, h.k_, s);
+    }
+};
+
+} // namespace bns
@@ -0,0 +1,75 @@
+#pragma once
+#include "kspp/ks.h"
+#include "util.h"
+
+namespace bns {
+
+/*
+ * Kraken-style text records: C or U, the read name, taxon and length, then M:<missing> and A:<ambiguous> k-mers if any,
+ * then the runs of hits. classify writes them from a worker's hits and classify_decode from binary records (binout.h),
+ * both through these functions.
+ */
+
+INLINE void append_counts(u32 count, const char character, ks::string &ks) {
+    if(count) {
+        char buf[] {character, ':'};
+        ks.putsn_(buf, 2);
+        ks.putuw_(count);
+        ks.putc_('\t');
+    }
+}
+
+// Everything before the hits, ending with a tab.
+INLINE void append_kraken_header(const tax_t taxon, const char *name, const int length, const u32 missing_count,
+                                 const u32 ambig_count, ks::string &bks) {
+    static const char tbl[]{'C', 'U'};
+    bks.putc_(tbl[!taxon]);
+    bks.putc_('\t');
+    bks.puts(name);
+    bks.putc_('\t');
+    bks.putuw_(taxon);
+    bks.putc_('\t');
+    bks.putw_(length);
+    bks.putc_('\t');
+    append_counts(missing_count, 'M', bks);
+    append_counts(ambig_count,   'A', bks);
+}
+
+INLINE void append_taxa_run(const tax_t last_taxa,
+                            const u32 taxa_run,
+                            ks::string &bks) {
+    // U for unclassified (unambiguous but not in database)
+    // A for ambiguous: ambiguous nucleotides
+    // Actual taxon otherwise.
+    switch(last_taxa) {
+        case 0:            bks.putc_('U'); break;
+        case (tax_t)-1:    bks.putc_('A'); break;
+        default:           bks.putuw_(last_taxa); break;
+    }
+    bks.putc_(':'); bks.putuw_(taxa_run); bks.putc_('\t');
+}
+
+// Calls func(taxon, length) for each run of consecutive hits to the same taxon in [beg, end).
+template<typename Func>
+INLINE void for_each_taxa_run(const tax_t *beg, const tax_t *end, const Func &func) {
+    for(const tax_t *p(beg), *q; p < end; p = q) {
+        for(q = p + 1; q < end && *q == *p; ++q);
+        func(*p, u32(q - p));
+    }
+}
+
+// Ends the record with the runs for_each_run(put) passes to put(taxon, length), or with 0:0 if the read is
+// unclassified or has none.
+template<typename RunFunc>
+INLINE void append_kraken_runs(const tax_t taxon, const RunFunc &for_each_run, ks::string &bks) {
+    const size_t start(bks.size());
+    if(taxon) for_each_run([&](tax_t run_taxon, u32 length) {append_taxa_run(run_taxon, length, bks);});
+    if(bks.size() == start) {
+        bks.putsn("0:0\n", 4);
+        return;
+    }
+    bks.back() = '\n'; // Replace the last run's tab.
+    bks.terminate();
+}
+
+} // namespace bns
@@ -174,6 +174,43 @@ static bseq1_t *bseq_realloc_read(int chunk_size, int *n_, void *ks1_, void *ks2
     return seqs;
 }
 
+// Like bseq_realloc_read, but tracks the capacity of seqs in *m_ so that buffers can be reused
+// for chunks with more records than the first. Records past *n_ keep their allocations for reuse.
+static bseq1_t *bseq_reuse_read(int chunk_size, int *n_, int *m_, void *ks1_, void *ks2_, bseq1_t *seqs) {
+    int n = 0, size = 0, m = *m_;
+    kseq_t *ks = (kseq_t *)ks1_, *ks2 = (kseq_t *)ks2_;
+    while (kseq_read(ks) >= 0) {
+        if (ks2 && kseq_read(ks2) < 0) { // the 2nd file has fewer reads
+            fprintf(stderr, "[W::%s] the 2nd file has fewer sequences.\n", __func__);
+            break;
+        }
+        if (n + 2 > m) {
+            int newm = m? m<<1 : 4096;
+            seqs = (bseq1_t *)realloc(seqs, newm * sizeof(bseq1_t));
+            memset(seqs + m, 0, (newm - m) * sizeof(bseq1_t));
+            m = newm;
+        }
+        trim_readno(&ks->name);
+        rekseq2bseq1(ks, seqs + n);
+        seqs[n].id = n;
+        size += seqs[n++].l_seq;
+        if (ks2) {
+            trim_readno(&ks2->name);
+            rekseq2bseq1(ks2, seqs + n);
+            seqs[n].id = n;
+            size += seqs[n++].l_seq;
+        }
+        if (size >= chunk_size && (n&1) == 0) break;
+    }
+    if (size == 0) { // test if the 2nd file is finished
+        if (ks2 && kseq_read(ks2) >= 0)
+            fprintf(stderr, "[W::%s] the 1st file has fewer sequences.\n", __func__);
+    }
+    *n_ = n;
+    *m_ = m;
+    return seqs;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,81 @@
+#pragma once
+#include "kmerutil.h"
+#include "util.h"
+#if __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace bns {
+
+/*
+ * Masking of read bases before k-mers are taken, by replacing them with 'N'.
+ * The encoder skips k-mers covering an N, so masked k-mers are never looked up, and classify reports them
+ * as ambiguous, as Kraken 2 does with bases it masks.
+ *
+ * mask_low_quality masks bases whose Phred score (qualities offset by 33) is below min_qual.
+ * mask_low_complexity masks windows of DUST_WINDOW bases whose triplets repeat too much, after DUST
+ * (Morgulis et al. 2006): a window of l triplets in which triplet t occurs c_t times scores
+ *     sum_t c_t (c_t - 1) / 2 / (l - 1),
+ * and is masked if that exceeds threshold. Homopolymers score 30.5, dinucleotide repeats 15.2, trinucleotide
+ * repeats 10 and random sequence ~0.5, so dustmasker's default level of 20 masks homopolymer runs, and lower
+ * thresholds short tandem repeats too. The score is kept up to date as the window slides, which takes a few
+ * operations per base: adding a triplet raises the sum by its previous count.
+ * Qualities are compared 32 at a time with AVX2; the DUST scan is serial by nature, but reads every base once.
+ * Windows restart after a base that is not A, C, G or T.
+ */
+static constexpr unsigned DUST_WINDOW = 64;
+
+// Returns the number of bases masked.
+inline size_t mask_low_quality(char *seq, const char *qual, size_t len, unsigned min_qual) {
+    const char floor(char(33 + std::min(min_qual, 93u)));
+    size_t nmasked(0), i(0);
+#if __AVX2__
+    const __m256i floorv(_mm256_set1_epi8(floor)), n(_mm256_set1_epi8('N'));
+    for(; i + 32 <= len; i += 32) {
+        // Qualities are printable, so a signed comparison is safe.
+        const __m256i low(_mm256_cmpgt_epi8(floorv, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(qual + i))));
+        const unsigned bits(_mm256_movemask_epi8(low));
+        if(bits == 0) continue;
+        __m256i *p(reinterpret_cast<__m256i *>(seq + i));
+        _mm256_storeu_si256(p, _mm256_blendv_epi8(_mm256_loadu_si256(p), n, low));
+        nmasked += pop::popcount(bits);
+    }
+#endif
+    for(; i < len; ++i)
+        if(qual[i] < floor) seq[i] = 'N', ++nmasked;
+    return nmasked;
+}
+
+// Returns the number of bases masked.
+inline size_t mask_low_complexity(char *seq, size_t len, unsigned threshold=20) {
+    static constexpr unsigned NTRIPLETS = DUST_WINDOW - 2;
+    u8 counts[64], window[NTRIPLETS]; // Counts of each triplet in the window, and the window's triplets.
+    u64 sum(0); // sum_t c_t (c_t - 1) / 2
+    unsigned ntriplets(0), run(0), triplet(0);
+    size_t nmasked(0), masked_to(0); // Bases before masked_to are masked.
+    std::memset(counts, 0, sizeof(counts));
+    for(size_t i(0); i < len; ++i) {
+        const int8_t base(cstr_lut[u8(seq[i])]);
+        if(base < 0) {
+            std::memset(counts, 0, sizeof(counts));
+            sum = ntriplets = run = 0;
+            continue;
+        }
+        triplet = ((triplet << 2) | base) & 63;
+        if(++run < 3) continue;
+        // The triplet leaving a full window is in the slot the new one takes.
+        const unsigned slot((run - 3) % NTRIPLETS);
+        if(ntriplets == NTRIPLETS) sum -= --counts[window[slot]];
+        else                       ++ntriplets;
+        window[slot] = triplet;
+        sum += counts[triplet]++;
+        if(ntriplets == NTRIPLETS && sum > u64(threshold) * (NTRIPLETS - 1)) {
+            // Mask the window: bases [i + 1 - DUST_WINDOW, i].
+            for(size_t j(std::max(masked_to, i + 1 - DUST_WINDOW)); j <= i; ++j) seq[j] = 'N', ++nmasked;
+            masked_to = i + 1;
+        }
+    }
+    return nmasked;
+}
+
+} // namespace bns
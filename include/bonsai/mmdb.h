@@ -0,0 +1,206 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+
+namespace bns {
+
+/*
+ * Memory-mappable database format.
+ *
+ * Layout:
+ *  [0, MMDB_HEADER_SIZE): mmdb_header_t, zero-padded.
+ *  Sections, each starting on an MMDB_ALIGN-byte boundary.
+ *
+ * Every array is stored exactly as it is used in memory, so a database
+ * is opened with one read-only mmap and no copying or parsing.
+ * Because the mapping is shared and read-only, any number of processes
+ * classifying against the same file share one copy in the page cache,
+ * and opening a database costs the same regardless of its size.
+ *
+ * Fields appended to mmdb_header_t read as zero from older files,
+ * so new fields must treat zero as their default.
+ */
+static constexpr size_t MMDB_ALIGN        = 4096;
+static constexpr size_t MMDB_HEADER_SIZE  = 4096;
+static constexpr size_t MMDB_MAX_SECTIONS = 32;
+static constexpr u32    MMDB_VERSION      = 1;
+static const char MMDB_MAGIC[8] {'B', 'N', 'S', 'M', 'M', 'D', 'B', '\0'};
+
+enum mmdb_section: u32 {
+    MMDB_SPACING  = 1,
+    MMDB_KH_FLAGS = 2,
+    MMDB_KH_KEYS  = 3,
+    MMDB_KH_VALS  = 4,
+    MMDB_CL_TABLE = 5, // CacheLineTable buckets (cltable.h)
+    MMDB_BLOOM    = 6, // BlockedBloomFilter blocks (blockbloom.h)
+    MMDB_COMPACT  = 7, // CompactHashTable slots (chtable.h)
+    MMDB_TAXA     = 8, // Table of taxa (dense_taxa()) indexed by MMDB_COMPACT slots and 16-bit MMDB_CL_TABLE values
+    MMDB_MB_OFFSETS = 9,  // MinimizerBinTable bin offsets (mbtable.h)
+    MMDB_MB_KEYS    = 10, // MinimizerBinTable keys, sorted within each bin
+    MMDB_MB_VALS    = 11, // MinimizerBinTable taxa, parallel to MMDB_MB_KEYS
+    MMDB_HOST_BLOOM = 12, // BlockedBloomFilter blocks of a host filter's k-mers (hostfilter.h)
+};
+
+struct mmdb_section_t {
+    u32 type_;
+    u32 elsize_; // Size of a single element, checked on load.
+    u64 offset_;
+    u64 nbytes_;
+};
+
+struct mmdb_header_t {
+    char magic_[8];
+    u32  version_;
+    u32  nsections_;
+    u32  k_, w_;
+    u64  n_buckets_, size_, n_occupied_, upper_bound_;
+    mmdb_section_t sections_[MMDB_MAX_SECTIONS];
+    u64  cl_size_; // Number of keys in the MMDB_CL_TABLE section, if present.
+    u32  score_;   // score_scheme by which the database's minimizers were chosen. Zero (LEX) for older files.
+    u32  bloom_hashes_; // Number of hashes of the MMDB_BLOOM section, if present.
+    u64  ch_size_;       // Number of keys in the MMDB_COMPACT section, if present.
+    u64  ch_nslots_;     // Slots of the MMDB_COMPACT section keys hash to. The section holds a tail past them.
+    u32  ch_value_bits_; // Bits of each MMDB_COMPACT slot holding an index into MMDB_TAXA.
+    u32  cl_value_bits_; // 16 if MMDB_CL_TABLE values index MMDB_TAXA. Otherwise (zero in older files), they are taxa.
+    u32  mb_l_;          // Minimizer length of the MMDB_MB_* sections, if present.
+};
+static_assert(sizeof(mmdb_header_t) <= MMDB_HEADER_SIZE, "mmdb header must fit in its reserved space.");
+
+class MMapDBWriter {
+    mmdb_header_t header_;
+    std::vector<const void *> data_;
+public:
+    MMapDBWriter(u32 k, u32 w) {
+        std::memset(&header_, 0, sizeof(header_));
+        std::memcpy(header_.magic_, MMDB_MAGIC, sizeof(MMDB_MAGIC));
+        header_.version_ = MMDB_VERSION;
+        header_.k_ = k;
+        header_.w_ = w;
+    }
+    mmdb_header_t &header() {return header_;}
+    void add(u32 type, const void *data, u64 nbytes, u32 elsize=1) {
+        if(header_.nsections_ == MMDB_MAX_SECTIONS) RUNTIME_ERROR("Too many sections for mmdb header.");
+        header_.sections_[header_.nsections_++] = mmdb_section_t{type, elsize, 0, nbytes};
+        data_.push_back(data);
+    }
+    void write(const char *path) {
+        u64 offset(MMDB_HEADER_SIZE);
+        for(u32 i(0); i < header_.nsections_; ++i) {
+            auto &sec(header_.sections_[i]);
+            sec.offset_ = offset = (offset + MMDB_ALIGN - 1) & ~u64(MMDB_ALIGN - 1);
+            offset += sec.nbytes_;
+        }
+        std::FILE *fp(std::fopen(path, "wb"));
+        if(fp == nullptr) throw file_open_error(path);
+        std::vector<char> pad(MMDB_ALIGN);
+        auto checked_write = [fp,path](const void *p, size_t n) {
+            if(n && std::fwrite(p, 1, n, fp) != n) RUNTIME_ERROR(std::string("Could not write mmdb to ") + path);
+        };
+        checked_write(&header_, sizeof(header_));
+        checked_write(pad.data(), MMDB_HEADER_SIZE - sizeof(header_));
+        u64 pos(MMDB_HEADER_SIZE);
+        for(u32 i(0); i < header_.nsections_; ++i) {
+            const auto &sec(header_.sections_[i]);
+            checked_write(pad.data(), sec.offset_ - pos);
+            checked_write(data_[i], sec.nbytes_);
+            pos = sec.offset_ + sec.nbytes_;
+        }
+        std::fclose(fp);
+    }
+};
+
+class MMapDB {
+    int          fd_;
+    const char *data_;
+    size_t      size_;
+public:
+    MMapDB(const char *path): fd_(::open(path, O_RDONLY)), data_(nullptr), size_(0) {
+        if(fd_ < 0) throw file_open_error(path);
+        struct stat sb;
+        if(fstat(fd_, &sb) || size_t(sb.st_size) < MMDB_HEADER_SIZE)
+            RUNTIME_ERROR(std::string("File too small to be a mmdb: ") + path);
+        size_ = sb.st_size;
+        void *p(mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0));
+        if(p == MAP_FAILED) RUNTIME_ERROR(std::string("Could not mmap ") + path);
+        data_ = static_cast<const char *>(p);
+        const auto &h(header());
+        if(std::memcmp(h.magic_, MMDB_MAGIC, sizeof(MMDB_MAGIC)))
+            RUNTIME_ERROR(std::string("Bad magic for mmdb at ") + path);
+        if(h.version_ > MMDB_VERSION)
+            RUNTIME_ERROR(ks::sprintf("mmdb version %u is newer than supported (%u).", h.version_, MMDB_VERSION).data());
+        if(h.nsections_ > MMDB_MAX_SECTIONS) RUNTIME_ERROR("Corrupted mmdb header.");
+        for(u32 i(0); i < h.nsections_; ++i)
+            if(h.sections_[i].offset_ + h.sections_[i].nbytes_ > size_)
+                RUNTIME_ERROR(std::string("Truncated mmdb at ") + path);
+    }
+    MMapDB(const MMapDB &) = delete;
+    ~MMapDB() {
+        if(data_) munmap(const_cast<char *>(data_), size_);
+        if(fd_ >= 0) ::close(fd_);
+    }
+    const mmdb_header_t &header() const {return *reinterpret_cast<const mmdb_header_t *>(data_);}
+    size_t size() const {return size_;}
+    const mmdb_section_t *find(u32 type) const {
+        const auto &h(header());
+        for(u32 i(0); i < h.nsections_; ++i)
+            if(h.sections_[i].type_ == type) return h.sections_ + i;
+        return nullptr;
+    }
+    template<typename T>
+    const T *section(u32 type, u64 *nelem=nullptr) const {
+        const mmdb_section_t *sec(find(type));
+        if(sec == nullptr) RUNTIME_ERROR(ks::sprintf("Missing section %u in mmdb.", type).data());
+        if(sec->elsize_ != sizeof(T)) RUNTIME_ERROR(ks::sprintf("Section %u has element size %u, expected %zu.", type, sec->elsize_, sizeof(T)).data());
+        if(nelem) *nelem = sec->nbytes_ / sizeof(T);
+        return reinterpret_cast<const T *>(data_ + sec->offset_);
+    }
+    static bool is_mmdb(const char *path) {
+        char buf[sizeof(MMDB_MAGIC)];
+        std::FILE *fp(std::fopen(path, "rb"));
+        if(fp == nullptr) return false;
+        const bool ret(std::fread(buf, 1, sizeof(buf), fp) == sizeof(buf) && std::memcmp(buf, MMDB_MAGIC, sizeof(buf)) == 0);
+        std::fclose(fp);
+        return ret;
+    }
+};
+
+// Returns a khash header whose arrays point into the mapping.
+// Only the header itself is heap-allocated; free it with std::free, not khash_destroy.
+template<typename T>
+T *khash_from_mmdb(const MMapDB &mm) {
+    using keytype_t = std::remove_pointer_t<decltype(std::declval<T>().keys)>;
+    using valtype_t = std::remove_pointer_t<decltype(std::declval<T>().vals)>;
+    using flagtype_t = std::remove_pointer_t<decltype(std::declval<T>().flags)>;
+    T *ret(static_cast<T *>(std::calloc(1, sizeof(T))));
+    const auto &h(mm.header());
+    ret->n_buckets   = h.n_buckets_;
+    ret->size        = h.size_;
+    ret->n_occupied  = h.n_occupied_;
+    ret->upper_bound = h.upper_bound_;
+    u64 n;
+    ret->flags = const_cast<flagtype_t *>(mm.section<flagtype_t>(MMDB_KH_FLAGS, &n));
+    if(n != __ac_fsize(ret->n_buckets)) RUNTIME_ERROR("Flags section does not match bucket count.");
+    ret->keys  = const_cast<keytype_t *>(mm.section<keytype_t>(MMDB_KH_KEYS, &n));
+    if(n != ret->n_buckets) RUNTIME_ERROR("Keys section does not match bucket count.");
+    ret->vals  = const_cast<valtype_t *>(mm.section<valtype_t>(MMDB_KH_VALS, &n));
+    if(n != ret->n_buckets) RUNTIME_ERROR("Vals section does not match bucket count.");
+    return ret;
+}
+
+template<typename T>
+void khash_add_to_mmdb(const T *map, MMapDBWriter &writer) {
+    if(map->n_buckets == 0) RUNTIME_ERROR("Cannot write an empty hash table to mmdb.");
+    auto &h(writer.header());
+    h.n_buckets_   = map->n_buckets;
+    h.size_        = map->size;
+    h.n_occupied_  = map->n_occupied;
+    h.upper_bound_ = map->upper_bound;
+    writer.add(MMDB_KH_FLAGS, map->flags, __ac_fsize(map->n_buckets) * sizeof(*map->flags), sizeof(*map->flags));
+    writer.add(MMDB_KH_KEYS,  map->keys,  map->n_buckets * sizeof(*map->keys), sizeof(*map->keys));
+    writer.add(MMDB_KH_VALS,  map->vals,  map->n_buckets * sizeof(*map->vals), sizeof(*map->vals));
+}
+
+} // namespace bns
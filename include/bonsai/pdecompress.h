@@ -0,0 +1,323 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <exception>
+#include <future>
+#include <memory>
+#include <thread>
+#include "util.h"
+#if ZWRAP_USE_ZSTD
+#  include "zstd.h"
+#endif
+
+namespace bns {
+
+/*
+ * Parallel decompression of read files.
+ *
+ * BGZF files and, in zstd builds, zstd files with multiple frames consist of independently compressed pieces.
+ * A producer thread splits the input into batches of these pieces, workers decompress a batch
+ * while the previous one is written out in order, and the result is fed through a socket.
+ * The consumer opens the other end with gzdopen, which passes plain text through unchanged,
+ * so kseq and bseq_read see exactly the records they would have read from the file.
+ *
+ * Anything else (plain text, single-stream or ordinary multi-member gzip) cannot be split without
+ * inflating it first and is opened with gzopen on the calling thread, as before.
+ */
+
+enum input_format: int {
+    INPUT_OTHER = 0,
+    INPUT_BGZF  = 1,
+    INPUT_ZSTD  = 2,
+};
+
+// Only regular files are probed. Pipes, FIFOs and terminals are reported as INPUT_OTHER without being opened:
+// the bytes read would be lost to gzopen, and opening a FIFO blocks until it has a writer.
+// The opened file is checked again, in case path was replaced in between.
+inline int detect_input_format(const char *path) {
+    struct stat st;
+    if(::stat(path, &st)) throw file_open_error(path);
+    if(!S_ISREG(st.st_mode)) return INPUT_OTHER;
+    const int fd(::open(path, O_RDONLY | O_NONBLOCK));
+    if(fd < 0) throw file_open_error(path);
+    u8 buf[16];
+    ssize_t n(0);
+    if(::fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        for(ssize_t r; n < ssize_t(sizeof(buf)) && (r = ::read(fd, buf + n, sizeof(buf) - n)) > 0; n += r);
+    ::close(fd);
+    if(n >= 4 && ((buf[0] == 0x28 && buf[1] == 0xB5 && buf[2] == 0x2F && buf[3] == 0xFD) ||    // zstd frame
+                  ((buf[0] & 0xF0) == 0x50 && buf[1] == 0x2A && buf[2] == 0x4D && buf[3] == 0x18))) // skippable frame
+        return INPUT_ZSTD;
+    if(n == ssize_t(sizeof(buf)) && buf[0] == 31 && buf[1] == 139 && buf[2] == 8 && (buf[3] & 4) &&
+       (buf[10] | (buf[11] << 8)) >= 6 && buf[12] == 'B' && buf[13] == 'C' && buf[14] == 2 && buf[15] == 0)
+        return INPUT_BGZF;
+    return INPUT_OTHER;
+}
+
+class ParallelDecompressor {
+    struct batch_t {
+        std::string                           in_;
+        std::vector<std::pair<size_t, size_t>> blocks_; // Offset, length in in_.
+        std::vector<std::string>              out_;
+        std::vector<std::future<void>>        tasks_;
+        bool                                  stream_ = false; // Next zstd frame too large to batch.
+    };
+
+    static constexpr size_t BLOCKS_PER_THREAD = 64;
+    static constexpr size_t ZSTD_MAX_BATCH    = size_t(64) << 20;
+
+    int              fds_[2];
+    std::FILE       *fp_;
+    const int        format_;
+    const unsigned   nthreads_;
+    std::string      carry_; // zstd input read past the end of the last batch.
+    std::exception_ptr error_;
+    std::thread      thread_;
+
+    // Returns false if the consumer has gone away.
+    bool write_out(const char *p, size_t l) {
+        while(l) {
+            const ssize_t nwritten(::send(fds_[1], p, l, MSG_NOSIGNAL));
+            if(nwritten < 0) {
+                if(errno == EINTR) continue;
+                if(errno == EPIPE || errno == ECONNRESET) return false;
+                RUNTIME_ERROR(std::string("Could not write decompressed data: ") + std::strerror(errno));
+            }
+            p += nwritten, l -= nwritten;
+        }
+        return true;
+    }
+
+    void fill_bgzf(batch_t &b) {
+        const size_t target(nthreads_ * BLOCKS_PER_THREAD);
+        u8 hdr[12];
+        while(b.blocks_.size() < target) {
+            const size_t nread(std::fread(hdr, 1, sizeof(hdr), fp_));
+            if(nread == 0) break;
+            if(nread != sizeof(hdr) || hdr[0] != 31 || hdr[1] != 139 || !(hdr[3] & 4))
+                RUNTIME_ERROR("Malformed or truncated BGZF block.");
+            const size_t xlen(hdr[10] | (hdr[11] << 8)), start(b.in_.size());
+            b.in_.resize(start + sizeof(hdr) + xlen);
+            std::memcpy(&b.in_[start], hdr, sizeof(hdr));
+            if(std::fread(&b.in_[start + sizeof(hdr)], 1, xlen, fp_) != xlen) RUNTIME_ERROR("Truncated BGZF header.");
+            size_t bsize(0);
+            for(const u8 *x(reinterpret_cast<const u8 *>(&b.in_[start + sizeof(hdr)])), *e(x + xlen); x + 4 <= e;) {
+                const size_t slen(x[2] | (x[3] << 8));
+                if(x[0] == 'B' && x[1] == 'C' && slen == 2 && x + 6 <= e) bsize = (x[4] | (x[5] << 8)) + 1;
+                x += 4 + slen;
+            }
+            if(bsize < sizeof(hdr) + xlen + 8) RUNTIME_ERROR("Gzip member without a BGZF block size in BGZF input.");
+            const size_t rest(bsize - sizeof(hdr) - xlen);
+            b.in_.resize(start + bsize);
+            if(std::fread(&b.in_[start + sizeof(hdr) + xlen], 1, rest, fp_) != rest) RUNTIME_ERROR("Truncated BGZF block.");
+            b.blocks_.emplace_back(start, bsize);
+        }
+    }
+    static void inflate_bgzf(const char *src, size_t l, std::string &out, z_stream &zs) {
+        const u8 *u(reinterpret_cast<const u8 *>(src));
+        const size_t xlen(u[10] | (u[11] << 8)), isize(u[l - 4] | (u[l - 3] << 8) | (u[l - 2] << 16) | (size_t(u[l - 1]) << 24));
+        const u32 crc(u[l - 8] | (u[l - 7] << 8) | (u[l - 6] << 16) | (u32(u[l - 5]) << 24));
+        out.resize(isize);
+        inflateReset(&zs);
+        zs.next_in   = const_cast<Bytef *>(u + 12 + xlen);
+        zs.avail_in  = l - 12 - xlen - 8;
+        zs.next_out  = reinterpret_cast<Bytef *>(&out[0]);
+        zs.avail_out = isize;
+        if(inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != isize)
+            RUNTIME_ERROR("Failed to inflate BGZF block.");
+        if(crc32(crc32(0, nullptr, 0), reinterpret_cast<const Bytef *>(out.data()), isize) != crc)
+            RUNTIME_ERROR("CRC mismatch in BGZF block.");
+    }
+
+#if ZWRAP_USE_ZSTD
+    void fill_zstd(batch_t &b) {
+        const size_t target(nthreads_ * BLOCKS_PER_THREAD);
+        std::swap(b.in_, carry_);
+        carry_.clear();
+        size_t pos(0);
+        bool eof(false);
+        while(b.blocks_.size() < target) {
+            const size_t fsize(ZSTD_findFrameCompressedSize(b.in_.data() + pos, b.in_.size() - pos));
+            if(!ZSTD_isError(fsize)) {
+                b.blocks_.emplace_back(pos, fsize);
+                if((pos += fsize) == b.in_.size() && eof) break;
+                continue;
+            }
+            if(eof) {
+                if(pos == b.in_.size()) break;
+                RUNTIME_ERROR("Truncated or corrupted zstd frame.");
+            }
+            if(b.in_.size() - pos >= ZSTD_MAX_BATCH) {
+                if(b.blocks_.empty()) b.stream_ = true; // A single frame this large gets decompressed as a stream.
+                break;
+            }
+            const size_t old(b.in_.size()), toread(std::max(old - pos, size_t(1) << 20));
+            b.in_.resize(old + toread);
+            const size_t nread(std::fread(&b.in_[old], 1, toread, fp_));
+            b.in_.resize(old + nread);
+            eof = nread < toread;
+        }
+        carry_.assign(b.in_, pos, std::string::npos);
+        b.in_.resize(pos);
+    }
+    static void decompress_zstd(const char *src, size_t l, std::string &out, ZSTD_DCtx *dctx) {
+        const unsigned long long csize(ZSTD_getFrameContentSize(src, l));
+        if(csize == ZSTD_CONTENTSIZE_ERROR) RUNTIME_ERROR("Invalid zstd frame.");
+        if(csize != ZSTD_CONTENTSIZE_UNKNOWN) {
+            out.resize(csize);
+            const size_t ret(ZSTD_decompressDCtx(dctx, &out[0], csize, src, l));
+            if(ZSTD_isError(ret) || ret != csize) RUNTIME_ERROR(std::string("Failed to decompress zstd frame: ") + ZSTD_getErrorName(ret));
+            return;
+        }
+        ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+        ZSTD_inBuffer in{src, l, 0};
+        out.clear();
+        for(size_t ret(1); ret;) {
+            const size_t used(out.size());
+            out.resize(used + ZSTD_DStreamOutSize());
+            ZSTD_outBuffer o{&out[used], ZSTD_DStreamOutSize(), 0};
+            if(ZSTD_isError(ret = ZSTD_decompressStream(dctx, &o, &in)))
+                RUNTIME_ERROR(std::string("Failed to decompress zstd frame: ") + ZSTD_getErrorName(ret));
+            out.resize(used + o.pos);
+            if(ret && in.pos == in.size && o.pos < o.size) RUNTIME_ERROR("Truncated zstd frame.");
+        }
+    }
+    // Decompresses the frame at the start of carry_ as a stream, without holding all of it in memory.
+    bool stream_zstd() {
+        std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        std::string in(std::move(carry_)), out(ZSTD_DStreamOutSize(), '\0');
+        carry_.clear();
+        ZSTD_inBuffer zin{in.data(), in.size(), 0};
+        for(size_t ret(1); ret;) {
+            if(zin.pos == zin.size) {
+                in.resize(1 << 20);
+                if((in.resize(std::fread(&in[0], 1, in.size(), fp_)), in.empty())) RUNTIME_ERROR("Truncated zstd frame.");
+                zin = ZSTD_inBuffer{in.data(), in.size(), 0};
+            }
+            ZSTD_outBuffer zout{&out[0], out.size(), 0};
+            if(ZSTD_isError(ret = ZSTD_decompressStream(dctx.get(), &zout, &zin)))
+                RUNTIME_ERROR(std::string("Failed to decompress zstd frame: ") + ZSTD_getErrorName(ret));
+            if(!write_out(out.data(), zout.pos)) return false;
+        }
+        carry_.assign(in, zin.pos, std::string::npos);
+        return true;
+    }
+#endif
+
+    void launch(batch_t &b) {
+        b.out_.resize(b.blocks_.size());
+        const unsigned ntasks(std::min(size_t(nthreads_), b.blocks_.size()));
+        for(unsigned t(0); t < ntasks; ++t) {
+            b.tasks_.emplace_back(std::async(std::launch::async, [&b,t,ntasks,this]() {
+                if(format_ == INPUT_BGZF) {
+                    z_stream zs;
+                    std::memset(&zs, 0, sizeof(zs));
+                    if(inflateInit2(&zs, -15) != Z_OK) RUNTIME_ERROR("Could not initialize inflate.");
+                    std::unique_ptr<z_stream, int (*)(z_stream *)> cleanup(&zs, inflateEnd);
+                    for(size_t i(t); i < b.blocks_.size(); i += ntasks)
+                        inflate_bgzf(&b.in_[b.blocks_[i].first], b.blocks_[i].second, b.out_[i], zs);
+                }
+#if ZWRAP_USE_ZSTD
+                else {
+                    std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+                    for(size_t i(t); i < b.blocks_.size(); i += ntasks)
+                        decompress_zstd(&b.in_[b.blocks_[i].first], b.blocks_[i].second, b.out_[i], dctx.get());
+                }
+#endif
+            }));
+        }
+    }
+    // Waits for b's workers and writes its output. Returns false if the consumer has gone away.
+    bool drain(batch_t &b) {
+        for(auto &task: b.tasks_) task.get();
+        bool ret(true);
+        for(const auto &out: b.out_) if(!(ret = write_out(out.data(), out.size()))) break;
+        b.in_.clear(), b.blocks_.clear(), b.out_.clear(), b.tasks_.clear();
+        b.stream_ = false;
+        return ret;
+    }
+    void run() {
+        batch_t batches[2];
+        unsigned cur(0);
+        bool pending(false);
+        try {
+            for(;;) {
+                batch_t &b(batches[cur]);
+#if ZWRAP_USE_ZSTD
+                if(format_ == INPUT_ZSTD) fill_zstd(b);
+                else
+#endif
+                fill_bgzf(b);
+#if ZWRAP_USE_ZSTD
+                if(b.stream_) {
+                    if(pending && !drain(batches[cur ^ 1])) break;
+                    pending = false;
+                    b.stream_ = false;
+                    if(!stream_zstd()) break;
+                    continue;
+                }
+#endif
+                if(b.blocks_.empty()) break;
+                launch(b);
+                if(pending && !drain(batches[cur ^ 1])) break;
+                pending = true;
+                cur ^= 1;
+            }
+            if(pending) drain(batches[cur ^ 1]);
+        } catch(...) {
+            for(auto &b: batches) for(auto &task: b.tasks_) if(task.valid()) task.wait();
+            error_ = std::current_exception();
+        }
+        ::shutdown(fds_[1], SHUT_WR);
+    }
+public:
+    ParallelDecompressor(const char *path, int format, unsigned nthreads):
+        fp_(std::fopen(path, "rb")), format_(format), nthreads_(std::max(nthreads, 1u))
+    {
+        if(fp_ == nullptr) throw file_open_error(path);
+#if !ZWRAP_USE_ZSTD
+        if(format == INPUT_ZSTD) RUNTIME_ERROR("zstd input requires a zstd-enabled build.");
+#endif
+        if(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds_)) RUNTIME_ERROR(std::string("socketpair failed: ") + std::strerror(errno));
+        thread_ = std::thread([this]() {run();});
+    }
+    ParallelDecompressor(const ParallelDecompressor &) = delete;
+    // Read end of the decompressed stream. The caller owns it (e.g., through gzdopen), and must close it before
+    // destroying the decompressor, even on error: the producer only stops early once its reader is gone.
+    int fd() const {return fds_[0];}
+    // Waits for the producer to finish and rethrows anything it failed with.
+    // Call after reading to the end, or after closing fd() to abandon the input.
+    void finish() {
+        if(thread_.joinable()) thread_.join();
+        if(error_) {
+            std::exception_ptr e(error_);
+            error_ = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+    ~ParallelDecompressor() {
+        if(thread_.joinable()) thread_.join();
+        ::close(fds_[1]);
+        std::fclose(fp_);
+    }
+};
+
+// Opens path for kseq, decompressing it on nthreads threads if its format allows.
+// If so, dec holds the decompressor, whose finish() should be called once the input has been read.
+inline gzFile gzopen_parallel(const char *path, unsigned nthreads, std::unique_ptr<ParallelDecompressor> &dec) {
+    const int format(nthreads > 1 ? detect_input_format(path): INPUT_OTHER);
+#if !ZWRAP_USE_ZSTD
+    if(format == INPUT_ZSTD) return gzopen(path, "rb"); // Let zlib report it; we cannot split it.
+#endif
+    if(format == INPUT_OTHER) return gzopen(path, "rb");
+    dec.reset(new ParallelDecompressor(path, format, nthreads));
+    LOG_DEBUG("Decompressing %s input %s with %u threads\n", format == INPUT_BGZF ? "BGZF": "zstd", path, nthreads);
+    gzFile ret(gzdopen(dec->fd(), "rb"));
+    if(ret) gzbuffer(ret, 1 << 17);
+    return ret;
+}
+
+} // namespace bns
@@ -72,7 +72,40 @@ class QueueMap {
     }
 };
 
-using qmap_t = QueueMap<u64, u64>;
+/*
+ * Returns the same window minima as QueueMap, as long as an element's score is a function of the element,
+ * in amortized O(1) per element instead of two ordered map operations.
+ * It keeps only the window's elements that are smaller than every element after them: the front is the
+ * minimum, and each new element first evicts the entries at the back it is not larger than.
+ */
+template<typename T, typename ScoreType>
+class MinQueue {
+    using PairType = ElScore<T, ScoreType>;
+    struct Entry {
+        PairType el_;
+        u64      index_;
+    };
+    std::vector<Entry> ring_;  // Holds up to wsz_ + 1 entries: a new element enters before the oldest leaves.
+    const u64          mask_;
+    const size_t       wsz_;
+    u64                front_, back_, n_; // Ring positions [front_, back_) are in use. n_ elements seen so far.
+public:
+    MinQueue(size_t wsz): ring_(circ::roundup(wsz + 1)), mask_(ring_.size() - 1), wsz_(wsz), front_(0), back_(0), n_(0) {}
+    const PairType &min() const {return ring_[front_ & mask_].el_;}
+    u64 next_value(const T el, const ScoreType score) {
+        const PairType pair(el, score);
+        while(back_ != front_ && !(ring_[(back_ - 1) & mask_].el_ < pair)) --back_;
+        ring_[back_++ & mask_] = Entry{pair, n_};
+        if(ring_[front_ & mask_].index_ + wsz_ <= n_) ++front_;
+        // Signal a window that is not filled by 0xFFFFFFFFFFFFFFFF
+        return ++n_ >= wsz_ ? min().el_: BF;
+    }
+    void reset() {
+        front_ = back_ = n_ = 0;
+    }
+};
+
+using qmap_t = MinQueue<u64, u64>;
 using elscore_t = ElScore<u64, u64>;
 
 } // namespace bns
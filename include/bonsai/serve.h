@@ -0,0 +1,347 @@
+#pragma once
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <list>
+#include <set>
+#include "classifier.h"
+
+namespace bns {
+
+/*
+ * Resident classification server (bonsai serve) and its client (bonsai query), over a Unix domain socket.
+ *
+ * The server loads the database and taxonomy once, so that a job pays for neither process startup nor a cold page cache.
+ * A client connects and sends one request line:
+ *     CLASSIFY <r1> [<r2>]  classify read files the server opens (paths are taken as given, so clients send absolute ones);
+ *     STREAM                classify FASTA/FASTQ (optionally gzipped) the client sends after the line, up to its end of stream;
+ *     SHUTDOWN              stop accepting jobs, and exit once running jobs finish. Streams end with the reads sent so far,
+ *                           and connections yet to send a request are turned away.
+ * The server answers with frames: a type byte, a 32-bit payload length in host order, and the payload.
+ * SERVE_DATA frames carry classify output, one per chunk, as soon as the chunk is classified; the job ends with a
+ * SERVE_DONE frame holding a summary line, or a SERVE_ERROR frame holding the error.
+ *
+ * Each connection has its own thread, which reads its chunks, but all jobs share the server's thread pool and
+ * per-thread buffers, one chunk at a time. Chunks take turns in the order they are ready (a ticket lock),
+ * and a job queues again after each of its chunks, so concurrent jobs advance chunk by chunk, and a large job
+ * does not hold up a small one for longer than a chunk.
+ */
+enum serve_frame: char {
+    SERVE_DATA  = 'D',
+    SERVE_DONE  = 'K',
+    SERVE_ERROR = 'E',
+};
+
+// Chunks are smaller than classify's by default, to bound the wait between turns and before a job's first results.
+static constexpr unsigned SERVE_CHUNK_BASES = 1u << 18;
+
+inline void send_all(int fd, const char *p, size_t l) {
+    for(const char *e(p + l); p < e;) {
+        const ssize_t nwritten(::send(fd, p, e - p, MSG_NOSIGNAL));
+        if(nwritten < 0) {
+            if(errno == EINTR) continue;
+            RUNTIME_ERROR(std::string("Could not write to socket: ") + std::strerror(errno));
+        }
+        p += nwritten;
+    }
+}
+
+// Returns false if the stream ends before l bytes.
+inline bool recv_all(int fd, char *p, size_t l) {
+    for(char *e(p + l); p < e;) {
+        const ssize_t nread(::recv(fd, p, e - p, 0));
+        if(nread < 0) {
+            if(errno == EINTR) continue;
+            RUNTIME_ERROR(std::string("Could not read from socket: ") + std::strerror(errno));
+        }
+        if(nread == 0) return false;
+        p += nread;
+    }
+    return true;
+}
+
+inline void send_frame(int fd, serve_frame type, const char *data, u32 len) {
+    char header[1 + sizeof(len)];
+    header[0] = type;
+    std::memcpy(header + 1, &len, sizeof(len));
+    send_all(fd, header, sizeof(header));
+    send_all(fd, data, len);
+}
+
+// Returns false at the end of the stream.
+inline bool recv_frame(int fd, char &type, std::string &payload) {
+    char header[1 + sizeof(u32)];
+    if(!recv_all(fd, header, sizeof(header))) return false;
+    type = header[0];
+    u32 len;
+    std::memcpy(&len, header + 1, sizeof(len));
+    payload.resize(len);
+    if(len && !recv_all(fd, &payload[0], len)) RUNTIME_ERROR("Truncated frame from server.");
+    return true;
+}
+
+inline sockaddr_un unix_address(const char *path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(std::strlen(path) >= sizeof(addr.sun_path)) RUNTIME_ERROR(std::string("Socket path is too long: ") + path);
+    std::strcpy(addr.sun_path, path);
+    return addr;
+}
+
+// Returns a socket connected to the server at path, or -1 if none is listening there.
+inline int connect_unix(const char *path) {
+    const sockaddr_un addr(unix_address(path));
+    const int fd(::socket(AF_UNIX, SOCK_STREAM, 0));
+    if(fd < 0) RUNTIME_ERROR(std::string("socket failed: ") + std::strerror(errno));
+    if(::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr))) {
+        const int err(errno); // For the caller's message.
+        ::close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+template<typename ScoreType>
+class ClassifyServer {
+    const ClassifierGeneric<ScoreType> &c_;
+    const TaxonomyIndex                &tax_;
+    const unsigned                      chunk_size_;
+    ForPool                             pool_;
+    ClassifyArena<ScoreType>            arena_;
+    std::mutex                          mutex_;
+    std::condition_variable             turn_cv_, jobs_cv_;
+    u64                                 next_ticket_, serving_; // Ticket lock for the pool and arena.
+    size_t                              njobs_;    // Connections being handled.
+    std::list<std::thread>              threads_;  // Connection threads.
+    std::vector<std::list<std::thread>::iterator> finished_; // Connection threads done with their jobs, to be joined.
+    std::set<int>                       conn_fds_; // Open connections, whose reads stop ends.
+    int                                 listen_fd_;
+    std::atomic<bool>                   stopping_;
+    std::string                         path_;
+public:
+    ClassifyServer(const ClassifierGeneric<ScoreType> &c, const TaxonomyIndex &tax, const char *path,
+                   unsigned chunk_size=SERVE_CHUNK_BASES):
+        c_(c), tax_(tax), chunk_size_(chunk_size), pool_(c.nt_), arena_(c), next_ticket_(0), serving_(0), njobs_(0),
+        listen_fd_(-1), stopping_(false), path_(path)
+    {
+        if(c.report_only_ || c.host_) RUNTIME_ERROR("The server writes records per read, and does not screen host reads.");
+        // A socket file left by a server that is gone is replaced; one that still answers is not.
+        const int probe(connect_unix(path));
+        if(probe >= 0) {
+            ::close(probe);
+            RUNTIME_ERROR(std::string("A server is already listening at ") + path);
+        }
+        // Only a socket is replaced: anything else at path, such as a database given in its place, is left alone.
+        struct stat st;
+        if(::lstat(path, &st) == 0) {
+            if(!S_ISSOCK(st.st_mode)) RUNTIME_ERROR(std::string(path) + " exists and is not a socket. Not replacing it.");
+            ::unlink(path);
+        } else if(errno != ENOENT) RUNTIME_ERROR(std::string("Could not stat ") + path + ": " + std::strerror(errno));
+        const sockaddr_un addr(unix_address(path));
+        if((listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0)) < 0) RUNTIME_ERROR(std::string("socket failed: ") + std::strerror(errno));
+        if(::bind(listen_fd_, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) || ::listen(listen_fd_, 64)) {
+            const std::string err(std::strerror(errno));
+            ::close(listen_fd_);
+            RUNTIME_ERROR("Could not listen at " + path_ + ": " + err);
+        }
+    }
+    ClassifyServer(const ClassifyServer &) = delete;
+    ~ClassifyServer() {
+        stop();
+        for(auto &t: threads_) if(t.joinable()) t.join();
+        ::close(listen_fd_);
+        ::unlink(path_.data());
+    }
+    // Accepts and handles jobs until stop is called or a client sends SHUTDOWN, then waits for running jobs.
+    void serve() {
+        for(;;) {
+            const int fd(::accept(listen_fd_, nullptr, nullptr));
+            if(stopping_) {
+                if(fd >= 0) ::close(fd);
+                break;
+            }
+            if(fd < 0) {
+                if(errno == EINTR || errno == ECONNABORTED) continue;
+                RUNTIME_ERROR(std::string("accept failed: ") + std::strerror(errno));
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            join_finished();
+            ++njobs_;
+            conn_fds_.insert(fd);
+            if(stopping_) ::shutdown(fd, SHUT_RD); // stop has already ended the others' reads.
+            // The thread cannot finish before it is stored, as it takes the lock to do so.
+            const auto it(threads_.emplace(threads_.end()));
+            *it = std::thread([this,fd,it] {
+                handle(fd);
+                std::lock_guard<std::mutex> lock(mutex_);
+                // Closed under the lock, so that stop never shuts down a descriptor reused by another connection.
+                conn_fds_.erase(fd);
+                ::close(fd);
+                finished_.push_back(it);
+                --njobs_;
+                jobs_cv_.notify_all();
+            });
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        jobs_cv_.wait(lock, [this] {return njobs_ == 0;});
+        join_finished();
+    }
+    // Makes serve return once running jobs finish. Safe to call from any thread.
+    // Connections stop being read, so that a client which sends nothing more cannot keep serve waiting:
+    // a stream ends with the reads received, and a connection without a request fails. Output is still sent.
+    void stop() {
+        if(stopping_.exchange(true)) return;
+        // Wakes the accept in serve.
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        std::lock_guard<std::mutex> lock(mutex_);
+        for(const int fd: conn_fds_) ::shutdown(fd, SHUT_RD);
+    }
+    const std::string &path() const {return path_;}
+private:
+    // Called with mutex_ held.
+    void join_finished() {
+        for(const auto it: finished_) it->join(), threads_.erase(it);
+        finished_.clear();
+    }
+    struct Turn {
+        ClassifyServer &s_;
+        Turn(ClassifyServer &s): s_(s) {
+            std::unique_lock<std::mutex> lock(s_.mutex_);
+            const u64 ticket(s_.next_ticket_++);
+            s_.turn_cv_.wait(lock, [&] {return s_.serving_ == ticket;});
+        }
+        ~Turn() {
+            std::lock_guard<std::mutex> lock(s_.mutex_);
+            ++s_.serving_;
+            s_.turn_cv_.notify_all();
+        }
+    };
+    static std::string read_request(int fd) {
+        std::string ret;
+        for(char ch; ret.size() < 1 << 16;) {
+            if(!recv_all(fd, &ch, 1)) RUNTIME_ERROR("Connection closed before a request was sent.");
+            if(ch == '\n') return ret;
+            ret.push_back(ch);
+        }
+        RUNTIME_ERROR("Request line is too long.");
+    }
+    // Runs the job requested on fd, reporting a failure to the client. The caller closes fd.
+    void handle(int fd) {
+        try {
+            std::istringstream is(read_request(fd));
+            std::string command, path1, path2;
+            is >> command >> path1 >> path2;
+            gzFile ifp1(nullptr), ifp2(nullptr);
+            if(command == "SHUTDOWN") {
+                stop();
+                send_frame(fd, SERVE_DONE, "Shutting down.", 14);
+                return;
+            } else if(command == "CLASSIFY" && !path1.empty()) {
+                if((ifp1 = gzopen(path1.data(), "rb")) == nullptr) throw file_open_error(path1);
+                if(!path2.empty() && (ifp2 = gzopen(path2.data(), "rb")) == nullptr) {
+                    gzclose(ifp1);
+                    throw file_open_error(path2);
+                }
+            } else if(command == "STREAM") {
+                // gzdopen takes ownership of the descriptor it is given, and frames are still sent on fd.
+                const int dupfd(::dup(fd));
+                if(dupfd < 0 || (ifp1 = gzdopen(dupfd, "rb")) == nullptr) RUNTIME_ERROR("Could not read the streamed reads.");
+            } else RUNTIME_ERROR("Unknown request: " + is.str());
+            kseq_t *ks1(kseq_init(ifp1)), *ks2(ifp2 ? kseq_init(ifp2): nullptr);
+            try {
+                run_job(fd, ks1, ks2);
+            } catch(...) {
+                kseq_destroy(ks1), gzclose(ifp1);
+                if(ks2) kseq_destroy(ks2), gzclose(ifp2);
+                throw;
+            }
+            kseq_destroy(ks1), gzclose(ifp1);
+            if(ks2) kseq_destroy(ks2), gzclose(ifp2);
+        } catch(const std::exception &ex) {
+            LOG_WARNING("Job failed: %s\n", ex.what());
+            try {
+                send_frame(fd, SERVE_ERROR, ex.what(), std::strlen(ex.what()));
+            } catch(const std::exception &) {} // The client is gone.
+        }
+    }
+    void run_job(int fd, kseq_t *ks1, kseq_t *ks2) {
+        const int is_paired(ks2 != nullptr);
+        ClassifyChunk chunk;
+        u64 nreads(0), nclassified(0);
+        if(c_.get_emit_binary()) send_frame(fd, SERVE_DATA, CLS_BINARY_MAGIC, sizeof(CLS_BINARY_MAGIC));
+        for(int nseq; (nseq = chunk.read(chunk_size_, ks1, ks2)) > 0;) {
+            chunk.out_.clear();
+            {
+                Turn turn(*this);
+                // Only one chunk is classified at a time, so the change in c_'s count is this chunk's.
+                const u64 before(c_.n_classified());
+                arena_.first_read_ = nreads;
+                classify_seqs(c_, tax_, chunk.seqs_, chunk.out_, nseq, is_paired, pool_, arena_);
+                nclassified += c_.n_classified() - before;
+            }
+            nreads += is_paired ? nseq / 2: nseq;
+            if(chunk.out_.size()) send_frame(fd, SERVE_DATA, chunk.out_.data(), chunk.out_.size());
+        }
+        const std::string summary(ks::sprintf("Classified %" PRIu64 " of %" PRIu64 " reads.", nclassified, nreads).data());
+        send_frame(fd, SERVE_DONE, summary.data(), summary.size());
+    }
+};
+
+/*
+ * Sends request to the server at path and writes the output it streams back to out.
+ * If stream_fd is nonnegative, its contents are sent after the request (for STREAM) from another thread,
+ * so that the server never waits for the client to read output while the client is still sending reads.
+ * Returns the server's summary, and throws the server's error if the job fails.
+ */
+inline std::string query_server(const char *path, const std::string &request, std::FILE *out, int stream_fd=-1) {
+    const int fd(connect_unix(path));
+    if(fd < 0) RUNTIME_ERROR(std::string("No server is listening at ") + path + ": " + std::strerror(errno));
+    std::string line(request + '\n'), payload, error;
+    std::thread sender;
+    try {
+        send_all(fd, line.data(), line.size());
+        if(stream_fd >= 0) {
+            sender = std::thread([fd,stream_fd,&error] {
+                try {
+                    char buf[1 << 16];
+                    for(ssize_t n; (n = ::read(stream_fd, buf, sizeof(buf))) != 0;) {
+                        if(n < 0) {
+                            if(errno == EINTR) continue;
+                            RUNTIME_ERROR(std::string("Could not read reads to send: ") + std::strerror(errno));
+                        }
+                        send_all(fd, buf, n);
+                    }
+                } catch(const std::exception &ex) {
+                    error = ex.what(); // The server reports the truncated stream, or has already failed.
+                }
+                ::shutdown(fd, SHUT_WR);
+            });
+        }
+        char type;
+        while(recv_frame(fd, type, payload)) {
+            switch(type) {
+                case SERVE_DATA:
+                    if(std::fwrite(payload.data(), 1, payload.size(), out) != payload.size()) RUNTIME_ERROR("Could not write output.");
+                    break;
+                case SERVE_DONE: case SERVE_ERROR:
+                    if(sender.joinable()) ::shutdown(fd, SHUT_RDWR), sender.join();
+                    ::close(fd);
+                    if(type == SERVE_ERROR) throw std::runtime_error(payload);
+                    if(!error.empty()) throw std::runtime_error(error);
+                    return payload;
+                default: RUNTIME_ERROR(ks::sprintf("Unknown frame type %d from server.", type).data());
+            }
+        }
+        RUNTIME_ERROR("Server closed the connection before the job finished.");
+    } catch(...) {
+        if(sender.joinable()) ::shutdown(fd, SHUT_RDWR), sender.join();
+        ::close(fd);
+        throw;
+    }
+}
+
+} // namespace bns
@@ -0,0 +1,300 @@
+#pragma once
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include "classifier.h"
+
+namespace bns {
+
+/*
+ * Low-latency classification of reads as they arrive, e.g., from a basecaller writing to stdin or a named pipe.
+ *
+ * process_dataset fills chunks of CLASSIFY_CHUNK_BASES bases before classifying anything, and kseq cannot help either:
+ * zlib's gzread keeps calling read until its buffer is full, so a record written to a pipe is only parsed once
+ * more data follows it. StreamReader instead parses what each read returns on its own thread, so a record is queued
+ * as soon as its last line arrives, and next_batch hands out a batch once it holds batch_reads records or
+ * batch_ms has passed since its first record arrived, whichever comes first. Each batch is classified and its output
+ * flushed before the next one, so a read's output follows it by at most batch_ms plus the time to classify a batch.
+ *
+ * Input is FASTQ, with sequence and qualities on any number of lines, or FASTA, optionally gzipped, which is inflated
+ * as it arrives. A FASTA record only ends at the next header (or the end of input), so FASTQ gives lower latency.
+ * Reads are single-end.
+ */
+static constexpr unsigned STREAM_DEFAULT_BATCH_READS = 1024;
+static constexpr unsigned STREAM_DEFAULT_BATCH_MS    = 100;
+
+class StreamReader {
+public:
+    using clock = std::chrono::steady_clock;
+private:
+    int                     fd_;
+    bool                    own_fd_;
+    size_t                  capacity_; // The reader waits while this many records are queued.
+    std::mutex              mutex_;
+    std::condition_variable ready_cv_, space_cv_;
+    std::deque<std::pair<bseq1_t, clock::time_point>> queue_; // Records and their arrival times.
+    bool                    done_;
+    std::exception_ptr      error_;
+    std::atomic<bool>       stop_;
+    // Parser state, used by the reader thread only.
+    enum {EXPECT_HEADER, IN_SEQ, IN_QUAL} state_;
+    char                    type_; // '>' or '@'.
+    std::string             line_, name_, comment_, seq_, qual_;
+    std::unique_ptr<z_stream, void (*)(z_stream *)> zs_; // If the input is gzipped.
+    std::string             head_;    // First bytes, until the input is known to be gzipped or not.
+    bool                    format_known_;
+    std::thread             thread_;
+public:
+    // Reads path, or stdin if path is "-". Opening a named pipe waits for a writer.
+    StreamReader(const char *path, size_t capacity=size_t(STREAM_DEFAULT_BATCH_READS) * 4):
+        StreamReader(std::strcmp(path, "-") ? ::open(path, O_RDONLY): STDIN_FILENO, std::strcmp(path, "-") != 0, capacity)
+    {
+        if(fd_ < 0) throw file_open_error(path);
+    }
+    StreamReader(int fd, bool own_fd, size_t capacity=size_t(STREAM_DEFAULT_BATCH_READS) * 4):
+        fd_(fd), own_fd_(own_fd), capacity_(std::max(capacity, size_t(1))), done_(false), stop_(false),
+        state_(EXPECT_HEADER), type_(0), zs_(nullptr, [](z_stream *zs) {inflateEnd(zs); delete zs;}), format_known_(false)
+    {
+        if(fd_ >= 0) thread_ = std::thread([this] {run();});
+    }
+    StreamReader(const StreamReader &) = delete;
+    ~StreamReader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            space_cv_.notify_all();
+        }
+        if(thread_.joinable()) thread_.join();
+        for(auto &rec: queue_) bseq_destroy(&rec.first);
+        if(own_fd_ && fd_ >= 0) ::close(fd_);
+    }
+    // Replaces batch's records with the next batch: up to max_reads records, handed out once there are that many,
+    // max_wait has passed since the first of them arrived, or the input has ended. Sets first_arrival to that
+    // record's arrival. Returns the number of records, 0 at the end of the input, and rethrows errors reading it.
+    size_t next_batch(std::vector<bseq1_t> &batch, size_t max_reads, std::chrono::milliseconds max_wait, clock::time_point &first_arrival) {
+        for(auto &rec: batch) bseq_destroy(&rec);
+        batch.clear();
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_cv_.wait(lock, [&] {return !queue_.empty() || done_;});
+        if(queue_.empty()) {
+            if(error_) std::rethrow_exception(error_);
+            return 0;
+        }
+        first_arrival = queue_.front().second;
+        ready_cv_.wait_until(lock, first_arrival + max_wait, [&] {return queue_.size() >= max_reads || done_;});
+        for(const size_t n(std::min(queue_.size(), max_reads)); batch.size() < n; queue_.pop_front())
+            batch.push_back(queue_.front().first);
+        space_cv_.notify_all();
+        return batch.size();
+    }
+private:
+    void run() {
+        try {
+            char buf[1 << 16];
+            while(!stop_) {
+                // Polls rather than blocking in read, so that the destructor need not wait for more input.
+                pollfd pfd {fd_, POLLIN, 0};
+                const int ret(::poll(&pfd, 1, 100));
+                if(ret < 0 && errno != EINTR) RUNTIME_ERROR(std::string("poll failed: ") + std::strerror(errno));
+                if(ret <= 0) continue;
+                const ssize_t n(::read(fd_, buf, sizeof(buf)));
+                if(n < 0) {
+                    if(errno == EINTR || errno == EAGAIN) continue;
+                    RUNTIME_ERROR(std::string("Could not read input: ") + std::strerror(errno));
+                }
+                if(n == 0) break;
+                feed(buf, n);
+            }
+            if(!stop_) finish();
+        } catch(...) {
+            error_ = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        ready_cv_.notify_all();
+    }
+    void feed(const char *p, size_t n) {
+        if(!format_known_) {
+            // Two bytes tell gzip (1f 8b) from text.
+            head_.append(p, n);
+            if(head_.size() < 2) return;
+            format_known_ = true;
+            if(u8(head_[0]) == 0x1f && u8(head_[1]) == 0x8b) {
+                zs_.reset(new z_stream);
+                std::memset(zs_.get(), 0, sizeof(z_stream));
+                if(inflateInit2(zs_.get(), 15 + 16) != Z_OK) RUNTIME_ERROR("inflateInit2 failed.");
+            }
+            std::string head;
+            head.swap(head_);
+            feed(head.data(), head.size());
+            return;
+        }
+        if(zs_) inflate_text(p, n);
+        else    parse_text(p, n);
+    }
+    void inflate_text(const char *p, size_t n) {
+        char out[1 << 16];
+        z_stream &zs(*zs_);
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(p));
+        zs.avail_in = n;
+        // Output can remain after the input is used up if out fills.
+        do {
+            zs.next_out = reinterpret_cast<Bytef *>(out);
+            zs.avail_out = sizeof(out);
+            const int ret(inflate(&zs, Z_NO_FLUSH));
+            if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                RUNTIME_ERROR(std::string("Could not inflate input: ") + (zs.msg ? zs.msg: "corrupt data"));
+            parse_text(out, sizeof(out) - zs.avail_out);
+            if(ret == Z_STREAM_END) inflateReset(&zs); // Another gzip member may follow.
+            else if(ret == Z_BUF_ERROR) break;
+        } while(zs.avail_in || zs.avail_out == 0);
+    }
+    void parse_text(const char *p, size_t n) {
+        for(const char *e(p + n); p < e;) {
+            const char *eol(static_cast<const char *>(std::memchr(p, '\n', e - p)));
+            if(eol == nullptr) {
+                line_.append(p, e);
+                return;
+            }
+            line_.append(p, eol);
+            if(!line_.empty() && line_.back() == '\r') line_.pop_back();
+            parse_line();
+            line_.clear();
+            p = eol + 1;
+        }
+    }
+    void parse_line() {
+        switch(state_) {
+            case EXPECT_HEADER:
+                if(line_.empty()) return;
+                if(line_[0] != '>' && line_[0] != '@') RUNTIME_ERROR("Input is not FASTA or FASTQ: " + line_.substr(0, 64));
+                parse_header();
+                return;
+            case IN_SEQ:
+                if(type_ == '>' && !line_.empty() && line_[0] == '>') {
+                    emit();
+                    parse_header();
+                } else if(type_ == '@' && !line_.empty() && line_[0] == '+') {
+                    state_ = IN_QUAL;
+                    if(seq_.empty()) emit(); // No quality line follows an empty sequence.
+                } else seq_ += line_;
+                return;
+            case IN_QUAL:
+                qual_ += line_;
+                if(qual_.size() >= seq_.size()) emit();
+                return;
+        }
+    }
+    void parse_header() {
+        type_ = line_[0];
+        const size_t end(line_.find_first_of(" \t"));
+        name_.assign(line_, 1, end == std::string::npos ? std::string::npos: end - 1);
+        comment_.assign(end == std::string::npos ? "": line_.substr(end + 1));
+        seq_.clear(), qual_.clear();
+        state_ = IN_SEQ;
+    }
+    void finish() {
+        if(!head_.empty()) parse_text(head_.data(), head_.size()); // A single byte of input.
+        if(!line_.empty()) {
+            if(line_.back() == '\r') line_.pop_back();
+            parse_line();
+            line_.clear();
+        }
+        if(state_ == IN_SEQ && type_ == '>') emit();
+        else if(state_ != EXPECT_HEADER) RUNTIME_ERROR("Input ends within a FASTQ record for " + name_);
+    }
+    // Queues the record parsed, laid out as kseq2bseq1 does: one allocation holding name, comment, sequence and qualities.
+    void emit() {
+        bseq1_t rec;
+        std::memset(&rec, 0, sizeof(rec));
+        rec.name = static_cast<char *>(std::malloc(name_.size() + comment_.size() + 2 * seq_.size() + 5));
+        if(rec.name == nullptr) throw std::bad_alloc();
+        std::memcpy(rec.name, name_.data(), name_.size() + 1);
+        char *start(rec.name + name_.size() + 2);
+        if(!comment_.empty()) {
+            rec.comment = start;
+            std::memcpy(start, comment_.data(), comment_.size() + 1);
+            start += comment_.size() + 1;
+        }
+        rec.seq = start;
+        std::memcpy(start, seq_.data(), seq_.size() + 1);
+        start += seq_.size() + 1;
+        if(type_ == '@') rec.qual = start, std::memcpy(start, qual_.data(), seq_.size()), start[seq_.size()] = '\0';
+        rec.l_seq = seq_.size();
+        state_ = EXPECT_HEADER;
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_cv_.wait(lock, [this] {return queue_.size() < capacity_ || stop_;});
+        if(stop_) {
+            bseq_destroy(&rec);
+            return;
+        }
+        queue_.emplace_back(rec, clock::now());
+        ready_cv_.notify_all();
+    }
+};
+
+/*
+ * Classifies the reads at path (- for stdin) in batches from StreamReader, writing and flushing each batch's output
+ * before taking the next. Batches hold up to batch_reads reads and wait at most batch_ms after their first read.
+ * As process_dataset, it writes host reads to host_out if set, reads extracted by clade to extract_out,
+ * and adds per-taxon counts to c's in report-only mode.
+ */
+template<typename ScoreType>
+void process_stream(ClassifyPipeline<ScoreType> &pipeline, const ClassifierGeneric<ScoreType> &c, const TaxonomyIndex &tax,
+                    const char *path, std::FILE *out, unsigned batch_reads=STREAM_DEFAULT_BATCH_READS,
+                    unsigned batch_ms=STREAM_DEFAULT_BATCH_MS, std::FILE *host_out=nullptr,
+                    const std::vector<std::FILE *> &extract_out={}) {
+    if(extract_out.size() != c.extract_.size())
+        RUNTIME_ERROR(ks::sprintf("%zu outputs given for %zu clade extractions.", extract_out.size(), c.extract_.size()).data());
+    StreamReader reader(path, size_t(std::max(batch_reads, 1u)) * 4);
+    ForPool &pool(pipeline.pool_);
+    ClassifyArena<ScoreType> &arena(pipeline.arena_);
+    std::vector<bseq1_t> batch;
+    ks::string cks(256u), hks(256u);
+    std::vector<ks::string> eks(extract_out.size());
+    StreamReader::clock::time_point first_arrival;
+    u64 nbatches(0);
+    double max_latency(0.), total_latency(0.);
+    auto write = [](std::FILE *fp, const ks::string &str) {
+        if((str.size() && std::fwrite(str.data(), 1, str.size(), fp) != str.size()) || std::fflush(fp))
+            RUNTIME_ERROR(std::string("Could not write classification output: ") + std::strerror(errno));
+    };
+    arena.first_read_ = 0;
+    if(c.get_emit_binary()) {
+        cks.putsn_(CLS_BINARY_MAGIC, sizeof(CLS_BINARY_MAGIC));
+        write(out, cks);
+    }
+    try {
+        for(size_t n; (n = reader.next_batch(batch, std::max(batch_reads, 1u), std::chrono::milliseconds(batch_ms), first_arrival)) > 0;) {
+            cks.clear(), hks.clear();
+            for(auto &str: eks) str.clear();
+            classify_seqs(c, tax, batch.data(), cks, n, 0, pool, arena, host_out ? &hks: nullptr, nullptr, eks.data());
+            arena.first_read_ += n;
+            write(out, cks);
+            if(host_out) write(host_out, hks);
+            for(size_t i(0); i < eks.size(); ++i) write(extract_out[i], eks[i]);
+            const double latency(std::chrono::duration<double>(StreamReader::clock::now() - first_arrival).count());
+            max_latency = std::max(max_latency, latency), total_latency += latency, ++nbatches;
+        }
+    } catch(...) {
+        for(auto &rec: batch) bseq_destroy(&rec);
+        throw;
+    }
+    arena.merge_taxon_reads(c);
+    if(nbatches == 0) LOG_WARNING("Could not get any sequences from stream, fyi.\n");
+    else LOG_INFO("Classified %" PRIu64 " reads in %" PRIu64 " batches. Output followed the first read of a batch by "
+                  "%0.1lf ms on average and %0.1lf ms at most.\n", arena.first_read_, nbatches,
+                  1e3 * total_latency / nbatches, 1e3 * max_latency);
+}
+
+template<typename ScoreType>
+void process_stream(const ClassifierGeneric<ScoreType> &c, const TaxonomyIndex &tax, const char *path, std::FILE *out,
+                    unsigned batch_reads=STREAM_DEFAULT_BATCH_READS, unsigned batch_ms=STREAM_DEFAULT_BATCH_MS,
+                    std::FILE *host_out=nullptr, const std::vector<std::FILE *> &extract_out={}) {
+    ClassifyPipeline<ScoreType> pipeline(c);
+    process_stream(pipeline, c, tax, path, out, batch_reads, batch_ms, host_out, extract_out);
+}
+
+} // namespace bns
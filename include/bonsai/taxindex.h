@@ -0,0 +1,289 @@
+#pragma once
+#include <atomic>
+#include "util.h"
+
+namespace bns {
+
+/*
+ * Read-only taxonomy with taxids remapped to dense indices, for constant-time
+ * lowest common ancestor and depth queries.
+ *
+ * Nodes are numbered in depth-first preorder below a virtual root (index 0), so the subtree of node i
+ * is the index range [i, end_[i]) and ancestry is two comparisons. For two nodes a < b where a is not an
+ * ancestor of b, the LCA is the parent of the shallowest node in (a, b]: every node of minimum depth there
+ * is a child of the LCA. That range minimum is answered in O(1) with a sparse table over blocks of 32 nodes
+ * plus, for each node, a bitmask of the minima candidates preceding it in its block.
+ *
+ * Roots of the taxonomy (parent 0) and nodes whose parent is missing hang off the virtual root, which
+ * lca() reports as taxid 1, as the hash-based lca() does for nodes without a common ancestor.
+ * A taxid missing from the taxonomy has no LCA: lca() returns tax_t(-1) and warns about the first such taxid.
+ * Nodes on a parent cycle are attached to it as well, with a warning.
+ * node_depth() matches the hash-based version: a root has depth 1.
+ */
+class TaxonomyIndex {
+    static constexpr u32 BLOCK   = 32;
+public:
+    static constexpr u32 MISSING = u32(-1);
+private:
+    std::vector<tax_t> taxid_;  // Dense index -> taxid. taxid_[0] is the virtual root.
+    std::vector<u32>   parent_;
+    std::vector<u32>   depth_;
+    std::vector<u32>   end_;    // One past the last descendant.
+    std::vector<u32>   masks_;  // Bit j of masks_[i]: node (i / BLOCK) * BLOCK + j is the minimum of it through i.
+    std::vector<u32>   sparse_; // Level l, block b: shallowest node in blocks [b, b + 2^l).
+    u32                nblocks_;
+    std::vector<u32>   dense_;  // Taxid -> dense index, if taxids are small enough for a direct table.
+    khash_t(p)        *dense_map_;
+    mutable std::atomic<bool> warned_missing_;
+
+    INLINE u32 shallower(u32 a, u32 b) const {return depth_[b] < depth_[a] ? b: a;}
+    INLINE u32 block_min(u32 l, u32 r) const { // l and r in the same block.
+        return (l & ~(BLOCK - 1)) + __builtin_ctz(masks_[r] & (~0u << (l & (BLOCK - 1))));
+    }
+    // Shallowest node in [l, r].
+    INLINE u32 range_min(u32 l, u32 r) const {
+        const u32 bl(l / BLOCK), br(r / BLOCK);
+        if(bl == br) return block_min(l, r);
+        u32 ret(shallower(block_min(l, bl * BLOCK + BLOCK - 1), block_min(br * BLOCK, r)));
+        if(br - bl > 1) {
+            const u32 level(31 - __builtin_clz(br - bl - 1)), *row(sparse_.data() + size_t(level) * nblocks_);
+            ret = shallower(ret, shallower(row[bl + 1], row[br - (1u << level)]));
+        }
+        return ret;
+    }
+    void build(const khash_t(p) *map);
+public:
+    explicit TaxonomyIndex(const khash_t(p) *map): nblocks_(0), dense_map_(nullptr), warned_missing_(false) {build(map);}
+    TaxonomyIndex(const TaxonomyIndex &) = delete;
+    ~TaxonomyIndex() {if(dense_map_) kh_destroy(p, dense_map_);}
+
+    size_t size() const {return taxid_.size() - 1;}
+    // Dense index of taxid, or MISSING.
+    INLINE u32 index(tax_t taxid) const {
+        if(dense_map_ == nullptr) return taxid < dense_.size() ? dense_[taxid]: MISSING;
+        const khiter_t ki(kh_get(p, dense_map_, taxid));
+        return ki == kh_end(dense_map_) ? MISSING: kh_val(dense_map_, ki);
+    }
+    INLINE bool  contains(tax_t taxid)   const {return index(taxid) != MISSING;}
+    INLINE tax_t taxid(u32 index)        const {return index ? taxid_[index]: 1;}
+    INLINE u32   depth_of(u32 index)     const {return depth_[index];}
+    INLINE u32   parent_of(u32 index)    const {return parent_[index];}
+    // One past the last index in the subtree of index.
+    INLINE u32   subtree_end(u32 index)  const {return end_[index];}
+    // Whether a is b or one of its ancestors.
+    INLINE bool  is_ancestor_of(u32 a, u32 b) const {return a <= b && b < end_[a];}
+    INLINE u32   lca_index(u32 a, u32 b) const {
+        if(a > b) std::swap(a, b);
+        return is_ancestor_of(a, b) ? a: parent_[range_min(a + 1, b)];
+    }
+    // Same results as lca(const khash_t(p) *, tax_t, tax_t).
+    INLINE tax_t lca(tax_t a, tax_t b) const {
+        if(a == b || b == 0) return a;
+        if(a == 0) return b;
+        const u32 ia(index(a)), ib(index(b));
+        if(unlikely(ia == MISSING || ib == MISSING)) {
+            // Reached once per k-mer from database builds, so only the first is reported.
+            if(!warned_missing_.exchange(true, std::memory_order_relaxed))
+                LOG_WARNING("Taxid %u is not in the taxonomy, so its LCA is returned as tax_t(-1). "
+                            "Further missing taxids are not reported.\n", ia == MISSING ? a: b);
+            return (tax_t)-1;
+        }
+        return taxid(lca_index(ia, ib));
+    }
+    unsigned node_depth(tax_t taxid) const {
+        const u32 i(index(taxid));
+        if(unlikely(i == MISSING)) LOG_EXIT("Tax ID %u missing. Abort!\n", taxid);
+        return depth_[i];
+    }
+};
+
+inline void TaxonomyIndex::build(const khash_t(p) *map) {
+    // Collect nodes and map them to temporary indices 1..n in hash order.
+    std::vector<tax_t> ids(1, 0);
+    ids.reserve(kh_size(map) + 1);
+    tax_t maxid(0);
+    for(khiter_t ki(0); ki != kh_end(map); ++ki)
+        if(kh_exist(map, ki)) ids.push_back(kh_key(map, ki)), maxid = std::max(maxid, kh_key(map, ki));
+    const u32 n(ids.size());
+    khash_t(p) *tmp(kh_init(p));
+    kh_resize(p, tmp, n);
+    int khr;
+    khint_t ki;
+    for(u32 i(1); i < n; ++i) ki = kh_put(p, tmp, ids[i], &khr), kh_val(tmp, ki) = i;
+    // Children in CSR form. Missing, zero and self parents make a node a child of the virtual root.
+    std::vector<u32> par(n, 0), offsets(n + 1, 0), children(n > 0 ? n - 1: 0);
+    for(u32 i(1); i < n; ++i) {
+        const tax_t pid(kh_val(map, kh_get(p, map, ids[i])));
+        ki = pid && pid != ids[i] ? kh_get(p, tmp, pid): kh_end(tmp);
+        par[i] = ki == kh_end(tmp) ? 0: kh_val(tmp, ki);
+        ++offsets[par[i] + 1];
+    }
+    kh_destroy(p, tmp);
+    for(u32 i(0); i < n; ++i) offsets[i + 1] += offsets[i];
+    {
+        std::vector<u32> fill(offsets.begin(), offsets.end() - 1);
+        for(u32 i(1); i < n; ++i) children[fill[par[i]]++] = i;
+    }
+    // Iterative preorder traversal. Nodes on a cycle are never reached from the root; each such cycle is
+    // broken by attaching the first unvisited node on it to the virtual root.
+    taxid_.assign(n, 0), parent_.assign(n, 0), depth_.assign(n, 0), end_.assign(n, 0);
+    std::vector<u32> order(n, u32(MISSING)), stack, pos;
+    u32 next(0);
+    auto visit = [&](u32 start, u32 start_parent, u32 start_depth) {
+        order[start] = next;
+        taxid_[next] = ids[start], parent_[next] = start_parent, depth_[next] = start_depth;
+        ++next;
+        stack.assign(1, start), pos.assign(1, offsets[start]);
+        while(!stack.empty()) {
+            const u32 node(stack.back());
+            if(pos.back() == offsets[node + 1]) {
+                end_[order[node]] = next;
+                stack.pop_back(), pos.pop_back();
+                continue;
+            }
+            const u32 child(children[pos.back()++]);
+            if(order[child] != MISSING) continue;
+            order[child] = next;
+            taxid_[next] = ids[child], parent_[next] = order[node], depth_[next] = depth_[order[node]] + 1;
+            ++next;
+            stack.push_back(child), pos.push_back(offsets[child]);
+        }
+    };
+    visit(0, 0, 0);
+    if(next < n) {
+        LOG_WARNING("%u taxa are on parent cycles; attaching them to the root.\n", n - next);
+        for(u32 i(1); i < n; ++i) {
+            if(order[i] != MISSING) continue;
+            visit(i, 0, 1);
+            end_[0] = next;
+        }
+    }
+    // Taxid -> dense index.
+    if(maxid < (u64(n) << 3) + (1u << 20)) {
+        dense_.assign(u64(maxid) + 1, u32(MISSING));
+        for(u32 i(1); i < n; ++i) dense_[taxid_[i]] = i;
+    } else {
+        dense_map_ = kh_init(p);
+        kh_resize(p, dense_map_, n);
+        for(u32 i(1); i < n; ++i) ki = kh_put(p, dense_map_, taxid_[i], &khr), kh_val(dense_map_, ki) = i;
+    }
+    // Range minimum structures over depth_.
+    masks_.resize(n);
+    nblocks_ = (n + BLOCK - 1) / BLOCK;
+    for(u32 b(0); b < nblocks_; ++b) {
+        u32 mask(0);
+        for(u32 i(b * BLOCK), e(std::min(n, i + BLOCK)); i < e; ++i) {
+            while(mask && depth_[b * BLOCK + 31 - __builtin_clz(mask)] >= depth_[i])
+                mask ^= 1u << (31 - __builtin_clz(mask));
+            masks_[i] = mask |= 1u << (i - b * BLOCK);
+        }
+    }
+    const u32 nlevels(nblocks_ > 1 ? 32 - __builtin_clz(nblocks_ - 1): 1);
+    sparse_.resize(size_t(nlevels) * nblocks_);
+    for(u32 b(0); b < nblocks_; ++b) sparse_[b] = block_min(b * BLOCK, std::min(n, b * BLOCK + BLOCK) - 1);
+    for(u32 l(1); l < nlevels; ++l) {
+        const u32 *prev(sparse_.data() + size_t(l - 1) * nblocks_);
+        u32 *row(sparse_.data() + size_t(l) * nblocks_);
+        for(u32 b(0); b + (1u << l) <= nblocks_; ++b)
+            row[b] = shallower(prev[b], prev[b + (1u << (l - 1))]);
+    }
+    LOG_DEBUG("Indexed taxonomy with %u nodes (max taxid %u).\n", n - 1, maxid);
+}
+
+// Same result as resolve_tree(hit_counts, parent_map): the hit taxon with the most hits on its root path,
+// or the LCA of those tied. Ancestry between hit taxa is checked in O(1) rather than by walking each path.
+// Taxa missing from the taxonomy are ignored. dense is scratch space, passed in so that callers can reuse it.
+// Counter is a linear::counter or anything else with its keys() and vals().
+template<typename Counter>
+tax_t resolve_tree(const Counter &hit_counts, const TaxonomyIndex &tax, std::vector<u32> &dense) {
+    const auto &keys(hit_counts.keys());
+    const auto &vals(hit_counts.vals());
+    dense.resize(keys.size());
+    for(size_t i(0); i < keys.size(); ++i) dense[i] = tax.index(keys[i]);
+    u64 max_score(0);
+    u32 best(0);
+    for(size_t i(0); i < dense.size(); ++i) {
+        if(dense[i] == TaxonomyIndex::MISSING) continue;
+        u64 score(0);
+        for(size_t j(0); j < dense.size(); ++j)
+            if(tax.is_ancestor_of(dense[j], dense[i])) score += vals[j];
+        if(score > max_score)       max_score = score, best = dense[i];
+        else if(score == max_score) best = tax.lca_index(best, dense[i]);
+    }
+    return max_score ? tax.taxid(best): 0;
+}
+
+/*
+ * The taxa in the subtrees of a set of taxa, and optionally taxon 0 (unclassified), for picking out reads by clade.
+ * A bit per dense index is set up front from the subtrees' preorder ranges, so a test costs a lookup of the taxon's
+ * index and of a bit, however many clades were given. Taxa missing from the taxonomy are in no clade.
+ */
+class CladeSet {
+    std::vector<u64> bits_;
+    bool             unclassified_;
+public:
+    CladeSet(const TaxonomyIndex &tax, const std::vector<tax_t> &taxids, bool unclassified=false):
+        bits_((tax.size() + 1 + 63) / 64), unclassified_(unclassified)
+    {
+        for(const tax_t taxid: taxids) {
+            const u32 i(tax.index(taxid));
+            if(i == TaxonomyIndex::MISSING) RUNTIME_ERROR(ks::sprintf("Taxid %u is not in the taxonomy.", taxid).data());
+            for(u32 j(i), end(tax.subtree_end(i)); j < end; ++j) bits_[j >> 6] |= u64(1) << (j & 63);
+        }
+    }
+    INLINE bool contains(const TaxonomyIndex &tax, tax_t taxon) const {
+        if(taxon == 0) return unclassified_;
+        const u32 i(tax.index(taxon));
+        return i != TaxonomyIndex::MISSING && (bits_[i >> 6] >> (i & 63) & 1);
+    }
+};
+
+/*
+ * Writes a clade report in the format of kraken-report: for each taxon with reads in its subtree, the percentage
+ * of all reads in the subtree, the reads in it, the reads assigned to the taxon itself, a rank code, the taxid
+ * and the taxon's name indented by two spaces per level, children sorted by reads in their subtree.
+ * The taxonomy has no ranks or names, so the rank code is 'R' for the root and '-' otherwise, and taxa are named
+ * by their taxids; join with names.dmp for names.
+ * direct holds the reads assigned to each dense index. Those at the virtual root (index 0) are reported at taxid 1.
+ */
+inline void write_kraken_report(const TaxonomyIndex &tax, const std::vector<u64> &direct, u64 unclassified, std::FILE *fp) {
+    const u32 n(tax.size() + 1), root(tax.contains(1) ? tax.index(1): 0);
+    if(direct.size() != n) RUNTIME_ERROR("Read counts do not match the taxonomy.");
+    std::vector<u64> own(direct), clade;
+    if(root) own[root] += own[0], own[0] = 0;
+    // Parents precede their children in preorder.
+    clade = own;
+    for(u32 i(n - 1); i > 0; --i) clade[tax.parent_of(i)] += clade[i];
+    const u64 total(clade[0] + unclassified);
+    const double scale(total ? 100. / total: 0.);
+    std::fprintf(fp, "%6.2lf\t%" PRIu64 "\t%" PRIu64 "\tU\t0\tunclassified\n", unclassified * scale, unclassified, unclassified);
+    // Children with reads, in CSR form by parent.
+    std::vector<u32> offsets(n + 1, 0), children;
+    for(u32 i(1); i < n; ++i) offsets[tax.parent_of(i) + 1] += clade[i] != 0;
+    for(u32 i(0); i < n; ++i) offsets[i + 1] += offsets[i];
+    children.resize(offsets[n]);
+    {
+        std::vector<u32> fill(offsets.begin(), offsets.end() - 1);
+        for(u32 i(1); i < n; ++i) if(clade[i]) children[fill[tax.parent_of(i)]++] = i;
+    }
+    for(u32 i(0); i < n; ++i)
+        std::sort(children.begin() + offsets[i], children.begin() + offsets[i + 1], [&](u32 a, u32 b) {
+            return clade[a] != clade[b] ? clade[a] > clade[b]: tax.taxid(a) < tax.taxid(b);
+        });
+    // Depth-first, from the virtual root, which is only listed if it holds reads itself (if there is no taxid 1).
+    std::vector<std::pair<u32, u32>> stack; // Node and indentation level.
+    if(own[0]) stack.emplace_back(0, 0);
+    else for(u32 j(offsets[1]); j-- > offsets[0];) stack.emplace_back(children[j], 0);
+    while(!stack.empty()) {
+        const u32 i(stack.back().first), level(stack.back().second);
+        stack.pop_back();
+        const tax_t taxid(tax.taxid(i));
+        std::fprintf(fp, "%6.2lf\t%" PRIu64 "\t%" PRIu64 "\t%c\t%u\t%*s", clade[i] * scale, clade[i], own[i],
+                     taxid == 1 ? 'R': '-', taxid, int(2 * level), "");
+        if(taxid == 1) std::fputs("root\n", fp);
+        else           std::fprintf(fp, "%u\n", taxid);
+        for(u32 j(offsets[i + 1]); j-- > offsets[i];) stack.emplace_back(children[j], level + 1);
+    }
+}
+
+} // namespace bns
@@ -354,7 +354,7 @@ T *khash_load_impl(const int fn) noexcept {
     nb = rex->n_buckets * sizeof(*rex->keys);
     if(::read(fn, rex->keys, nb) != nb) exit(1);
     nb = rex->n_buckets * sizeof(*rex->vals);
-    if(::read(fn, rex->keys, nb) != nb) exit(1);
+    if(::read(fn, rex->vals, nb) != nb) exit(1);
     return rex;
 }
 
@@ -608,6 +608,24 @@ public:
 #  define BNS_REQUIRE(...) do {if(!(__VA_ARGS__)) RUNTIME_ERROR(#__VA_ARGS__);} while(0)
 #endif
 
+// Distinct values of map in ascending order after a leading 0, the taxon table of compact database layouts:
+// these store the index of a taxon in it, which needs far fewer bits than the taxon.
+inline std::vector<tax_t> dense_taxa(const khash_t(c) *map) {
+    std::vector<tax_t> ret(1, 0);
+    for(khiter_t ki(0); ki != kh_end(map); ++ki) {
+        if(!kh_exist(map, ki)) continue;
+        if(kh_val(map, ki) == 0) RUNTIME_ERROR("Taxon 0 cannot be stored in a compact table.");
+        ret.push_back(kh_val(map, ki));
+    }
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+// Index of taxon in a table from dense_taxa.
+inline u32 dense_index(const std::vector<tax_t> &taxa, tax_t taxon) {
+    return std::lower_bound(taxa.begin(), taxa.end(), taxon) - taxa.begin();
+}
+
 struct KSeqBufferHolder {
     std::vector<kseq_t> kseqs_;
     KSeqBufferHolder(size_t n) {
@@ -0,0 +1,77 @@
+#include "test/catch.hpp"
+#include "database.h"
+#include "classifier.h"
+using namespace bns;
+
+TEST_CASE("CompactHashTable finds stored keys and has the expected false-positive rate") {
+    khash_t(c) *th(kh_init(c));
+    std::mt19937_64 mt(13);
+    int khr;
+    for(size_t i(0); i < 100000; ++i) {
+        khint_t ki(kh_put(c, th, mt(), &khr));
+        kh_val(th, ki) = 1 + mt() % 1000;
+    }
+    for(const double fpr: {1e-3, 1e-6}) {
+        u64 nshadowed;
+        const CompactHashTable ch(CompactHashTable::from_khash(th, fpr, &nshadowed));
+        REQUIRE(ch.size() + nshadowed == kh_size(th));
+        REQUIRE(ch.value_bits() == 10);
+        const double load(double(ch.size()) / ch.nslots());
+        REQUIRE(load <= CompactHashTable::MAX_LOAD + 1e-6);
+        REQUIRE(CompactHashTable::expected_fpr(load, ch.value_bits()) <= fpr * 1.01);
+        size_t nwrong(0), ncounted(0);
+        for(khiter_t ki(0); ki != kh_end(th); ++ki) {
+            if(!kh_exist(th, ki)) continue;
+            const tax_t got(ch.get(kh_key(th, ki)));
+            REQUIRE(got != 0);
+            nwrong += got != kh_val(th, ki);
+        }
+        REQUIRE(nwrong <= nshadowed);
+        ch.for_each_taxon([&](tax_t) {++ncounted;});
+        REQUIRE(ncounted == ch.size());
+        size_t nfalse(0);
+        const size_t ntests(1000000);
+        for(size_t i(0); i < ntests; ++i) nfalse += ch.get(mt()) != 0;
+        // With 22-bit fingerprints, the maximum load allows ~1.2e-6; a handful of hits is within noise.
+        REQUIRE(double(nfalse) / ntests <= 2. * CompactHashTable::expected_fpr(load, ch.value_bits()) + 1e-5);
+    }
+    kh_destroy(c, th);
+}
+
+TEST_CASE("Compact databases are written, mapped and queried without the hash table") {
+    khash_t(c) *th(kh_init(c));
+    std::mt19937_64 mt(17);
+    int khr;
+    for(size_t i(0); i < 50000; ++i) {
+        khint_t ki(kh_put(c, th, mt(), &khr));
+        kh_val(th, ki) = 1 + mt() % 100;
+    }
+    Spacer sp(31, 31, nullptr);
+    {
+        Database<khash_t(c)> db(sp, 0, th);
+        db.write_mmap("__zomg__.mmdb", false, 10., 1e-4);
+    }
+    {
+        Database<khash_t(c)> db("__zomg__.mmdb");
+        REQUIRE(db.db_ == nullptr);
+        REQUIRE(!db.cht_.empty());
+        REQUIRE(!db.bf_.empty());
+        const CompactHashTable ch(CompactHashTable::from_khash(th, 1e-4));
+        REQUIRE(db.cht_.nbytes() == ch.nbytes());
+        REQUIRE(std::memcmp(db.cht_.data(), ch.data(), ch.nbytes()) == 0);
+        ClassifierGeneric<score::Lex> c(db.db_, db.s_, db.k_, db.w_, 1);
+        c.set_table(&db.cht_);
+        c.set_filter(&db.bf_);
+        std::vector<u64> keys;
+        for(khiter_t ki(0); ki != kh_end(th); ++ki) if(kh_exist(th, ki)) keys.push_back(kh_key(th, ki));
+        for(size_t i(0); i < 50000; ++i) keys.push_back(mt());
+        std::vector<tax_t> batched;
+        c.lookup_batch(keys.data(), 0, keys.size(), keys.size(), [&](tax_t tax) {batched.push_back(tax);});
+        for(size_t i(0); i < keys.size(); ++i) {
+            REQUIRE(batched[i] == c.lookup(keys[i]));
+            if(i < kh_size(th)) REQUIRE(batched[i] != 0);
+        }
+    }
+    REQUIRE(system("rm __zomg__.mmdb") == 0);
+    kh_destroy(c, th);
+}
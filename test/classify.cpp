@@ -0,0 +1,458 @@
+#include "test/catch.hpp"
+#include "classifier.h"
+#include "test/fixtures.h"
+using namespace bns;
+using namespace fixtures;
+
+TEST_CASE("classify_seqs output does not depend on task division or buffer reuse") {
+    const std::string genome(load_phix());
+
+    // Label the first half of phiX with taxon 10, the second with 11, both children of 1.
+    khash_t(c) *db(phix_db(genome, {10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+
+    std::mt19937_64 mt(5);
+    const unsigned nreads(1000);
+    Reads seqs(make_reads(phix_reads(genome, nreads, mt)));
+    const TaxonomyIndex tax(taxmap);
+    Classifier c(db, spvec_t(30), 31, 31, 3, true, false, true);
+    ForPool pool(c.nt_);
+    ks::string expected(256u);
+    classify_seqs(c, tax, seqs.data(), expected, nreads, 0, pool);
+    REQUIRE(std::count(expected.begin(), expected.end(), '\n') == nreads);
+    ClassifyArena<score::Lex> arena(c);
+    for(const unsigned nthreads: {1u, 3u, 64u, 3u}) {
+        ks::string out(256u);
+        arena.plan(seqs.data(), nreads, 0, nthreads, 1);
+        REQUIRE(arena.ntasks() >= std::min(nthreads * CLASSIFY_TASKS_PER_THREAD, nreads) / 2);
+        REQUIRE(arena.starts_.front() == 0);
+        REQUIRE(arena.starts_.back() == nreads);
+        for(unsigned i(1); i < arena.ntasks(); ++i)
+            REQUIRE(arena.bases_[arena.order_[i - 1]] >= arena.bases_[arena.order_[i]]);
+        classify_tasks(c, tax, seqs.data(), out, 0, pool, arena);
+        REQUIRE(out == expected);
+    }
+    // With the default minimum task size, a small chunk (here about 100 kb, as a stream batch) still has a task per thread.
+    arena.plan(seqs.data(), nreads, 0, 16);
+    REQUIRE(arena.ntasks() >= 16);
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
+
+TEST_CASE("Long-read mode counts past 65535 hits, summarizes hits and classifies windows") {
+    const std::string genome(load_phix());
+
+    khash_t(c) *db(phix_db(genome, {10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+    const TaxonomyIndex tax(taxmap);
+
+    // 40 copies of the first 2000 bases, then 3000 bases from the second half.
+    const std::string first(genome.substr(0, 2000)), second(genome.substr(genome.size() - 3000));
+    std::string seq;
+    for(int i(0); i < 40; ++i) seq += first;
+    seq += second;
+    std::string name("chimera");
+    bseq1_t bs;
+    std::memset(&bs, 0, sizeof(bs));
+    bs.name = &name[0], bs.seq = &seq[0], bs.l_seq = seq.size();
+
+    Classifier c(db, spvec_t(30), 31, 31, 1, true, false, true);
+    ClassifyWorker<score::Lex> w(c.enc_);
+    ks::string out(256u);
+    c.set_summarize_hits(true);
+    c.set_window(2000);
+    classify_seq(c, w, tax, &bs, 0, out);
+    REQUIRE(w.hit_counts_.count(10) > 65535);
+    const std::string line(out.data(), out.size());
+    REQUIRE(line.find("C\tchimera\t10\t") == 0);
+    // The last windows fall in the second half of the genome.
+    const size_t wbeg(line.find("\tW:") + 3), wend(line.find('\t', wbeg));
+    const std::string windows(line.substr(wbeg, wend - wbeg));
+    REQUIRE(windows.find("10,10,") == 0);
+    REQUIRE(windows.substr(windows.size() - 3) == ",11");
+    const std::string summary(line.substr(wend + 1));
+    REQUIRE(summary == "10:" + std::to_string(w.hit_counts_.count(10)) + "\t11:" + std::to_string(w.hit_counts_.count(11)) + "\n");
+
+    // Without the summary, every run of hits is listed.
+    c.set_summarize_hits(false);
+    c.set_window(0);
+    out.clear();
+    classify_seq(c, w, tax, &bs, 0, out);
+    REQUIRE(std::string(out.data(), out.size()).find("\tW:") == std::string::npos);
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
+
+TEST_CASE("Windowed databases are queried with window minimizers only") {
+    const std::string genome(load_phix());
+
+    // As lca_map stores them: the minimizers of windows of 50 bases, labeled by the half of phiX they start in.
+    khash_t(c) *db(phix_db(genome, {10, 11}, 50));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+    const TaxonomyIndex tax(taxmap);
+
+    Classifier windowed(db, spvec_t(30), 31, 50, 1, true, false, true), every(db, spvec_t(30), 31, 31, 1, true, false, true);
+    ClassifyWorker<score::Lex> ww(windowed.enc_), we(every.enc_);
+    std::mt19937_64 mt(11);
+    size_t nlookups_windowed(0), nlookups_every(0);
+    for(unsigned i(0); i < 500; ++i) {
+        const size_t len(100 + mt() % 150), start(mt() % (genome.size() / 2 - len));
+        std::string seq(genome.substr(i & 1 ? start + genome.size() / 2: start, len)), name("read");
+        bseq1_t bs;
+        std::memset(&bs, 0, sizeof(bs));
+        bs.name = &name[0], bs.seq = &seq[0], bs.l_seq = seq.size();
+        ks::string out1(256u), out2(256u);
+        classify_seq(windowed, ww, tax, &bs, 0, out1);
+        classify_seq(every, we, tax, &bs, 0, out2);
+        nlookups_windowed += ww.kmers_.size(), nlookups_every += we.kmers_.size();
+        // Every minimizer in the database found through windows is also found by looking up every k-mer.
+        for(size_t j(0); j < ww.hit_counts_.size(); ++j) REQUIRE(we.hit_counts_.count(ww.hit_counts_.keys()[j]));
+        // Each window's minimizer counts once per window, and no window is reported as ambiguous.
+        size_t nwindows(0);
+        for(const u32 run: ww.runs_) nwindows += run;
+        REQUIRE(nwindows == seq.size() - 50 + 1);
+        REQUIRE(std::string(out1.data(), out1.size()).find("\tA:") == std::string::npos);
+        const tax_t expected(i & 1 ? 11: 10);
+        if(std::string(out2.data(), out2.size()).find("C\tread\t" + std::to_string(expected)) == 0)
+            REQUIRE(std::string(out1.data(), out1.size()).find("C\tread\t" + std::to_string(expected)) == 0);
+    }
+    REQUIRE(nlookups_windowed * 5 < nlookups_every);
+
+    // -W windows hold a fixed number of minimizer windows however runs fall, so a chimera of 1000 bases from each
+    // half changes taxon in the window holding the junction.
+    std::string seq(genome.substr(200, 1000) + genome.substr(genome.size() - 1200, 1000)), name("chimera");
+    bseq1_t bs;
+    std::memset(&bs, 0, sizeof(bs));
+    bs.name = &name[0], bs.seq = &seq[0], bs.l_seq = seq.size();
+    windowed.set_window(100);
+    ks::string out(256u);
+    classify_seq(windowed, ww, tax, &bs, 0, out);
+    REQUIRE(ww.windows_.size() == (seq.size() - 50 + 1 + 99) / 100);
+    for(unsigned i(0); i < ww.windows_.size(); ++i) {
+        // Window i covers minimizer windows starting at bases [100i, 100i + 100), which end 49 bases later.
+        if(100 * i + 99 + 49 < 1000) REQUIRE(ww.windows_[i] == 10);
+        if(100 * i >= 1000)          REQUIRE(ww.windows_[i] == 11);
+    }
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
+
+TEST_CASE("Entropy-minimized databases are queried with entropy minimizers") {
+    const std::string genome(load_phix());
+
+    khash_t(c) *db(phix_db<score::Entropy>(genome, {10}, 50));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}}));
+    const TaxonomyIndex tax(taxmap);
+
+    std::mt19937_64 mt(13);
+    const unsigned nreads(200);
+    std::vector<std::string> sequences;
+    for(unsigned i(0); i < nreads; ++i) sequences.push_back(phix_read(genome, mt, 150, 151));
+    Reads seqs(make_reads(std::move(sequences)));
+    ClassifierGeneric<score::Entropy> entropy(db, spvec_t(30), 31, 50, 2, false, false, true);
+    Classifier lex(db, spvec_t(30), 31, 50, 2, false, false, true);
+    ForPool pool(2);
+    ks::string out_entropy(256u), out_lex(256u);
+    classify_seqs(entropy, tax, seqs.data(), out_entropy, nreads, 0, pool);
+    classify_seqs(lex, tax, seqs.data(), out_lex, nreads, 0, pool);
+    // Each worker's copy of the encoder keeps its own entropy window, so the result does not depend on threading.
+    ClassifierGeneric<score::Entropy> serial(db, spvec_t(30), 31, 50, 1, false, false, true);
+    ForPool pool1(1);
+    ks::string out_serial(256u);
+    classify_seqs(serial, tax, seqs.data(), out_serial, nreads, 0, pool1);
+    REQUIRE(out_serial == out_entropy);
+    // Reads from the strand the database was built from choose the same minimizers; lex minimizers mostly miss.
+    const auto nclassified([](const ks::string &s) {return std::count(s.begin(), s.end(), '\n');});
+    REQUIRE(nclassified(out_entropy) == nreads);
+    REQUIRE(nclassified(out_lex) < nreads / 2);
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
+
+TEST_CASE("The lookup cache changes no output and counts its hits") {
+    LookupCache empty(8);
+    tax_t tax;
+    for(u64 key(0); key < 1000; ++key) REQUIRE(!empty.get(key, tax));
+    REQUIRE(!empty.get(u64(-1), tax));
+
+    const std::string genome(load_phix());
+
+    khash_t(c) *db(phix_db(genome, {10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+    const TaxonomyIndex tax_index(taxmap);
+
+    // Each read appears five times, as in amplicon data; a few are random and mostly miss.
+    std::mt19937_64 mt(29);
+    const unsigned ndistinct(200), nreads(5 * ndistinct);
+    const std::vector<std::string> distinct(phix_reads(genome, ndistinct, mt));
+    std::vector<std::string> sequences;
+    for(unsigned i(0); i < nreads; ++i) sequences.push_back(distinct[mt() % ndistinct]);
+    Reads seqs(make_reads(std::move(sequences)));
+    for(const u32 window: {0u, 20u}) {
+        Classifier plain(db, spvec_t(30), 31, 31, 2, true, false, true), cached(db, spvec_t(30), 31, 31, 2, true, false, true);
+        plain.set_window(window), cached.set_window(window);
+        cached.set_cache_bits(14);
+        ForPool pool(2);
+        ks::string expected(256u), out(256u);
+        classify_seqs(plain, tax_index, seqs.data(), expected, nreads, 0, pool);
+        classify_seqs(cached, tax_index, seqs.data(), out, nreads, 0, pool);
+        REQUIRE(out == expected);
+        REQUIRE(plain.n_cache_lookups() == 0);
+        REQUIRE(cached.n_cache_lookups() > 0);
+        // Only the first occurrence of each read in each thread's cache misses, barring collisions.
+        REQUIRE(cached.n_cache_hits() > cached.n_cache_lookups() / 2);
+    }
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
+
+TEST_CASE("Report-only mode counts reads per taxon and writes a clade report") {
+    const std::string genome(load_phix());
+
+    // Thirds of phiX labeled 12, 10 and 11, with 12 a child of 10.
+    khash_t(c) *db(phix_db(genome, {12, 10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}, {12, 10}}));
+    const TaxonomyIndex tax(taxmap);
+
+    std::mt19937_64 mt(31);
+    const unsigned nreads(1000);
+    Reads seqs(make_reads(phix_reads(genome, nreads, mt)));
+    Classifier records(db, spvec_t(30), 31, 31, 2, true, false, true), counts(db, spvec_t(30), 31, 31, 2, true, false, true);
+    counts.set_report_only(true);
+    ForPool pool(2);
+    ks::string expected(256u), out(256u);
+    classify_seqs(records, tax, seqs.data(), expected, nreads, 0, pool);
+    classify_seqs(counts, tax, seqs.data(), out, nreads, 0, pool);
+    REQUIRE(out.size() == 0);
+    REQUIRE(counts.n_classified() == records.n_classified());
+    REQUIRE(counts.n_unclassified() == records.n_unclassified());
+    // Reads assigned to each taxon, from the third column of the per-read output.
+    std::map<tax_t, u64> direct;
+    for(const char *p(expected.data()), *e(p + expected.size()); p < e; p = std::find(p, e, '\n') + 1)
+        ++direct[std::strtoul(std::strchr(std::strchr(p, '\t') + 1, '\t') + 1, nullptr, 10)];
+
+    std::FILE *rfp(std::tmpfile());
+    counts.write_report(tax, rfp);
+    std::rewind(rfp);
+    char line[256];
+    std::vector<std::string> order;
+    std::map<std::string, std::pair<u64, u64>> rows; // Name -> clade and direct reads.
+    while(std::fgets(line, sizeof(line), rfp)) {
+        double pct;
+        unsigned long long clade, own;
+        char rank;
+        unsigned taxid;
+        char name[64];
+        int indent;
+        REQUIRE(std::sscanf(line, "%lf\t%llu\t%llu\t%c\t%u%n", &pct, &clade, &own, &rank, &taxid, &indent) == 5);
+        REQUIRE(line[indent++] == '\t');
+        REQUIRE(std::sscanf(line + indent, "%63s", name) == 1);
+        REQUIRE(std::abs(pct - 100. * clade / nreads) < 0.01);
+        order.push_back(std::string(line + indent, std::strlen(line + indent) - 1));
+        rows[name] = std::make_pair(clade, own);
+    }
+    std::fclose(rfp);
+    REQUIRE(rows.at("unclassified").first == direct[0]);
+    REQUIRE(rows.at("root").first == nreads - direct[0]);
+    REQUIRE(rows.at("10").first == direct[10] + direct[12]);
+    REQUIRE(rows.at("10").second == direct[10]);
+    REQUIRE(rows.at("12").second == direct[12]);
+    REQUIRE(rows.at("11").second == direct[11]);
+    // Children follow their parents, indented one more level.
+    const auto at(std::find(order.begin(), order.end(), "  10"));
+    REQUIRE(at != order.end());
+    REQUIRE(std::find(at, order.end(), "    12") != order.end());
+    REQUIRE(order[1] == "root");
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
+
+TEST_CASE("Binary records decode to the text classify writes") {
+    const std::string genome(load_phix());
+
+    khash_t(c) *db(phix_db(genome, {10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+    const TaxonomyIndex tax(taxmap);
+
+    // Random reads are unclassified, and Ns make ambiguous runs.
+    std::mt19937_64 mt(37);
+    const unsigned nreads(1000);
+    std::vector<std::string> sequences(phix_reads(genome, nreads, mt));
+    for(unsigned i(0); i < nreads; i += 5) sequences[i][mt() % sequences[i].size()] = 'N';
+    Reads seqs(make_reads(std::move(sequences)));
+    for(const bool emit_all: {true, false}) {
+        Classifier text(db, spvec_t(30), 31, 31, 2, emit_all, false, true), binary(db, spvec_t(30), 31, 31, 2, emit_all, false, true);
+        binary.set_emit_binary(true);
+        ForPool pool(2);
+        ks::string expected(256u), out(256u), decoded(256u);
+        classify_seqs(text, tax, seqs.data(), expected, nreads, 0, pool);
+        classify_seqs(binary, tax, seqs.data(), out, nreads, 0, pool);
+        cls_record_t rec;
+        std::vector<std::pair<tax_t, u32>> runs;
+        u64 last(0), nrecords(0);
+        for(const char *p(out.data()), *e(p + out.size()); read_binary_record(p, e, rec, runs); ++nrecords) {
+            REQUIRE((nrecords == 0 || rec.read_ > last));
+            last = rec.read_;
+            append_kraken_text(rec, runs, seqs[rec.read_].name, decoded);
+        }
+        REQUIRE(nrecords == size_t(std::count(expected.begin(), expected.end(), '\n')));
+        REQUIRE(std::string(decoded.data(), decoded.size()) == std::string(expected.data(), expected.size()));
+    }
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
+
+TEST_CASE("Samples classified through one pipeline match samples classified separately") {
+    const std::string genome(load_phix());
+
+    khash_t(c) *db(phix_db(genome, {10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+    const TaxonomyIndex tax(taxmap);
+
+    // Samples of different sizes, so that the second reuses chunk buffers larger than it needs.
+    std::mt19937_64 mt(41);
+    const unsigned nreads[] {2000, 300};
+    TempFile files[2];
+    for(unsigned s(0); s < 2; ++s) write_fasta(files[s].path(), phix_reads(genome, nreads[s], mt), s ? "s1read": "s0read");
+    std::string separate[2];
+    u64 nclassified[2];
+    for(unsigned s(0); s < 2; ++s) {
+        Classifier c(db, spvec_t(30), 31, 31, 2, true, false, true);
+        separate[s] = classify_file(c, tax, files[s].path());
+        nclassified[s] = c.n_classified();
+    }
+    Classifier c(db, spvec_t(30), 31, 31, 2, true, false, true);
+    ClassifyPipeline<score::Lex> pipeline(c);
+    for(unsigned s(0); s < 2; ++s) {
+        c.reset_counts();
+        std::FILE *ofp(std::tmpfile());
+        process_dataset(pipeline, c, tax, files[s].path(), nullptr, ofp, 4096);
+        REQUIRE(slurp(ofp) == separate[s]);
+        REQUIRE(c.n_classified() == nclassified[s]);
+        REQUIRE(c.n_classified() + c.n_unclassified() == nreads[s]);
+    }
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
+
+TEST_CASE("Databases classified in one pass match databases classified separately") {
+    const std::string genome(load_phix());
+
+    // Every k-mer of phiX, canonical or not, labeled by the half it starts in, and by the third,
+    // with a taxonomy for each labeling.
+    khash_t(c) *halves(phix_db(genome, {10, 11})), *thirds(phix_db(genome, {20, 21, 22}));
+    phix_db(genome, {10, 11}, 31, false, halves);
+    phix_db(genome, {20, 21, 22}, 31, false, thirds);
+    khash_t(p) *taxmap1(make_taxmap({{1, 0}, {10, 1}, {11, 1}})), *taxmap2(make_taxmap({{1, 0}, {20, 1}, {21, 1}, {22, 1}}));
+    const TaxonomyIndex tax1(taxmap1), tax2(taxmap2);
+
+    // Pairs with the odd ambiguous base, so that windows restart within reads and at the second read.
+    std::mt19937_64 mt(53);
+    TempFile files[2];
+    for(unsigned r(0); r < 2; ++r) {
+        std::vector<std::string> seqs;
+        for(unsigned i(0); i < 1000; ++i) {
+            seqs.push_back(phix_read(genome, mt, 40, 200));
+            if(i % 5 == 0) seqs.back()[mt() % seqs.back().size()] = 'N';
+            if(i % 9 == 0) randomize(seqs.back(), mt);
+        }
+        write_fasta(files[r].path(), seqs, "read", r ? "/2": "/1");
+    }
+    const char *paths[] {files[0].path(), files[1].path()};
+
+    // Canonical k-mers are encoded in one pass for all three; the others by each database's encoder.
+    for(const bool canon: {true, false}) {
+        for(const bool paired: {false, true}) {
+            std::string separate[3];
+            {
+                Classifier c(halves, spvec_t(30), 31, 31, 2, true, false, true, canon);
+                separate[0] = classify_file(c, tax1, paths[0], paired ? paths[1]: nullptr);
+            }
+            {
+                Classifier c(thirds, spvec_t(30), 31, 50, 2, true, false, true, canon);
+                separate[1] = classify_file(c, tax2, paths[0], paired ? paths[1]: nullptr);
+            }
+            {
+                Classifier c(halves, spvec_t(30), 31, 40, 2, false, false, true, canon);
+                c.set_cache_bits(10);
+                separate[2] = classify_file(c, tax1, paths[0], paired ? paths[1]: nullptr);
+            }
+            Classifier c(halves, spvec_t(30), 31, 31, 2, true, false, true, canon),
+                       d1(thirds, spvec_t(30), 31, 50, 2, true, false, true, canon),
+                       d2(halves, spvec_t(30), 31, 40, 2, false, false, true, canon);
+            d2.set_cache_bits(10);
+            REQUIRE(c.enc_.shares_positions() == canon);
+            c.add_database(d1, tax2);
+            c.add_database(d2, tax1);
+            std::vector<std::FILE *> douts {std::tmpfile(), std::tmpfile()};
+            std::FILE *ofp(std::tmpfile());
+            process_dataset(c, tax1, paths[0], paired ? paths[1]: nullptr, ofp, 4096, 1, nullptr, douts);
+            REQUIRE(slurp(ofp) == separate[0]);
+            REQUIRE(slurp(douts[0]) == separate[1]);
+            REQUIRE(slurp(douts[1]) == separate[2]);
+            REQUIRE(d1.n_classified() + d1.n_unclassified() == 1000u);
+            REQUIRE(d2.n_cache_lookups() > 0);
+        }
+    }
+    Classifier c(halves, spvec_t(30), 31, 31, 1), other(halves, spvec_t(26), 27, 27, 1);
+    REQUIRE_THROWS(c.add_database(other, tax1));
+    kh_destroy(p, taxmap1);
+    kh_destroy(p, taxmap2);
+    kh_destroy(c, halves);
+    kh_destroy(c, thirds);
+}
+
+TEST_CASE("Reads are extracted by clade as they are classified") {
+    const std::string genome(load_phix());
+
+    // phiX's halves as taxa 10 and 11, under 5, beside 6; 1 is the root.
+    khash_t(c) *db(phix_db(genome, {10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {5, 1}, {6, 1}, {10, 5}, {11, 5}}));
+    const TaxonomyIndex tax(taxmap);
+
+    std::mt19937_64 mt(61);
+    TempFile files[2];
+    std::vector<std::string> records[2];
+    for(unsigned r(0); r < 2; ++r) {
+        std::FILE *ofp(std::fopen(files[r].path(), "w"));
+        REQUIRE(ofp);
+        for(unsigned i(0); i < 600; ++i) {
+            std::string seq(phix_read(genome, mt, 60, 160));
+            if(i % 4 == 0) randomize(seq, mt);
+            records[r].push_back(ks::sprintf("@read%u\n%s\n+\n%s\n", i, seq.data(), std::string(seq.size(), 'I').data()).data());
+            std::fputs(records[r].back().data(), ofp);
+        }
+        std::fclose(ofp);
+    }
+    const char *paths[] {files[0].path(), files[1].path()};
+
+    for(const bool paired: {false, true}) {
+        Classifier c(db, spvec_t(30), 31, 31, 2, true, false, true);
+        c.add_extraction(CladeSet(tax, {10}));
+        c.add_extraction(CladeSet(tax, {5}, true));
+        c.add_extraction(CladeSet(tax, {6}));
+        std::vector<std::FILE *> eouts {std::tmpfile(), std::tmpfile(), std::tmpfile()};
+        std::FILE *ofp(std::tmpfile());
+        process_dataset(c, tax, paths[0], paired ? paths[1]: nullptr, ofp, 4096, 1, nullptr, {}, eouts);
+        // The records expected in each, from the taxa in the classification output.
+        std::string expected[3];
+        std::istringstream is(slurp(ofp));
+        unsigned i(0), counts[2] {0, 0};
+        for(std::string line; std::getline(is, line); ++i) {
+            std::istringstream fields(line);
+            std::string status, name;
+            tax_t taxon;
+            REQUIRE(fields >> status >> name >> taxon);
+            const std::string rec(records[0][i] + (paired ? records[1][i]: ""));
+            if(taxon == 10) expected[0] += rec;
+            if(taxon == 0 || taxon == 5 || taxon == 10 || taxon == 11) expected[1] += rec;
+            ++counts[taxon == 10];
+        }
+        REQUIRE(i == 600);
+        REQUIRE(counts[0] > 100);
+        REQUIRE(counts[1] > 100);
+        for(unsigned j(0); j < 3; ++j) REQUIRE(slurp(eouts[j]) == expected[j]);
+    }
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
@@ -0,0 +1,104 @@
+#include "test/catch.hpp"
+#include "classifier.h"
+#include "database.h"
+using namespace bns;
+
+TEST_CASE("CacheLineTable matches khash") {
+    khash_t(c) *th(kh_init(c));
+    std::mt19937_64 mt(13);
+    int khr;
+    for(size_t i(0); i < 100000; ++i) {
+        khint_t ki(kh_put(c, th, mt(), &khr));
+        kh_val(th, ki) = (i % 1000) + 1;
+    }
+    for(const double load: {0.5, 0.85, 0.95}) {
+        CacheLineTable ct(CacheLineTable::from_khash(th, load));
+        REQUIRE(ct.size() == kh_size(th));
+        for(khiter_t ki(0); ki != kh_end(th); ++ki)
+            if(kh_exist(th, ki))
+                REQUIRE(ct.get(kh_key(th, ki)) == kh_val(th, ki));
+        for(size_t i(0); i < 100000; ++i) {
+            const u64 key(mt());
+            khiter_t ki(kh_get(c, th, key));
+            REQUIRE(ct.get(key) == (ki == kh_end(th) ? 0: kh_val(th, ki)));
+        }
+    }
+    Spacer sp(31, 31, nullptr);
+    {
+        Database<khash_t(c)> db(sp, 0, th);
+        db.write_mmap("__zomg__.mmdb", true);
+    }
+    {
+        Database<khash_t(c)> db("__zomg__.mmdb");
+        REQUIRE(db.ct_.size() == kh_size(th));
+        REQUIRE(db.ct_.value_bits() == 16);
+        for(khiter_t ki(0); ki != kh_end(th); ++ki)
+            if(kh_exist(th, ki))
+                REQUIRE(db.ct_.get(kh_key(th, ki)) == kh_val(th, ki));
+    }
+    REQUIRE(system("rm __zomg__.mmdb") == 0);
+    kh_destroy(c, th);
+}
+
+TEST_CASE("CacheLineTable stores 16-bit taxon indices unless there are too many taxa") {
+    khash_t(c) *th(kh_init(c));
+    std::mt19937_64 mt(7);
+    int khr;
+    for(size_t i(0); i < 200000; ++i) {
+        khint_t ki(kh_put(c, th, mt(), &khr));
+        kh_val(th, ki) = (i % 70000) * 3 + 1;
+    }
+    CacheLineTable wide(CacheLineTable::from_khash(th));
+    REQUIRE(wide.value_bits() == 32);
+    REQUIRE(wide.taxa() == nullptr);
+    for(khiter_t ki(0); ki != kh_end(th); ++ki)
+        if(kh_exist(th, ki) && kh_val(th, ki) > 60000 * 3) kh_val(th, ki) = 1;
+    CacheLineTable narrow(CacheLineTable::from_khash(th)), forced(CacheLineTable::from_khash(th, 0.7, false));
+    REQUIRE(narrow.value_bits() == 16);
+    REQUIRE(narrow.ntaxa() == 60001);
+    REQUIRE(forced.value_bits() == 32);
+    REQUIRE(narrow.nbuckets() < forced.nbuckets() * 0.85);
+    for(khiter_t ki(0); ki != kh_end(th); ++ki) {
+        if(!kh_exist(th, ki)) continue;
+        REQUIRE(narrow.get(kh_key(th, ki)) == kh_val(th, ki));
+        REQUIRE(forced.get(kh_key(th, ki)) == kh_val(th, ki));
+    }
+    for(size_t i(0); i < 100000; ++i) {
+        const u64 key(mt());
+        REQUIRE(narrow.get(key) == (kh_get(c, th, key) == kh_end(th) ? 0: kh_val(th, kh_get(c, th, key))));
+    }
+    kh_destroy(c, th);
+}
+
+TEST_CASE("Batched lookups preserve order across ranges") {
+    khash_t(c) *th(kh_init(c));
+    std::mt19937_64 mt(1337);
+    std::vector<u64> kmers;
+    int khr;
+    for(size_t i(0); i < 1000; ++i) {
+        const u64 key(mt());
+        if(i & 1) {
+            khint_t ki(kh_put(c, th, key, &khr));
+            kh_val(th, ki) = i;
+        }
+        kmers.push_back(key);
+    }
+    CacheLineTable ct(CacheLineTable::from_khash(th));
+    BlockedBloomFilter bf(BlockedBloomFilter::from_khash(th, 10.));
+    ClassifierGeneric<score::Lex> classifier(th, spvec_t(30), 31, 31, 1);
+    for(int mode(0); mode < 6; ++mode) {
+        if(mode == 1) classifier.set_prefetch_khash(true);
+        if(mode == 2) classifier.set_table(&ct);
+        if(mode == 3) classifier.set_filter(&bf);
+        if(mode == 4) classifier.set_table(nullptr);
+        if(mode == 5) classifier.set_prefetch_khash(false);
+        std::vector<tax_t> taxa;
+        auto push = [&taxa](tax_t tax) {taxa.push_back(tax);};
+        classifier.lookup_batch(kmers.data(), 0, 333, kmers.size(), push);
+        classifier.lookup_batch(kmers.data(), 333, kmers.size(), kmers.size(), push);
+        REQUIRE(taxa.size() == kmers.size());
+        for(size_t i(0); i < kmers.size(); ++i)
+            REQUIRE(taxa[i] == ((i & 1) ? i: 0));
+    }
+    kh_destroy(c, th);
+}
@@ -199,3 +199,34 @@ TEST_CASE("entmin") {
     }
     LOG_INFO("kmers2 size: %zu\n", kmers2.size());
 }
+TEST_CASE("MinQueue selects the same window minima as QueueMap") {
+    std::mt19937_64 mt(13);
+    for(const size_t wsz: {1u, 2u, 7u, 20u, 64u}) {
+        QueueMap<u64, u64> qm(wsz);
+        MinQueue<u64, u64> mq(wsz);
+        for(size_t i(0); i < 20000; ++i) {
+            if(i % 5000 == 4999) qm.reset(), mq.reset();
+            const u64 el(mt() % 50); // Small range, so that windows hold repeats.
+            REQUIRE(mq.next_value(el, el * 7 % 11) == qm.next_value(el, el * 7 % 11));
+        }
+    }
+}
+TEST_CASE("Windowed canonical for_each matches next_canonicalized_minimizer") {
+    gzFile fp(gzopen("test/phix.fa", "rb"));
+    kseq_t *ks(kseq_init(fp));
+    REQUIRE(kseq_read(ks) >= 0);
+    std::string seq(ks->seq.s, ks->seq.l);
+    kseq_destroy(ks);
+    gzclose(fp);
+    for(const size_t pos: {0u, 17u, 400u, 401u, 2000u, 5385u}) seq[pos] = 'N';
+    for(const unsigned w: {32u, 50u, 100u}) {
+        Spacer sp(31, w);
+        EncType enc(sp, true), ref(sp, true);
+        std::vector<u64> rolled, expected;
+        enc.for_each([&](u64 min) {rolled.push_back(min);}, seq.data(), seq.size());
+        ref.assign(seq.data(), seq.size());
+        for(u64 min; ref.has_next_kmer();)
+            if((min = ref.next_canonicalized_minimizer()) != BF) expected.push_back(min);
+        REQUIRE(rolled == expected);
+    }
+}
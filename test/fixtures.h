@@ -0,0 +1,138 @@
+#pragma once
+#include "test/catch.hpp"
+#include "classifier.h"
+#include <unistd.h>
+
+// Fixtures shared by the classification tests: phiX, databases labeling its k-mers by position,
+// small taxonomies, reads in memory or in scratch files.
+namespace fixtures {
+using namespace bns;
+
+// The phiX genome from test/phix.fa.
+inline std::string load_phix() {
+    gzFile fp(gzopen("test/phix.fa", "rb"));
+    REQUIRE(fp);
+    kseq_t *ks(kseq_init(fp));
+    REQUIRE(kseq_read(ks) >= 0);
+    std::string ret(ks->seq.s, ks->seq.l);
+    kseq_destroy(ks);
+    gzclose(fp);
+    return ret;
+}
+
+// Adds the k-mers of genome (usually phiX; window minimizers if w > 31) to db, or to a new database. The genome is
+// split into as many equal parts as split has taxa, and each k-mer is labeled by its part. A k-mer keeps its first label.
+template<typename ScoreType=score::Lex>
+khash_t(c) *phix_db(const std::string &genome, std::initializer_list<tax_t> split, unsigned w=31, bool canon=true,
+                    khash_t(c) *db=nullptr) {
+    if(db == nullptr) db = kh_init(c);
+    Encoder<ScoreType> enc(Spacer(31, w, nullptr), canon);
+    const std::vector<tax_t> taxa(split);
+    int khr;
+    size_t pos(0);
+    enc.for_each([&](u64 kmer) {
+        khint_t ki(kh_put(c, db, kmer, &khr));
+        if(khr) kh_val(db, ki) = taxa[pos * taxa.size() / genome.size()];
+        ++pos;
+    }, genome.data(), genome.size());
+    return db;
+}
+
+// A taxonomy from {taxon, parent} pairs, with 0 as the root's parent.
+inline khash_t(p) *make_taxmap(std::initializer_list<std::pair<tax_t, tax_t>> parents) {
+    khash_t(p) *ret(kh_init(p));
+    int khr;
+    for(const auto &pair: parents) {
+        khint_t ki(kh_put(p, ret, pair.first, &khr));
+        kh_val(ret, ki) = pair.second;
+    }
+    return ret;
+}
+
+// A read of minlen to maxlen - 1 bases from a random position in genome.
+inline std::string phix_read(const std::string &genome, std::mt19937_64 &mt, unsigned minlen=50, unsigned maxlen=150) {
+    return genome.substr(mt() % (genome.size() - maxlen), minlen + mt() % (maxlen - minlen));
+}
+
+// Replaces every base of seq with a random one. Such reads mostly go unclassified.
+inline void randomize(std::string &seq, std::mt19937_64 &mt) {
+    for(auto &c: seq) c = "ACGT"[mt() & 3];
+}
+
+// n reads from phix_read, of which every seventh is randomized.
+inline std::vector<std::string> phix_reads(const std::string &genome, unsigned n, std::mt19937_64 &mt) {
+    std::vector<std::string> ret;
+    for(unsigned i(0); i < n; ++i) {
+        ret.push_back(phix_read(genome, mt));
+        if(i % 7 == 0) randomize(ret.back(), mt);
+    }
+    return ret;
+}
+
+// Reads named read0, read1, ... as classify_seqs takes them; the records point into the strings held here.
+struct Reads {
+    std::vector<std::string> names_, seqs_;
+    std::vector<bseq1_t>     bs_;
+    Reads() = default;
+    Reads(Reads &&) = default;
+    Reads(const Reads &) = delete;
+    bseq1_t *data() {return bs_.data();}
+    bseq1_t &operator[](size_t i) {return bs_[i];}
+    unsigned size() const {return bs_.size();}
+};
+inline Reads make_reads(std::vector<std::string> seqs) {
+    Reads ret;
+    ret.seqs_ = std::move(seqs);
+    ret.bs_.resize(ret.seqs_.size());
+    for(unsigned i(0); i < ret.seqs_.size(); ++i) ret.names_.push_back("read" + std::to_string(i));
+    for(unsigned i(0); i < ret.seqs_.size(); ++i) {
+        std::memset(&ret.bs_[i], 0, sizeof(ret.bs_[i]));
+        ret.bs_[i].name  = &ret.names_[i][0];
+        ret.bs_[i].seq   = &ret.seqs_[i][0];
+        ret.bs_[i].l_seq = ret.seqs_[i].size();
+    }
+    return ret;
+}
+
+// Everything written to fp, which is closed.
+inline std::string slurp(std::FILE *fp) {
+    std::string ret(std::ftell(fp), '\0');
+    std::rewind(fp);
+    REQUIRE(std::fread(&ret[0], 1, ret.size(), fp) == ret.size());
+    std::fclose(fp);
+    return ret;
+}
+
+// A scratch file with a unique name in the working directory, removed when it goes out of scope, so that a failed
+// REQUIRE does not leave it behind.
+class TempFile {
+    std::string path_;
+public:
+    TempFile(): path_("__zomg__XXXXXX") {
+        const int fd(::mkstemp(&path_[0]));
+        REQUIRE(fd >= 0);
+        ::close(fd);
+    }
+    TempFile(const TempFile &) = delete;
+    ~TempFile() {std::remove(path_.data());}
+    const char *path() const {return path_.data();}
+};
+
+// Writes seqs to path as FASTA records named prefix0, prefix1, ..., each name followed by suffix.
+inline void write_fasta(const char *path, const std::vector<std::string> &seqs, const char *prefix="read",
+                        const char *suffix="") {
+    std::FILE *ofp(std::fopen(path, "w"));
+    REQUIRE(ofp);
+    for(unsigned i(0); i < seqs.size(); ++i) std::fprintf(ofp, ">%s%u%s\n%s\n", prefix, i, suffix, seqs[i].data());
+    std::fclose(ofp);
+}
+
+// What process_dataset writes for the reads in path1, paired with path2 if given.
+template<typename ClassifierType>
+std::string classify_file(ClassifierType &c, const TaxonomyIndex &tax, const char *path1, const char *path2=nullptr) {
+    std::FILE *ofp(std::tmpfile());
+    process_dataset(c, tax, path1, path2, ofp, 4096);
+    return slurp(ofp);
+}
+
+} // namespace fixtures
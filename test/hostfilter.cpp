@@ -0,0 +1,85 @@
+#include "test/catch.hpp"
+#include "classifier.h"
+#include "test/fixtures.h"
+using namespace bns;
+using namespace fixtures;
+
+namespace {
+std::string first_record(const char *path) {
+    gzFile fp(gzopen(path, "rb"));
+    kseq_t *ks(kseq_init(fp));
+    REQUIRE(kseq_read(ks) >= 0);
+    const std::string ret(ks->seq.s, ks->seq.l);
+    kseq_destroy(ks);
+    gzclose(fp);
+    return ret;
+}
+}
+
+TEST_CASE("Host filters are written and mapped, and keep every host k-mer") {
+    const std::string host(first_record("test/phix.fa"));
+    const HostFilter filter(std::vector<std::string>{"test/phix.fa"}, 31, spvec_t(30));
+    REQUIRE(filter.k() == 31);
+    REQUIRE(filter.nkmers() == host.size() - 30);
+    TempFile hf;
+    filter.write(hf.path());
+    {
+        const HostFilter mapped(hf.path());
+        REQUIRE(mapped.nkmers() == filter.nkmers());
+        REQUIRE(mapped.nbytes() == filter.nbytes());
+        Encoder<score::Lex> enc(mapped.enc_);
+        enc.for_each([&](u64 kmer) {REQUIRE(mapped.may_contain(kmer));}, host.data(), host.size());
+        std::mt19937_64 mt(3);
+        size_t npassed(0);
+        for(size_t i(0); i < 100000; ++i) npassed += mapped.may_contain(mt() >> 2);
+        REQUIRE(npassed < 100000 / 20);
+    }
+}
+
+TEST_CASE("Host reads are screened out before classification and written separately") {
+    const std::string host(first_record("test/phix.fa")), genome(first_record("test/GCF_000302455.1_ASM30245v1_genomic.fna.gz"));
+    const HostFilter filter(std::vector<std::string>{"test/phix.fa"}, 31, spvec_t(30));
+    khash_t(c) *db(phix_db(genome, {10}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}}));
+    const TaxonomyIndex tax(taxmap);
+
+    // One read in three from the host, each with a substitution, which leaves over half their k-mers intact.
+    std::mt19937_64 mt(11);
+    const unsigned nreads(600);
+    std::vector<std::string> sequences;
+    unsigned nhost(0);
+    for(unsigned i(0); i < nreads; ++i) {
+        const bool is_host(i % 3 == 0);
+        std::string seq(phix_read(is_host ? host: genome, mt, 100, 150));
+        if(is_host) {
+            char &base(seq[mt() % seq.size()]);
+            base = base == 'A' ? 'C': 'A';
+        }
+        nhost += is_host;
+        sequences.push_back(std::move(seq));
+    }
+    Reads seqs(make_reads(std::move(sequences)));
+    Classifier c(db, spvec_t(30), 31, 31, 2, true, false, true);
+    ForPool pool(c.nt_);
+    ks::string unscreened(256u);
+    classify_seqs(c, tax, seqs.data(), unscreened, nreads, 0, pool);
+
+    c.set_host_filter(&filter);
+    ClassifyArena<score::Lex> arena(c);
+    ks::string out(256u), hout(256u);
+    classify_seqs(c, tax, seqs.data(), out, nreads, 0, pool, arena, &hout);
+    REQUIRE(c.n_screened_reads() == nreads);
+    REQUIRE(c.n_host_reads() == nhost);
+    // Other reads are classified as they would be without screening.
+    std::string expected;
+    for(const char *p(unscreened.data()), *e(p + unscreened.size()); p < e;) {
+        const char *eol(std::find(p, e, '\n') + 1);
+        if(std::strtoul(std::strchr(p, '\t') + 5, nullptr, 10) % 3) expected.append(p, eol); // Past "\tread".
+        p = eol;
+    }
+    REQUIRE(std::string(out.data(), out.size()) == expected);
+    REQUIRE(size_t(std::count(hout.begin(), hout.end(), '>')) == nhost);
+    REQUIRE(std::string(hout.data(), hout.size()).find(">read0\n" + seqs.seqs_[0] + "\n") == 0);
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
@@ -0,0 +1,96 @@
+#include "test/catch.hpp"
+#include "classifier.h"
+#include "test/fixtures.h"
+using namespace bns;
+using namespace fixtures;
+
+TEST_CASE("Low-quality bases are masked") {
+    std::mt19937_64 mt(31);
+    for(size_t len(0); len < 200; ++len) {
+        std::string seq, qual;
+        for(size_t i(0); i < len; ++i) seq.push_back("ACGT"[mt() & 3]), qual.push_back(char(33 + mt() % 42));
+        std::string masked(seq);
+        const size_t nmasked(mask_low_quality(&masked[0], qual.data(), len, 20));
+        size_t expected(0);
+        for(size_t i(0); i < len; ++i) {
+            REQUIRE(masked[i] == (qual[i] - 33 < 20 ? 'N': seq[i]));
+            expected += qual[i] - 33 < 20;
+        }
+        REQUIRE(nmasked == expected);
+    }
+}
+
+TEST_CASE("Low-complexity windows are masked by their DUST score") {
+    std::mt19937_64 mt(37);
+    auto random_seq = [&](size_t len) {
+        std::string ret;
+        for(size_t i(0); i < len; ++i) ret.push_back("ACGT"[mt() & 3]);
+        return ret;
+    };
+    auto repeat = [](const char *unit, size_t len) {
+        std::string ret;
+        while(ret.size() < len) ret += unit;
+        ret.resize(len);
+        return ret;
+    };
+    std::string seq(random_seq(1000));
+    REQUIRE(mask_low_complexity(&seq[0], seq.size()) == 0);
+    const std::string flank(random_seq(200));
+    seq = flank + repeat("A", 100) + flank;
+    const size_t nmasked(mask_low_complexity(&seq[0], seq.size()));
+    REQUIRE(nmasked >= 100);
+    REQUIRE(nmasked < 100 + 2 * DUST_WINDOW);
+    REQUIRE(seq.substr(200, 100) == repeat("N", 100));
+    REQUIRE(seq.substr(0, 100) == flank.substr(0, 100));
+    // Dinucleotide repeats score ~15, trinucleotide repeats ~10.
+    for(const char *unit: {"AC", "CAG"}) {
+        seq = repeat(unit, 100);
+        REQUIRE(mask_low_complexity(&seq[0], seq.size()) == 0);
+        REQUIRE(mask_low_complexity(&seq[0], seq.size(), 9) == 100);
+    }
+    // An N restarts the window, so no window of 64 fits in either half.
+    seq = repeat("A", 60) + "N" + repeat("A", 60);
+    REQUIRE(mask_low_complexity(&seq[0], seq.size()) == 0);
+}
+
+TEST_CASE("Masked k-mers are not looked up and count as ambiguous") {
+    const std::string genome(load_phix());
+
+    khash_t(c) *db(phix_db(genome, {10}));
+    // A homopolymer run in the database: it would hit without masking.
+    const std::string poly(80, 'A');
+    phix_db(poly, {11}, 31, true, db);
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+    const TaxonomyIndex tax(taxmap);
+    Classifier c(db, spvec_t(30), 31, 31, 1, true, false, true);
+    ClassifyWorker<score::Lex> w(c.enc_);
+
+    std::string seq(genome.substr(1000, 100)), qual(100, 'I'), name("read");
+    std::fill(qual.begin() + 40, qual.begin() + 60, '#'); // Phred 2
+    bseq1_t bs;
+    std::memset(&bs, 0, sizeof(bs));
+    bs.name = &name[0], bs.seq = &seq[0], bs.qual = &qual[0], bs.l_seq = seq.size();
+    ks::string out(256u);
+    classify_seq(c, w, tax, &bs, 0, out);
+    REQUIRE(std::string(out.data(), out.size()) == "C\tread\t10\t100\t10:70\n");
+    c.set_min_quality(10);
+    out.clear();
+    classify_seq(c, w, tax, &bs, 0, out);
+    // The 20 masked bases leave no k-mer from position 10 to 59.
+    REQUIRE(std::string(out.data(), out.size()) == "C\tread\t10\t100\tA:50\t10:20\n");
+    REQUIRE(w.nmasked_[0] == 20);
+    REQUIRE(seq == genome.substr(1000, 100));
+
+    seq = genome.substr(2000, 50) + poly + genome.substr(3000, 50);
+    bs.seq = &seq[0], bs.qual = nullptr, bs.l_seq = seq.size();
+    out.clear();
+    classify_seq(c, w, tax, &bs, 0, out);
+    REQUIRE(std::string(out.data(), out.size()).find("\t11:") != std::string::npos);
+    c.set_dust_threshold(20);
+    out.clear();
+    classify_seq(c, w, tax, &bs, 0, out);
+    REQUIRE(std::string(out.data(), out.size()).find("\t11:") == std::string::npos);
+    REQUIRE(w.nmasked_[1] >= poly.size());
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
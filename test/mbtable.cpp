@@ -0,0 +1,96 @@
+#include "test/catch.hpp"
+#include "database.h"
+#include "classifier.h"
+using namespace bns;
+
+TEST_CASE("MinimizerBinTable finds exactly the stored keys, with or without a bin cache") {
+    khash_t(c) *th(kh_init(c));
+    std::mt19937_64 mt(19);
+    int khr;
+    const u32 k(31);
+    // Overlapping k-mers, as from reads, so that runs share a minimizer.
+    std::vector<u64> kmers;
+    u64 kmer(mt() & ((u64(1) << (2 * k)) - 1));
+    for(size_t i(0); i < 100000; ++i) {
+        kmer = ((kmer << 2) | (mt() & 3)) & ((u64(1) << (2 * k)) - 1);
+        kmers.push_back(kmer);
+        if(mt() % 3) {
+            khint_t ki(kh_put(c, th, kmer, &khr));
+            kh_val(th, ki) = 1 + mt() % 1000;
+        }
+    }
+    // Minimizers of up to 16 bases are computed with AVX2 if available, longer ones without.
+    for(const u32 l: {13u, 21u}) {
+        const MinimizerBinTable mb(MinimizerBinTable::from_khash(th, k, l));
+        REQUIRE(mb.size() == kh_size(th));
+        REQUIRE(mb.nbins() == kh_size(th) / MinimizerBinTable::BIN_KEYS);
+        MinimizerBinTable::bin_cache_t cache;
+        size_t nloads(0);
+        for(const u64 kmer: kmers) {
+            const khiter_t ki(kh_get(c, th, kmer));
+            const tax_t expected(ki == kh_end(th) ? 0: kh_val(th, ki));
+            REQUIRE(mb.minimizer(kmer) == mb.minimizer(reverse_complement(kmer, k)));
+            nloads += mb.minimizer(kmer) != cache.minimizer_;
+            REQUIRE(mb.get(kmer, cache) == expected);
+            REQUIRE(mb.get(kmer) == expected);
+        }
+        // Runs of up to k - l + 1 k-mers share a minimizer.
+        REQUIRE(nloads < kmers.size() / 3);
+        for(size_t i(0); i < 100000; ++i) {
+            const u64 key(mt() & ((u64(1) << (2 * k)) - 1));
+            if(kh_get(c, th, key) == kh_end(th)) REQUIRE(mb.get(key) == 0);
+        }
+        size_t ncounted(0);
+        mb.for_each_taxon([&](tax_t) {++ncounted;});
+        REQUIRE(ncounted == mb.size());
+    }
+    // Views of mapped tables bound l as from_khash does: minimizers of 32 bases do not fit their mask.
+    const u64 offsets[] {0, 0};
+    REQUIRE_THROWS(MinimizerBinTable(offsets, 1, nullptr, nullptr, 0, 32, 32));
+    REQUIRE_NOTHROW(MinimizerBinTable(offsets, 1, nullptr, nullptr, 0, 32, 31));
+    kh_destroy(c, th);
+}
+
+TEST_CASE("Binned databases are written, mapped and queried without the hash table") {
+    khash_t(c) *th(kh_init(c));
+    std::mt19937_64 mt(23);
+    int khr;
+    for(size_t i(0); i < 50000; ++i) {
+        khint_t ki(kh_put(c, th, mt() >> 2, &khr));
+        kh_val(th, ki) = 1 + mt() % 100;
+    }
+    Spacer sp(31, 31, nullptr);
+    {
+        Database<khash_t(c)> db(sp, 0, th);
+        db.write_mmap("__zomg__.mmdb", false, 10., 0., 15);
+    }
+    {
+        Database<khash_t(c)> db("__zomg__.mmdb");
+        REQUIRE(db.db_ == nullptr);
+        REQUIRE(db.cht_.empty());
+        REQUIRE(db.mbt_.size() == kh_size(th));
+        REQUIRE(db.mbt_.l() == 15);
+        const MinimizerBinTable mb(MinimizerBinTable::from_khash(th, 31, 15));
+        REQUIRE(db.mbt_.nbytes() == mb.nbytes());
+        REQUIRE(std::memcmp(db.mbt_.keys(), mb.keys(), mb.size() * sizeof(u64)) == 0);
+        ClassifierGeneric<score::Lex> c(db.db_, db.s_, db.k_, db.w_, 1);
+        c.set_table(&db.mbt_);
+        c.set_filter(&db.bf_);
+        std::vector<u64> keys;
+        for(khiter_t ki(0); ki != kh_end(th); ++ki) if(kh_exist(th, ki)) keys.push_back(kh_key(th, ki));
+        for(size_t i(0); i < 50000; ++i) keys.push_back(mt() >> 2);
+        std::vector<tax_t> batched;
+        // Ranges of different lengths, as classify_seq looks up reads and windows.
+        for(size_t beg(0), len(1); beg < keys.size(); beg += len, len = len % 200 + 7)
+            c.lookup_batch(keys.data(), beg, std::min(beg + len, keys.size()), keys.size(), [&](tax_t tax) {batched.push_back(tax);});
+        REQUIRE(batched.size() == keys.size());
+        for(size_t i(0); i < keys.size(); ++i) {
+            const khiter_t ki(kh_get(c, th, keys[i]));
+            REQUIRE(batched[i] == (ki == kh_end(th) ? 0: kh_val(th, ki)));
+            REQUIRE(batched[i] == c.lookup(keys[i]));
+        }
+        for(const u64 key: keys) c.prefetch(key); // With no hash table to fall back to.
+    }
+    REQUIRE(system("rm __zomg__.mmdb") == 0);
+    kh_destroy(c, th);
+}
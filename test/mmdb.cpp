@@ -0,0 +1,57 @@
+#include "test/catch.hpp"
+#include "database.h"
+using namespace bns;
+
+TEST_CASE("mmdb round-trips a lookup table") {
+    khash_t(c) *th(kh_init(c));
+    khint_t ki;
+    int khr;
+    for(size_t i(0); i < 1 << 12; ++i) {
+        ki = kh_put(c, th, (i << 14) | (i + 2), &khr);
+        kh_val(th, ki) = i + 1;
+    }
+    Spacer sp(31, 31, nullptr);
+    {
+        Database<khash_t(c)> db(sp, 1, th);
+        db.write_mmap("__zomg__.mmdb");
+    }
+    REQUIRE(MMapDB::is_mmdb("__zomg__.mmdb"));
+    {
+        Database<khash_t(c)> db("__zomg__.mmdb");
+        REQUIRE(db.mm_);
+        REQUIRE(db.k_ == 31);
+        REQUIRE(db.w_ == 31);
+        REQUIRE(db.s_ == spvec_t(30));
+        REQUIRE(kh_size(db.db_) == 1u << 12);
+        for(size_t i(0); i < 1 << 12; ++i) {
+            ki = kh_get(c, db.db_, (i << 14) | (i + 2));
+            REQUIRE(ki != kh_end(db.db_));
+            REQUIRE(kh_val(db.db_, ki) == i + 1);
+        }
+        REQUIRE(kh_get(c, db.db_, UINT64_C(-1)) == kh_end(db.db_));
+    }
+    REQUIRE(system("rm __zomg__.mmdb") == 0);
+}
+
+TEST_CASE("Databases record the scheme that chose their minimizers") {
+    Spacer sp(31, 50, nullptr);
+    for(const score_scheme scheme: {LEX, ENTROPY, FEATURE_COUNT}) {
+        {
+            Database<khash_t(c)> db(sp, 1, kh_init(c));
+            int khr;
+            const khint_t ki(kh_put(c, db.db_, 137, &khr));
+            kh_val(db.db_, ki) = 4;
+            db.score_ = scheme;
+            db.write("__zomg__.db");
+            db.write_mmap("__zomg__.mmdb");
+        }
+        for(const char *path: {"__zomg__.db", "__zomg__.mmdb"}) {
+            Database<khash_t(c)> db(path);
+            REQUIRE(db.score_ == scheme);
+            REQUIRE(db.k_ == 31);
+            REQUIRE(db.w_ == 50);
+            REQUIRE(kh_size(db.db_) == 1);
+        }
+    }
+    REQUIRE(system("rm __zomg__.db __zomg__.mmdb") == 0);
+}
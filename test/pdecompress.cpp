@@ -0,0 +1,106 @@
+#include "test/catch.hpp"
+#include "classifier.h"
+#include "pdecompress.h"
+#include "test/fixtures.h"
+#include <sys/stat.h>
+using namespace bns;
+using namespace fixtures;
+
+namespace {
+
+// Writes data as BGZF blocks of at most bsize uncompressed bytes, followed by the empty EOF block.
+void write_bgzf(const std::string &data, const char *path, size_t bsize) {
+    std::FILE *fp(std::fopen(path, "wb"));
+    REQUIRE(fp);
+    for(size_t i(0);; i += bsize) {
+        const size_t l(i < data.size() ? std::min(bsize, data.size() - i): 0);
+        std::vector<u8> out(18 + compressBound(l) + 8);
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        REQUIRE(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+        zs.next_in   = (Bytef *)data.data() + i;
+        zs.avail_in  = l;
+        zs.next_out  = out.data() + 18;
+        zs.avail_out = out.size() - 26;
+        REQUIRE(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+        const size_t total(18 + zs.total_out + 8);
+        deflateEnd(&zs);
+        static const u8 hdr[] {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0};
+        std::memcpy(out.data(), hdr, sizeof(hdr));
+        out[16] = (total - 1) & 0xFF, out[17] = (total - 1) >> 8;
+        const u32 crc(crc32(crc32(0, nullptr, 0), (const Bytef *)data.data() + i, l));
+        for(int j(0); j < 4; ++j) out[total - 8 + j] = crc >> (8 * j), out[total - 4 + j] = l >> (8 * j);
+        REQUIRE(std::fwrite(out.data(), 1, total, fp) == total);
+        if(l == 0) break;
+    }
+    std::fclose(fp);
+}
+
+std::vector<std::string> read_all(const char *path, unsigned nthreads) {
+    std::unique_ptr<ParallelDecompressor> dec;
+    gzFile fp(gzopen_parallel(path, nthreads, dec));
+    REQUIRE(fp);
+    kseq_t *ks(kseq_init(fp));
+    std::vector<std::string> ret;
+    while(kseq_read(ks) >= 0) ret.emplace_back(std::string(ks->name.s) + ':' + ks->seq.s + ':' + ks->qual.s);
+    kseq_destroy(ks);
+    gzclose(fp);
+    if(dec) dec->finish();
+    return ret;
+}
+
+} // anonymous namespace
+
+TEST_CASE("Parallel BGZF decompression yields the same records") {
+    std::mt19937_64 mt(7);
+    std::string fq;
+    for(size_t i(0); i < 20000; ++i) {
+        std::string seq(50 + mt() % 200, 'A');
+        for(auto &c: seq) c = "ACGT"[mt() & 3];
+        fq += "@read" + std::to_string(i) + '\n' + seq + "\n+\n" + std::string(seq.size(), 'I') + '\n';
+    }
+    TempFile plain, bgzf, fifo, trunc;
+    {
+        std::FILE *fp(std::fopen(plain.path(), "wb"));
+        std::fwrite(fq.data(), 1, fq.size(), fp);
+        std::fclose(fp);
+    }
+    write_bgzf(fq, bgzf.path(), 65280);
+    REQUIRE(detect_input_format(bgzf.path()) == INPUT_BGZF);
+    REQUIRE(detect_input_format(plain.path()) == INPUT_OTHER);
+    // Named pipes are not read, which would block here and lose the bytes read.
+    std::remove(fifo.path());
+    REQUIRE(::mkfifo(fifo.path(), 0600) == 0);
+    REQUIRE(detect_input_format(fifo.path()) == INPUT_OTHER);
+    const auto expected(read_all(plain.path(), 1));
+    REQUIRE(expected.size() == 20000);
+    REQUIRE(read_all(bgzf.path(), 1) == expected);
+    REQUIRE(read_all(bgzf.path(), 4) == expected);
+    write_bgzf(fq, bgzf.path(), 1000); // Many more blocks than one batch holds.
+    REQUIRE(read_all(bgzf.path(), 3) == expected);
+    REQUIRE(std::system(("head -c 100000 " + std::string(bgzf.path()) + " > " + trunc.path()).data()) == 0);
+    REQUIRE_THROWS(read_all(trunc.path(), 4));
+}
+
+TEST_CASE("A write error while classifying parallel-decompressed input is reported, not waited on") {
+    // Enough input that the decompressor fills the socket to the reader well before the end.
+    std::mt19937_64 mt(13);
+    std::string fq;
+    for(size_t i(0); i < 100000; ++i) {
+        std::string seq(150, 'A');
+        for(auto &c: seq) c = "ACGT"[mt() & 3];
+        fq += "@read" + std::to_string(i) + '\n' + seq + "\n+\n" + std::string(seq.size(), 'I') + '\n';
+    }
+    TempFile bgzf;
+    write_bgzf(fq, bgzf.path(), 60000);
+    khash_t(c) *db(kh_init(c));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}}));
+    const TaxonomyIndex tax(taxmap);
+    Classifier c(db, spvec_t(30), 31, 31, 1, true, false, true);
+    std::FILE *ofp(std::fopen("/dev/full", "w"));
+    REQUIRE(ofp);
+    REQUIRE_THROWS_WITH(process_dataset(c, tax, bgzf.path(), nullptr, ofp, 1 << 16, 2), Catch::Contains("Could not write"));
+    std::fclose(ofp);
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
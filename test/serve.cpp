@@ -0,0 +1,102 @@
+#include "test/catch.hpp"
+#include <fcntl.h>
+#include "serve.h"
+#include "test/fixtures.h"
+using namespace bns;
+using namespace fixtures;
+
+TEST_CASE("The server classifies files and streamed reads as classify does, and reports failed jobs") {
+    const std::string genome(load_phix());
+
+    khash_t(c) *db(phix_db(genome, {10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+    const TaxonomyIndex tax(taxmap);
+
+    std::mt19937_64 mt(43);
+    TempFile reads, sock;
+    write_fasta(reads.path(), phix_reads(genome, 3000, mt));
+    std::remove(sock.path()); // The server makes the socket there.
+    Classifier c(db, spvec_t(30), 31, 31, 2, true, false, true);
+    const std::string expected(classify_file(c, tax, reads.path()));
+    const u64 nclassified(c.n_classified());
+
+    std::unique_ptr<char, decltype(&std::free)> path(::realpath(reads.path(), nullptr), &std::free);
+    REQUIRE(path);
+    {
+        // Small chunks, so that jobs take turns.
+        ClassifyServer<score::Lex> server(c, tax, sock.path(), 4096);
+        std::thread serving([&] {server.serve();});
+        std::FILE *ofp(std::tmpfile());
+        REQUIRE(query_server(sock.path(), std::string("CLASSIFY ") + path.get(), ofp) ==
+                "Classified " + std::to_string(nclassified) + " of 3000 reads.");
+        REQUIRE(slurp(ofp) == expected);
+        // Streamed and file jobs at once.
+        std::string streamed, filed;
+        std::thread other([&] {
+            std::FILE *ofp(std::tmpfile());
+            query_server(sock.path(), std::string("CLASSIFY ") + path.get(), ofp);
+            filed = slurp(ofp);
+        });
+        const int sfd(::open(reads.path(), O_RDONLY));
+        REQUIRE(sfd >= 0);
+        ofp = std::tmpfile();
+        query_server(sock.path(), "STREAM", ofp, sfd);
+        ::close(sfd);
+        streamed = slurp(ofp);
+        other.join();
+        REQUIRE(streamed == expected);
+        REQUIRE(filed == expected);
+        ofp = std::tmpfile();
+        REQUIRE_THROWS_WITH(query_server(sock.path(), "CLASSIFY /no/such/reads.fa", ofp), Catch::Contains("/no/such/reads.fa"));
+        REQUIRE_THROWS_WITH(query_server(sock.path(), "FOO", ofp), Catch::Contains("Unknown request"));
+        std::fclose(ofp);
+        REQUIRE(query_server(sock.path(), "SHUTDOWN", stdout) == "Shutting down.");
+        serving.join();
+    }
+    REQUIRE(connect_unix(sock.path()) < 0);
+    // A file given in place of the socket, such as the reads or the database, is not removed.
+    REQUIRE_THROWS_WITH(ClassifyServer<score::Lex>(c, tax, reads.path()), Catch::Contains("not a socket"));
+    struct stat st;
+    REQUIRE(::stat(reads.path(), &st) == 0);
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
+
+TEST_CASE("Stopping the server ends connections whose clients send nothing more") {
+    const std::string genome(load_phix());
+
+    khash_t(c) *db(phix_db(genome, {10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+    const TaxonomyIndex tax(taxmap);
+    Classifier c(db, spvec_t(30), 31, 31, 1, true, false, true);
+    TempFile sock;
+    std::remove(sock.path());
+    {
+        ClassifyServer<score::Lex> server(c, tax, sock.path());
+        std::thread serving([&] {server.serve();});
+        // One client sends no request, the other starts a stream with one read and leaves it open.
+        const int idle(connect_unix(sock.path())), streaming(connect_unix(sock.path()));
+        REQUIRE(idle >= 0);
+        REQUIRE(streaming >= 0);
+        const std::string request("STREAM\n>read0\n" + genome.substr(0, 100) + "\n");
+        send_all(streaming, request.data(), request.size());
+        REQUIRE(query_server(sock.path(), "SHUTDOWN", stdout) == "Shutting down.");
+        serving.join();
+        char type;
+        std::string payload;
+        REQUIRE(recv_frame(idle, type, payload));
+        REQUIRE(type == SERVE_ERROR);
+        // The stream ends with the read it was sent.
+        std::string out;
+        while(recv_frame(streaming, type, payload) && type == SERVE_DATA) out += payload;
+        REQUIRE(type == SERVE_DONE);
+        REQUIRE(payload == "Classified 1 of 1 reads.");
+        REQUIRE(out.find("C\tread0\t10\t") == 0);
+        ::close(idle);
+        ::close(streaming);
+    }
+    // The client's message gives the reason it could not connect.
+    REQUIRE_THROWS_WITH(query_server(sock.path(), "SHUTDOWN", stdout), Catch::Contains(std::strerror(ENOENT)));
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
@@ -0,0 +1,101 @@
+#include "test/catch.hpp"
+#include <future>
+#include "stream.h"
+#include "test/fixtures.h"
+using namespace bns;
+using namespace fixtures;
+
+TEST_CASE("StreamReader hands out reads as they arrive, and parses them as kseq does") {
+    std::mt19937_64 mt(47);
+    std::string text;
+    for(unsigned i(0); i < 500; ++i) {
+        std::string seq(50 + mt() % 200, 'A');
+        for(auto &c: seq) c = "ACGTN"[mt() % 5];
+        std::string qual(seq.size(), 'I');
+        for(auto &c: qual) c = char(33 + mt() % 40);
+        // Some records wrap their sequence and qualities, and some have comments or CRLF line ends.
+        const std::string eol(i % 11 == 0 ? "\r\n": "\n");
+        text += "@read" + std::to_string(i) + (i % 3 ? "": " some comment") + eol;
+        if(i % 5 == 0) text += seq.substr(0, 40) + eol + seq.substr(40) + eol + "+" + eol + qual.substr(0, 40) + eol + qual.substr(40) + eol;
+        else           text += seq + eol + "+" + eol + qual + eol;
+    }
+    TempFile fq, fqgz;
+    {
+        std::FILE *fp(std::fopen(fq.path(), "w"));
+        REQUIRE(fp);
+        std::fwrite(text.data(), 1, text.size(), fp);
+        std::fclose(fp);
+        REQUIRE(std::system(("gzip -c " + std::string(fq.path()) + " > " + fqgz.path()).data()) == 0);
+    }
+    std::vector<std::array<std::string, 4>> expected;
+    gzFile gfp(gzopen(fq.path(), "rb"));
+    kseq_t *ks(kseq_init(gfp));
+    while(kseq_read(ks) >= 0)
+        expected.push_back({std::string(ks->name.s), ks->comment.l ? std::string(ks->comment.s): "", std::string(ks->seq.s), std::string(ks->qual.s)});
+    kseq_destroy(ks);
+    gzclose(gfp);
+    REQUIRE(expected.size() == 500);
+
+    for(const char *path: {fq.path(), fqgz.path()}) {
+        std::string data;
+        {
+            std::ifstream ifs(path, std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        }
+        int fds[2];
+        REQUIRE(::pipe(fds) == 0);
+        // The writer sends a first part, then waits until the reader has had a batch out of it.
+        std::promise<void> got_first;
+        bool written(true); // Catch assertions are for the main thread.
+        std::thread writer([&, fd=fds[1]] {
+            const size_t first(data.size() / 10);
+            written = ::write(fd, data.data(), first) == ssize_t(first);
+            got_first.get_future().wait();
+            for(size_t off(first); written && off < data.size();) {
+                const ssize_t n(::write(fd, data.data() + off, std::min(data.size() - off, size_t(4096))));
+                written = n > 0;
+                off += n;
+            }
+            ::close(fd);
+        });
+        std::vector<std::array<std::string, 4>> got;
+        {
+            StreamReader reader(fds[0], true, 64);
+            std::vector<bseq1_t> batch;
+            StreamReader::clock::time_point arrival;
+            size_t nbatches(0);
+            for(size_t n; (n = reader.next_batch(batch, 1000, std::chrono::milliseconds(20), arrival)) > 0; ++nbatches) {
+                // Fewer reads than asked for: the batch was handed out on the timeout, before the rest was sent.
+                if(nbatches == 0) {
+                    REQUIRE(n < expected.size());
+                    got_first.set_value();
+                }
+                for(const auto &rec: batch)
+                    got.push_back({rec.name, rec.comment ? rec.comment: "", std::string(rec.seq, rec.l_seq), rec.qual ? rec.qual: ""});
+            }
+            for(auto &rec: batch) bseq_destroy(&rec);
+        }
+        writer.join();
+        REQUIRE(written);
+        REQUIRE(got == expected);
+    }
+}
+
+TEST_CASE("Stream mode writes what classify writes, batch by batch") {
+    const std::string genome(load_phix());
+
+    khash_t(c) *db(phix_db(genome, {10, 11}));
+    khash_t(p) *taxmap(make_taxmap({{1, 0}, {10, 1}, {11, 1}}));
+    const TaxonomyIndex tax(taxmap);
+
+    std::mt19937_64 mt(53);
+    TempFile reads;
+    write_fasta(reads.path(), phix_reads(genome, 2000, mt));
+    Classifier c(db, spvec_t(30), 31, 31, 2, true, false, true);
+    const std::string expected(classify_file(c, tax, reads.path()));
+    std::FILE *ofp(std::tmpfile());
+    process_stream(c, tax, reads.path(), ofp, 100, 10);
+    REQUIRE(slurp(ofp) == expected);
+    kh_destroy(p, taxmap);
+    kh_destroy(c, db);
+}
@@ -0,0 +1,92 @@
+#include "test/catch.hpp"
+#include "taxindex.h"
+using namespace bns;
+
+namespace {
+
+// Random forest: 1 is the root, a few other roots hang off 0, and every other node's parent was added before it.
+khash_t(p) *random_taxonomy(std::mt19937_64 &mt, size_t n, tax_t idscale, std::vector<tax_t> &ids) {
+    khash_t(p) *ret(kh_init(p));
+    int khr;
+    khint_t ki;
+    ids.assign(1, 1);
+    ki = kh_put(p, ret, 1, &khr), kh_val(ret, ki) = 0;
+    while(ids.size() < n) {
+        const tax_t id(2 + mt() % (idscale * n));
+        if(kh_get(p, ret, id) != kh_end(ret)) continue;
+        ki = kh_put(p, ret, id, &khr);
+        kh_val(ret, ki) = mt() % 100 == 0 ? 0: ids[mt() % ids.size()];
+        ids.push_back(id);
+    }
+    return ret;
+}
+
+} // anonymous namespace
+
+TEST_CASE("TaxonomyIndex matches hash-based lca, node_depth and resolve_tree") {
+    std::mt19937_64 mt(42);
+    for(const tax_t idscale: {2u, 100000u}) { // Direct taxid table, then a hash table.
+        std::vector<tax_t> ids;
+        khash_t(p) *taxmap(random_taxonomy(mt, 3000, idscale, ids));
+        TaxonomyIndex tax(taxmap);
+        REQUIRE(tax.size() == ids.size());
+        for(const tax_t id: ids) REQUIRE(tax.node_depth(id) == node_depth(taxmap, id));
+        for(size_t i(0); i < 100000; ++i) {
+            const tax_t a(ids[mt() % ids.size()]), b(ids[mt() % ids.size()]);
+            REQUIRE(tax.lca(a, b) == lca(taxmap, a, b));
+        }
+        REQUIRE(tax.lca(ids[5], 0) == ids[5]);
+        std::vector<u32> dense;
+        for(size_t i(0); i < 20000; ++i) {
+            linear::counter<tax_t, u16> counts;
+            // Draw from a small subtree-heavy pool so that paths overlap and ties occur.
+            for(size_t j(0), n(1 + mt() % 20); j < n; ++j) counts.add(ids[mt() % std::min(ids.size(), size_t(1) + mt() % 200)], 1 + mt() % 3);
+            REQUIRE(resolve_tree(counts, tax, dense) == resolve_tree(counts, taxmap));
+        }
+        kh_destroy(p, taxmap);
+    }
+}
+
+TEST_CASE("TaxonomyIndex handles missing parents and cycles") {
+    khash_t(p) *taxmap(kh_init(p));
+    int khr;
+    khint_t ki;
+    for(const auto &pair: {std::make_pair(1u, 0u), std::make_pair(2u, 1u), std::make_pair(3u, 2u), std::make_pair(4u, 2u),
+                           std::make_pair(5u, 99u), std::make_pair(6u, 5u), std::make_pair(7u, 8u), std::make_pair(8u, 7u)})
+        ki = kh_put(p, taxmap, pair.first, &khr), kh_val(taxmap, ki) = pair.second;
+    TaxonomyIndex tax(taxmap);
+    REQUIRE(tax.size() == 8);
+    REQUIRE(tax.lca(3, 4) == 2);
+    REQUIRE(tax.lca(3, 2) == 2);
+    REQUIRE(tax.lca(6, 5) == 5);
+    REQUIRE(tax.lca(6, 3) == 1); // Different trees.
+    REQUIRE(tax.lca(7, 3) == 1);
+    REQUIRE(tax.node_depth(3) == 3);
+    REQUIRE(tax.node_depth(6) == 2);
+    REQUIRE(tax.lca(3, 12345) == tax_t(-1));
+    REQUIRE(tax.lca(12345, 3) == tax_t(-1)); // Warned about once, above.
+    kh_destroy(p, taxmap);
+}
+
+TEST_CASE("CladeSet holds exactly the subtrees of its taxa") {
+    std::mt19937_64 mt(7);
+    std::vector<tax_t> ids;
+    khash_t(p) *taxmap(random_taxonomy(mt, 3000, 100000u, ids));
+    const TaxonomyIndex tax(taxmap);
+    for(unsigned trial(0); trial < 20; ++trial) {
+        std::vector<tax_t> clades;
+        for(unsigned i(0), n(1 + mt() % 4); i < n; clades.push_back(ids[mt() % ids.size()]), ++i);
+        const CladeSet set(tax, clades, trial & 1);
+        for(const tax_t id: ids) {
+            // Walks up the hash-based taxonomy to see whether id lies under any of the clades.
+            bool under(false);
+            for(tax_t node(id); node && !under; node = kh_val(taxmap, kh_get(p, taxmap, node)))
+                under = std::find(clades.begin(), clades.end(), node) != clades.end();
+            REQUIRE(set.contains(tax, id) == under);
+        }
+        REQUIRE(set.contains(tax, 0) == bool(trial & 1));
+        REQUIRE(!set.contains(tax, 1 + 100000u * 3000));
+    }
+    REQUIRE_THROWS(CladeSet(tax, {1 + 100000u * 3000}));
+    kh_destroy(p, taxmap);
+}